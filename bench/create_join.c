@@ -0,0 +1,82 @@
+﻿/**
+	Create and join latency benchmark for the Cross Platform C11 Native Threads library
+
+	Times thrd_create followed by thrd_join of a thread that returns at once, with plain OS threads, then with recycled ones (thrd_recycle).
+
+	Under Linux, from the root of the repository:
+		gcc -O2 bench/create_join.c threads.c futex.c topology.c -o create_join.out -pthread
+		./create_join.out [iterations]
+*/
+#include "../threads.h"
+
+#include <stdio.h>  /* For printf(), fprintf() */
+#include <stdlib.h> /* For atoi() */
+
+/* Default number of create+join pairs per mode, after as many warm-up pairs */
+#define BENCH_ITERATIONS 20000
+
+
+
+static int bench_noop(void* arg) {
+	(void) arg;
+	return 0;
+}
+
+
+
+static long long bench_now(void) {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+/**
+ * Returns the mean create+join latency in nanoseconds, -1 if a call failed
+ */
+static double bench_create_join(int iterations) {
+	long long start = 0;
+	for (int i = -iterations; i < iterations; ++i) {
+		if (i == 0) {
+			start = bench_now();
+		}
+
+		thrd_t thr;
+		int res = -1;
+		if (thrd_create(&thr, bench_noop, NULL) != thrd_success || thrd_join(thr, &res) != thrd_success || res != 0) {
+			return -1;
+		}
+	}
+	return (double) (bench_now() - start) / iterations;
+}
+
+
+
+int main(int argc, char* argv[]) {
+	int iterations = (argc > 1) ? atoi(argv[1]) : BENCH_ITERATIONS;
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	double plain = bench_create_join(iterations);
+
+	/* One idle thread is enough: each thread is joined before the next one is created */
+	if (thrd_recycle(1) != thrd_success) {
+		fprintf(stderr, "thrd_recycle is not supported\n");
+		return 1;
+	}
+	double recycled = bench_create_join(iterations);
+	thrd_recycle(0);
+
+	if (plain < 0 || recycled < 0) {
+		fprintf(stderr, "thrd_create or thrd_join failed\n");
+		return 1;
+	}
+
+	printf("mode       create+join\n");
+	printf("plain      %8.2f us\n", plain / 1000);
+	printf("recycled   %8.2f us\n", recycled / 1000);
+	return 0;
+}
@@ -0,0 +1,224 @@
+﻿/**
+	NUMA stack and TLS latency benchmark for the Cross Platform C11 Native Threads library
+
+	Threads are created with thrd_attr_setnode on each node, and pinned to the CPUs of the first node with thrd_attr_setaffinity:
+	their stack (and the static TLS glibc places at its top) is local for the first node, remote for the others.
+	Each thread times a pointer chase through an array on its stack and through a thread-local array.
+	Then detached node threads are created in a loop, to check that the stacks of the finished ones are unmapped.
+	On a machine with a single NUMA node only the local latency and the detached threads are run.
+
+	Under Linux, from the root of the repository:
+		gcc -O2 bench/numa_stack.c threads.c futex.c topology.c -o numa_stack.out -pthread
+		./numa_stack.out
+*/
+#include "../threads.h"
+#include "../topology.h"
+
+#include <stdio.h>  /* For printf(), fprintf(), fopen(), fgets(), fclose() */
+#include <string.h> /* For strchr() */
+#include <time.h>   /* For clock_gettime() */
+
+/* Stack of the measuring threads, and the part of it that is chased through */
+#define BENCH_STACK_SIZE (96u << 20)
+#define BENCH_STACK_CHASE (64u << 20)
+
+/* Thread-local array chased through, part of the static TLS of every thread of the process */
+#define BENCH_TLS_CHASE (8u << 20)
+
+/* Loads timed per array, one per cache line in a random cycle */
+#define BENCH_LOADS (1u << 22)
+#define BENCH_LINE (64 / sizeof(size_t))
+
+/* Detached node threads created by the unmapping check */
+#define BENCH_DETACHED 1000
+
+static _Thread_local size_t bench_tls[BENCH_TLS_CHASE / sizeof(size_t)];
+
+
+
+/**
+ * Result of a measuring thread, in nanoseconds per load
+ */
+typedef struct {
+	double stack;
+	double tls;
+} bench_result_t;
+
+
+
+static long long bench_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+/**
+ * Links the cache lines of chain in one random cycle (Sattolo's algorithm) and returns the time per load of a walk through it
+ */
+static double bench_chase(size_t* chain, size_t words) {
+	size_t lines = words / BENCH_LINE;
+	for (size_t i = 0; i < lines; ++i) {
+		chain[i * BENCH_LINE] = i * BENCH_LINE;
+	}
+
+	unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+	for (size_t i = lines - 1; i > 0; --i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		size_t j = (size_t) (seed % i);
+		size_t swap = chain[i * BENCH_LINE];
+		chain[i * BENCH_LINE] = chain[j * BENCH_LINE];
+		chain[j * BENCH_LINE] = swap;
+	}
+
+	size_t index = 0;
+	long long start = bench_now();
+	for (unsigned int i = 0; i < BENCH_LOADS; ++i) {
+		index = *(volatile size_t*) &chain[index];
+	}
+	return (double) (bench_now() - start) / BENCH_LOADS;
+}
+
+
+
+static int bench_measure(void* arg) {
+	bench_result_t* result = (bench_result_t*) arg;
+	size_t chain[BENCH_STACK_CHASE / sizeof(size_t)];
+	result->stack = bench_chase(chain, sizeof(chain) / sizeof(size_t));
+	result->tls = bench_chase(bench_tls, sizeof(bench_tls) / sizeof(size_t));
+	return 0;
+}
+
+
+
+static int bench_noop(void* arg) {
+	(void) arg;
+	return 0;
+}
+
+
+
+/**
+ * Returns the number of mappings of the process, -1 if /proc is not there
+ */
+static int bench_mappings(void) {
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (maps == NULL) {
+		return -1;
+	}
+
+	int count = 0;
+	char line[512];
+	while (fgets(line, sizeof(line), maps) != NULL) {
+		if (strchr(line, '\n') != NULL) {
+			++count;
+		}
+	}
+	fclose(maps);
+	return count;
+}
+
+
+
+/**
+ * Runs bench_measure with its stack on node and the CPUs of cpuset, returns thrd_success or thrd_error
+ */
+static int bench_node(int node, const thrd_cpuset_t* cpuset, __OUT__ bench_result_t* result) {
+	thrd_attr_t attr;
+	thrd_attr_init(&attr);
+	thrd_attr_setnode(&attr, node);
+	thrd_attr_setaffinity(&attr, cpuset);
+	thrd_attr_setstacksize(&attr, BENCH_STACK_SIZE);
+
+	thrd_t thr;
+	if (thrd_create_ex(&thr, &attr, bench_measure, result) != thrd_success) {
+		return thrd_error;
+	}
+	return thrd_join(thr, NULL);
+}
+
+
+
+/**
+ * Creates detached threads on node, each creation unmapping the stacks of the finished ones, and puts the growth of the mappings to growth
+ */
+static int bench_detached(int node, __OUT__ int* growth) {
+	thrd_attr_t attr;
+	thrd_attr_init(&attr);
+	thrd_attr_setnode(&attr, node);
+
+	int before = bench_mappings();
+	for (int i = 0; i < BENCH_DETACHED; ++i) {
+		thrd_t thr;
+		if (thrd_create_ex(&thr, &attr, bench_noop, NULL) != thrd_success || thrd_detach(thr) != thrd_success) {
+			return thrd_error;
+		}
+	}
+
+	/* The last detached threads are given time to finish, then the creation of a joined thread reaps them */
+	struct timespec pause = { 0, 50000000 };
+	thrd_sleep(&pause, NULL);
+	thrd_t thr;
+	if (thrd_create_ex(&thr, &attr, bench_noop, NULL) != thrd_success || thrd_join(thr, NULL) != thrd_success) {
+		return thrd_error;
+	}
+	*growth = bench_mappings() - before;
+	return thrd_success;
+}
+
+
+
+int main(void) {
+	const topo_t* topo = topo_get();
+	if (topo == NULL) {
+		fprintf(stderr, "topo_get failed\n");
+		return 1;
+	}
+
+	/* The threads run on the first node that has CPUs */
+	int home = -1;
+	thrd_cpuset_t cpuset;
+	for (int node = 0; home < 0 && node < topo->node_count; ++node) {
+		if (topo_cpuset(topo_node, node, &cpuset) == thrd_success && thrd_cpuset_count(&cpuset) > 0) {
+			home = node;
+		}
+	}
+	if (home < 0) {
+		fprintf(stderr, "no NUMA node with CPUs\n");
+		return 1;
+	}
+
+	printf("threads on node %d\n", home);
+	printf("stack node  stack chase  TLS chase\n");
+	int remote = 0;
+	for (int node = 0; node < topo->node_count; ++node) {
+		thrd_cpuset_t cpus;
+		if (topo_cpuset(topo_node, node, &cpus) != thrd_success || thrd_cpuset_count(&cpus) == 0) {
+			continue;
+		}
+
+		bench_result_t result;
+		if (bench_node(node, &cpuset, &result) != thrd_success) {
+			fprintf(stderr, "thread on node %d failed\n", node);
+			return 1;
+		}
+		printf("%10d  %8.1f ns  %6.1f ns  %s\n", node, result.stack, result.tls, (node == home) ? "local" : "remote");
+		remote |= (node != home);
+	}
+	if (!remote) {
+		printf("single NUMA node, remote latency skipped\n");
+	}
+
+	int growth = 0;
+	if (bench_detached(home, &growth) != thrd_success) {
+		fprintf(stderr, "detached threads failed\n");
+		return 1;
+	}
+	if (bench_mappings() >= 0) {
+		printf("%d detached node threads, mappings grew by %d\n", BENCH_DETACHED, growth);
+	}
+	return 0;
+}
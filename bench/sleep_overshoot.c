@@ -0,0 +1,107 @@
+﻿/**
+	thrd_sleep overshoot benchmark for the Cross Platform C11 Native Threads library
+
+	Sleeps of 5 us and 100 us, with the default timer slack, with a 1 ns timer slack (thrd_set_timerslack),
+	and in precise mode (thrd_set_sleep_spin). Prints the mean overshoot, the share of sleeps that overshoot by less than 5 us,
+	and a histogram of the overshoots.
+
+	Under Linux, from the root of the repository:
+		gcc -O2 bench/sleep_overshoot.c threads.c futex.c topology.c -o sleep_overshoot.out -pthread
+		./sleep_overshoot.out [sleeps]
+*/
+#include "../threads.h"
+
+#include <stdio.h>  /* For printf(), fprintf(), snprintf() */
+#include <stdlib.h> /* For atoi() */
+#include <time.h>   /* For clock_gettime() */
+
+/* Default number of sleeps per row */
+#define BENCH_SLEEPS 2000
+
+/* Upper bounds of the histogram buckets in nanoseconds, the last bucket takes everything above */
+static const long bench_buckets[] = { 1000, 5000, 10000, 50000, 100000 };
+#define BENCH_BUCKET_COUNT (sizeof(bench_buckets) / sizeof(bench_buckets[0]) + 1)
+
+
+
+static long long bench_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+/**
+ * Sleeps sleeps times for nanoseconds and prints one row, returns -1 if thrd_sleep failed
+ */
+static int bench_row(const char* mode, long nanoseconds, int sleeps) {
+	struct timespec duration = { 0, nanoseconds };
+	unsigned int histogram[BENCH_BUCKET_COUNT] = { 0 };
+	long long total = 0;
+	int under = 0;
+
+	for (int i = 0; i < sleeps; ++i) {
+		long long start = bench_now();
+		if (thrd_sleep(&duration, NULL) != 0) {
+			return -1;
+		}
+		long long overshoot = bench_now() - start - nanoseconds;
+
+		total += overshoot;
+		if (overshoot < 5000) {
+			++under;
+		}
+		unsigned int bucket = 0;
+		while (bucket < BENCH_BUCKET_COUNT - 1 && overshoot >= bench_buckets[bucket]) {
+			++bucket;
+		}
+		++histogram[bucket];
+	}
+
+	printf("%-12s %4ld us  %+9.1f us  %5.1f%%  ", mode, nanoseconds / 1000, (double) total / sleeps / 1000, 100.0 * under / sleeps);
+	for (unsigned int bucket = 0; bucket < BENCH_BUCKET_COUNT; ++bucket) {
+		printf(" %7u", histogram[bucket]);
+	}
+	printf("\n");
+	return 0;
+}
+
+
+
+int main(int argc, char* argv[]) {
+	int sleeps = (argc > 1) ? atoi(argv[1]) : BENCH_SLEEPS;
+	if (sleeps <= 0) {
+		fprintf(stderr, "usage: %s [sleeps]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-12s %7s  %12s  %7s  ", "mode", "sleep", "overshoot", "< 5 us");
+	for (unsigned int bucket = 0; bucket < BENCH_BUCKET_COUNT - 1; ++bucket) {
+		char label[32];
+		snprintf(label, sizeof(label), "<%ld us", bench_buckets[bucket] / 1000);
+		printf(" %7s", label);
+	}
+	printf(" %7s\n", "more");
+
+	int failed = 0;
+	failed |= bench_row("default", 5000, sleeps);
+	failed |= bench_row("default", 100000, sleeps);
+
+	if (thrd_set_timerslack(1) == thrd_success) {
+		failed |= bench_row("slack=1ns", 5000, sleeps);
+		failed |= bench_row("slack=1ns", 100000, sleeps);
+		thrd_set_timerslack(0);
+	}
+
+	thrd_set_sleep_spin(60000);
+	failed |= bench_row("spin=60us", 5000, sleeps);
+	failed |= bench_row("spin=60us", 100000, sleeps);
+	thrd_set_sleep_spin(0);
+
+	if (failed) {
+		fprintf(stderr, "thrd_sleep failed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,315 @@
+﻿/**
+	Work-stealing scaling benchmark for the Cross Platform C11 Native Threads library
+
+	Fork-join fib, n-queens and quicksort on pools of 1, 2, 4... up to N workers, spawned through task groups:
+	every spawn from a task is a push on the Chase-Lev deque of its worker, and the other workers only get work by stealing.
+	Each result is checked against a sequential computation, so the program also serves as a check of the deques
+	when built with -fsanitize=address or -fsanitize=thread. It returns 1 on a wrong result.
+
+	Under Linux, from the root of the repository:
+		gcc -O2 bench/tpool_scaling.c threads.c futex.c topology.c tpool.c -o tpool_scaling.out -pthread
+		./tpool_scaling.out [max workers] [fib n] [queens n] [sort size]
+*/
+#include "../tpool.h"
+#include "../topology.h"
+
+#include <stdio.h>  /* For printf(), fprintf() */
+#include <stdlib.h> /* For atoi(), malloc(), free(), qsort() */
+#include <time.h>   /* For clock_gettime() */
+
+/* Default problem sizes: fib(30) spawns about 1.3 million tasks */
+#define BENCH_FIB 30
+#define BENCH_QUEENS 12
+#define BENCH_SORT (1 << 22)
+
+/* Rows of the board placed by tasks, the rows below are searched sequentially */
+#define BENCH_QUEENS_SPAWN 4
+
+/* Subarrays smaller than this are sorted sequentially */
+#define BENCH_SORT_CUTOFF 2048
+
+/* Pool the tasks spawn to, the one being measured */
+static tpool_t bench_pool;
+
+
+
+static long long bench_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+/**
+ * fib: fib(n - 1) is spawned and fib(n - 2) computed by the task itself, without sequential cut-off so that every inner call is a task
+ */
+typedef struct {
+	int n;
+	long long result;
+} bench_fib_t;
+
+
+
+static long long bench_fib_seq(int n) {
+	return (n < 2) ? n : bench_fib_seq(n - 1) + bench_fib_seq(n - 2);
+}
+
+
+
+static void bench_fib(void* arg) {
+	bench_fib_t* fib = (bench_fib_t*) arg;
+	if (fib->n < 2) {
+		fib->result = fib->n;
+		return;
+	}
+
+	bench_fib_t left = { fib->n - 1, 0 };
+	bench_fib_t right = { fib->n - 2, 0 };
+	tpool_group_t group;
+	tpool_group_init(&group, bench_pool);
+	tpool_group_spawn(&group, bench_fib, &left);
+	bench_fib(&right);
+	tpool_group_wait(&group);
+	fib->result = left.result + right.result;
+}
+
+
+
+/**
+ * n-queens: a task per queen placed on the first BENCH_QUEENS_SPAWN rows, bit masks of the attacked columns and diagonals
+ */
+typedef struct {
+	int n;
+	int row;
+	unsigned int columns;
+	unsigned int left;
+	unsigned int right;
+	long long result;
+} bench_queens_t;
+
+
+
+static long long bench_queens_seq(int n, int row, unsigned int columns, unsigned int left, unsigned int right) {
+	if (row == n) {
+		return 1;
+	}
+
+	long long count = 0;
+	unsigned int free = ~(columns | left | right) & ((1u << n) - 1);
+	while (free != 0) {
+		unsigned int bit = free & -free;
+		free ^= bit;
+		count += bench_queens_seq(n, row + 1, columns | bit, (left | bit) << 1, (right | bit) >> 1);
+	}
+	return count;
+}
+
+
+
+static void bench_queens(void* arg) {
+	bench_queens_t* queens = (bench_queens_t*) arg;
+	if (queens->row >= BENCH_QUEENS_SPAWN || queens->row == queens->n) {
+		queens->result = bench_queens_seq(queens->n, queens->row, queens->columns, queens->left, queens->right);
+		return;
+	}
+
+	bench_queens_t children[32];
+	int count = 0;
+	tpool_group_t group;
+	tpool_group_init(&group, bench_pool);
+	unsigned int free = ~(queens->columns | queens->left | queens->right) & ((1u << queens->n) - 1);
+	while (free != 0) {
+		unsigned int bit = free & -free;
+		free ^= bit;
+		bench_queens_t child = { queens->n, queens->row + 1, queens->columns | bit, (queens->left | bit) << 1, (queens->right | bit) >> 1, 0 };
+		children[count] = child;
+		tpool_group_spawn(&group, bench_queens, &children[count]);
+		++count;
+	}
+	tpool_group_wait(&group);
+
+	queens->result = 0;
+	for (int i = 0; i < count; ++i) {
+		queens->result += children[i].result;
+	}
+}
+
+
+
+/**
+ * quicksort: the lower part is spawned and the upper part sorted by the task itself
+ */
+typedef struct {
+	int* data;
+	size_t count;
+} bench_sort_t;
+
+
+
+static int bench_compare(const void* a, const void* b) {
+	int x = *(const int*) a;
+	int y = *(const int*) b;
+	return (x > y) - (x < y);
+}
+
+
+
+static void bench_sort(void* arg) {
+	bench_sort_t* sort = (bench_sort_t*) arg;
+	int* data = sort->data;
+	size_t count = sort->count;
+	if (count < BENCH_SORT_CUTOFF) {
+		qsort(data, count, sizeof(int), bench_compare);
+		return;
+	}
+
+	/* Hoare partition around the median of three */
+	int a = data[0];
+	int b = data[count / 2];
+	int c = data[count - 1];
+	int pivot = (a < b) ? ((b < c) ? b : (a < c) ? c : a) : ((a < c) ? a : (b < c) ? c : b);
+	size_t i = 0;
+	size_t j = count - 1;
+	for (;;) {
+		while (data[i] < pivot) {
+			++i;
+		}
+		while (data[j] > pivot) {
+			--j;
+		}
+		if (i >= j) {
+			break;
+		}
+		int swap = data[i];
+		data[i] = data[j];
+		data[j] = swap;
+		++i;
+		--j;
+	}
+
+	bench_sort_t lower = { data, j + 1 };
+	bench_sort_t upper = { data + j + 1, count - j - 1 };
+	tpool_group_t group;
+	tpool_group_init(&group, bench_pool);
+	tpool_group_spawn(&group, bench_sort, &lower);
+	bench_sort(&upper);
+	tpool_group_wait(&group);
+}
+
+
+
+/**
+ * Runs the root task on the pool and returns its time in milliseconds
+ */
+static double bench_run(tpool_func_t func, void* arg) {
+	long long start = bench_now();
+	tpool_submit(bench_pool, func, arg);
+	tpool_wait(bench_pool);
+	return (double) (bench_now() - start) / 1000000;
+}
+
+
+
+static void bench_fill(int* data, size_t count) {
+	unsigned int seed = 2463534242u;
+	for (size_t i = 0; i < count; ++i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		data[i] = (int) (seed >> 1);
+	}
+}
+
+
+
+int main(int argc, char* argv[]) {
+	unsigned int max = (argc > 1) ? (unsigned int) atoi(argv[1]) : thrd_hardware_concurrency();
+	int fib_n = (argc > 2) ? atoi(argv[2]) : BENCH_FIB;
+	int queens_n = (argc > 3) ? atoi(argv[3]) : BENCH_QUEENS;
+	size_t sort_count = (argc > 4) ? (size_t) atoi(argv[4]) : BENCH_SORT;
+	if (max == 0 || fib_n < 0 || queens_n < 1 || queens_n > 16 || sort_count == 0) {
+		fprintf(stderr, "usage: %s [max workers] [fib n] [queens n] [sort size]\n", argv[0]);
+		return 1;
+	}
+
+	int* data = (int*) malloc(sort_count * sizeof(int));
+	int* expected = (int*) malloc(sort_count * sizeof(int));
+	if (data == NULL || expected == NULL) {
+		fprintf(stderr, "insufficient memory\n");
+		return 1;
+	}
+	bench_fill(expected, sort_count);
+	qsort(expected, sort_count, sizeof(int), bench_compare);
+	long long fib_expected = bench_fib_seq(fib_n);
+	long long queens_expected = bench_queens_seq(queens_n, 0, 0, 0, 0);
+
+	printf("fib(%d), %d-queens, quicksort of %zu ints\n", fib_n, queens_n, sort_count);
+	printf("workers  threads   fib ms  speedup  queens ms  speedup  sort ms  speedup\n");
+
+	double base[3] = { 0, 0, 0 };
+	int failed = 0;
+	for (unsigned int workers = 1; workers <= max; workers = (workers < max && workers * 2 > max) ? max : workers * 2) {
+		tpool_attr_t attr;
+		tpool_attr_init(&attr);
+		tpool_attr_setworkers(&attr, workers);
+
+		/* Spare workers as in the shared pool: a fork-join wait must not be taken for a blocked worker and start them */
+		tpool_attr_setblocking(&attr, workers);
+		if (tpool_create(&bench_pool, &attr) != thrd_success) {
+			fprintf(stderr, "tpool_create failed\n");
+			return 1;
+		}
+
+		double time[3];
+		bench_fib_t fib = { fib_n, 0 };
+		time[0] = bench_run(bench_fib, &fib);
+
+		bench_queens_t queens = { queens_n, 0, 0, 0, 0, 0 };
+		time[1] = bench_run(bench_queens, &queens);
+
+		bench_fill(data, sort_count);
+		bench_sort_t sort = { data, sort_count };
+		time[2] = bench_run(bench_sort, &sort);
+
+		/* The fork-join waits run tasks or poll instead of blocking, the pool never needs more threads than its workers */
+		unsigned int threads = tpool_live(bench_pool);
+		tpool_destroy(bench_pool);
+
+		if (fib.result != fib_expected) {
+			fprintf(stderr, "fib(%d): %lld instead of %lld\n", fib_n, fib.result, fib_expected);
+			failed = 1;
+		}
+		if (queens.result != queens_expected) {
+			fprintf(stderr, "%d-queens: %lld instead of %lld\n", queens_n, queens.result, queens_expected);
+			failed = 1;
+		}
+		for (size_t i = 0; i < sort_count; ++i) {
+			if (data[i] != expected[i]) {
+				fprintf(stderr, "quicksort: wrong value at %zu\n", i);
+				failed = 1;
+				break;
+			}
+		}
+		if (threads > workers) {
+			fprintf(stderr, "%u threads for %u workers\n", threads, workers);
+			failed = 1;
+		}
+
+		if (workers == 1) {
+			base[0] = time[0];
+			base[1] = time[1];
+			base[2] = time[2];
+		}
+		printf("%7u  %7u  %7.1f  %6.2fx  %9.1f  %6.2fx  %7.1f  %6.2fx\n", workers, threads,
+			time[0], base[0] / time[0], time[1], base[1] / time[1], time[2], base[2] / time[2]);
+
+		if (workers == max) {
+			break;
+		}
+	}
+
+	free(data);
+	free(expected);
+	return failed;
+}
@@ -0,0 +1,91 @@
+﻿/**
+	Futex helpers for the Cross Platform C11 Native Threads library
+
+	Linux:
+		http://man7.org/linux/man-pages/man2/futex.2.html
+	Windows:
+		https://docs.microsoft.com/en-us/windows/win32/api/synchapi/nf-synchapi-waitonaddress
+*/
+#include "futex.h"
+
+#ifdef __linux__
+	#include <linux/futex.h>	/* For FUTEX_WAIT_BITSET */
+	#include <sys/syscall.h>	/* For SYS_futex */
+	#include <unistd.h>			/* For syscall() */
+#elif defined(__unix__)
+	#include <sched.h>			/* For sched_yield() */
+#endif /* __linux__ */
+
+#include <errno.h>  /* For errno */
+#include <limits.h> /* For INT_MAX */
+
+
+
+int futex_wait(atomic_int* addr, int expected, const struct timespec* deadline) {
+	#ifdef __linux__
+		/* FUTEX_WAIT_BITSET takes an absolute timeout, FUTEX_CLOCK_REALTIME makes it a TIME_UTC one */
+		long value = syscall(
+			SYS_futex,
+			(int*) addr,
+			FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+			expected,
+			deadline,
+			NULL,
+			FUTEX_BITSET_MATCH_ANY
+		);
+
+		/* EAGAIN: *addr != expected, EINTR: signal, both are reported as a wake-up */
+		if (value != 0 && errno == ETIMEDOUT) {
+			return thrd_timedout;
+		}
+	#elif defined(__unix__)
+		if (atomic_load_explicit(addr, memory_order_relaxed) == expected) {
+			if (deadline != NULL) {
+				struct timespec now;
+				timespec_get(&now, TIME_UTC);
+				if (now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec)) {
+					return thrd_timedout;
+				}
+			}
+			sched_yield();
+		}
+	#endif /* __linux__ */
+
+	#ifdef _WIN32
+		DWORD milliseconds = INFINITE;
+		if (deadline != NULL) {
+			struct timespec now;
+			timespec_get(&now, TIME_UTC);
+			long long remaining = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+			if (remaining <= 0) {
+				return thrd_timedout;
+			}
+			milliseconds = (remaining >= INFINITE) ? INFINITE - 1 : (DWORD) remaining;
+		}
+
+		if (!WaitOnAddress((volatile VOID*) addr, &expected, sizeof(expected), milliseconds) && GetLastError() == ERROR_TIMEOUT) {
+			return thrd_timedout;
+		}
+	#endif /* _WIN32 */
+
+	return thrd_success;
+}
+
+
+
+void futex_wake(atomic_int* addr, int count) {
+	#ifdef __linux__
+		syscall(SYS_futex, (int*) addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+	#elif defined(__unix__)
+		(void) addr;
+		(void) count;
+	#endif /* __linux__ */
+
+	#ifdef _WIN32
+		if (count == 1) {
+			WakeByAddressSingle((PVOID) addr);
+		} else {
+			WakeByAddressAll((PVOID) addr);
+		}
+	#endif /* _WIN32 */
+}
@@ -0,0 +1,38 @@
+﻿#ifndef C11_THREADS_FUTEX_HEADER
+#define C11_THREADS_FUTEX_HEADER
+
+#include "threads.h"
+#include <stdatomic.h>
+#include <time.h>
+
+
+
+/**
+ * Futex helpers shared by the library, wait/wake on the address of a 32 bits atomic integer.
+ * Linux uses the futex system call, Windows uses WaitOnAddress (link with Synchronization.lib).
+ * Other Posix systems fall back to sched_yield() polling.
+ */
+
+
+
+/**
+ * Blocks the calling thread while *addr is equal to expected. Spurious wake-ups are possible, callers must check their condition again.
+ *
+ * @param addr			address of the atomic integer to wait on
+ * @param expected		value that *addr must have for the thread to sleep
+ * @param deadline		absolute TIME_UTC deadline, NULL to wait without time limit
+ * @return				thrd_success if woken up or *addr differs from expected, thrd_timedout if deadline has passed
+ */
+int futex_wait(atomic_int* addr, int expected, const struct timespec* deadline);
+
+
+
+/**
+ * Wakes up to count threads blocked in futex_wait on addr.
+ *
+ * @param addr			address of the atomic integer
+ * @param count			maximal number of threads to wake up, INT_MAX for all
+ */
+void futex_wake(atomic_int* addr, int count);
+
+#endif /* C11_THREADS_FUTEX_HEADER */
@@ -0,0 +1,429 @@
+﻿/**
+	Futures for the Cross Platform C11 Native Threads library
+*/
+#include "future.h"
+#include "futex.h"
+
+#include <errno.h>  /* For errno */
+#include <limits.h> /* For INT_MAX */
+#include <stdint.h> /* For uintptr_t */
+#include <stdlib.h> /* For malloc(), free() */
+
+
+
+/**
+ * State word enum, fut_waiting is combined with the other values
+ *
+ * fut_pending		the value is not set
+ * fut_ready		the value is set and can be read
+ * fut_waiting		a consumer sleeps, or is about to sleep, on the word
+ * fut_setting		a producer won the right to set the value and is writing it
+ */
+enum {
+	fut_pending = 0,
+	fut_ready   = 1 << 0,
+	fut_waiting = 1 << 1,
+	fut_setting = 1 << 2
+};
+
+
+
+/**
+ * Role enum of a future, telling what its links do when the futures they are registered on are set
+ *
+ * fut_role_plain	created by fut_create, no link
+ * fut_role_then	one link, the continuation is submitted with the value it follows. Also used by fut_async, without link
+ * fut_role_all		one link per future, the last one to be set sets this future
+ * fut_role_any		one link per future, the first one to be set sets this future
+ */
+enum {
+	fut_role_plain,
+	fut_role_then,
+	fut_role_all,
+	fut_role_any
+};
+
+
+
+/**
+ * Registration of a future on another one, allocated with the future it belongs to
+ *
+ * next			next registration on the same future, the list is a lock-free stack
+ * owner		future the link belongs to, it holds a reference on it until it is notified
+ * index		rank of the link in the array of its owner
+ */
+struct fut_link {
+	struct fut_link* next;
+	struct fut_state* owner;
+	unsigned int index;
+};
+
+
+
+/**
+ * Shared state of a future, fut_t points to it. The links of the future live at its end, in the same allocation
+ *
+ * state		state word, see fut_pending
+ * references	number of references, the state is released with the last one
+ * links		links registered on this future, &fut_closed once its value is set
+ * input		value the continuation of a fut_then future is run with
+ * remaining	number of futures not set yet, for fut_when_all
+ */
+struct fut_state {
+	atomic_int state;
+	atomic_int references;
+	void* value;
+	_Atomic(struct fut_link*) links;
+
+	int role;
+	tpool_t pool;
+	fut_func_t func;
+	void* arg;
+	void* input;
+	atomic_uint remaining;
+	unsigned int count;
+	struct fut_link link[];
+};
+
+
+
+static int fut_complete(struct fut_state* fut, void* value);
+
+
+
+/* End of the link list of a future whose value is set, a link pushed after that would never be notified */
+static struct fut_link fut_closed;
+
+
+
+/**
+ * Allocates a pending future with count links and the given number of references, returns NULL if there is insufficient amount of memory
+ */
+static struct fut_state* fut_alloc(int role, unsigned int count, int references) {
+	struct fut_state* fut = (struct fut_state*) malloc(sizeof(struct fut_state) + count * sizeof(struct fut_link));
+	if (fut == NULL) {
+		return NULL;
+	}
+
+	atomic_init(&fut->state, fut_pending);
+	atomic_init(&fut->references, references);
+	fut->value = NULL;
+	atomic_init(&fut->links, NULL);
+	fut->role = role;
+	fut->pool = NULL;
+	fut->func = NULL;
+	fut->arg = NULL;
+	fut->input = NULL;
+	atomic_init(&fut->remaining, count);
+	fut->count = count;
+
+	for (unsigned int i = 0; i < count; ++i) {
+		fut->link[i].next = NULL;
+		fut->link[i].owner = fut;
+		fut->link[i].index = i;
+	}
+	return fut;
+}
+
+
+
+/**
+ * Runs the continuation of a fut_then or fut_async future, then drops the reference of its link
+ */
+static void fut_continue(void* param) {
+	struct fut_state* fut = (struct fut_state*) param;
+	fut_complete(fut, fut->func(fut->input, fut->arg));
+	fut_release(fut);
+}
+
+
+
+/**
+ * Tells the owner of a link that the future it is registered on has been set to value
+ */
+static void fut_notify(struct fut_link* link, void* value) {
+	struct fut_state* owner = link->owner;
+	switch (owner->role) {
+		case fut_role_then:
+			owner->input = value;
+			if (owner->pool == NULL || tpool_submit(owner->pool, fut_continue, owner) != thrd_success) {
+				fut_continue(owner);
+			}
+			return;
+
+		case fut_role_all:
+			if (atomic_fetch_sub_explicit(&owner->remaining, 1, memory_order_acq_rel) == 1) {
+				fut_complete(owner, NULL);
+			}
+			break;
+
+		case fut_role_any:
+			/* Only the first one wins, the others find the value set */
+			fut_complete(owner, (void*) (uintptr_t) link->index);
+			break;
+	}
+	fut_release(owner);
+}
+
+
+
+/**
+ * Registers link on fut, or notifies it right away if the value of fut is already set
+ */
+static void fut_register(struct fut_state* fut, struct fut_link* link) {
+	struct fut_link* head = atomic_load_explicit(&fut->links, memory_order_acquire);
+	for (;;) {
+		if (head == &fut_closed) {
+			fut_notify(link, fut->value);
+			return;
+		}
+
+		link->next = head;
+		if (atomic_compare_exchange_weak_explicit(&fut->links, &head, link, memory_order_release, memory_order_acquire)) {
+			return;
+		}
+	}
+}
+
+
+
+int fut_create(__OUT__ fut_t* fut) {
+	struct fut_state* state = fut_alloc(fut_role_plain, 0, 1);
+
+	/* ERROR: No memory for the future */
+	if (state == NULL) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	*fut = state;
+	return thrd_success;
+}
+
+
+
+void fut_retain(fut_t fut) {
+	atomic_fetch_add_explicit(&fut->references, 1, memory_order_relaxed);
+}
+
+
+
+void fut_release(fut_t fut) {
+	if (atomic_fetch_sub_explicit(&fut->references, 1, memory_order_acq_rel) != 1) {
+		return;
+	}
+
+	/* Never set: the owners of the links registered on it will not be notified, their references are dropped */
+	struct fut_link* link = atomic_load_explicit(&fut->links, memory_order_acquire);
+	if (link != &fut_closed) {
+		while (link != NULL) {
+			struct fut_link* next = link->next;
+			fut_release(link->owner);
+			link = next;
+		}
+	}
+	free(fut);
+}
+
+
+
+/**
+ * Sets the value of a future, returns 0 if it has already been set. The producer first claims the state, so that the value is written once
+ */
+static int fut_complete(struct fut_state* fut, void* value) {
+	int state = atomic_load_explicit(&fut->state, memory_order_relaxed);
+	do {
+		if (state & (fut_ready | fut_setting)) {
+			return 0;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&fut->state, &state, state | fut_setting, memory_order_relaxed, memory_order_relaxed));
+
+	fut->value = value;
+	if (atomic_exchange_explicit(&fut->state, fut_ready, memory_order_release) & fut_waiting) {
+		futex_wake(&fut->state, INT_MAX);
+	}
+
+	/* Links registered from now on are notified by their registration */
+	struct fut_link* link = atomic_exchange_explicit(&fut->links, &fut_closed, memory_order_acq_rel);
+	while (link != NULL) {
+		struct fut_link* next = link->next;
+		fut_notify(link, value);
+		link = next;
+	}
+	return 1;
+}
+
+
+
+int fut_set(fut_t fut, void* value) {
+	/* ERROR: The value has already been set */
+	if (!fut_complete(fut, value)) {
+		errno = EALREADY;
+		return thrd_error;
+	}
+
+	/* SUCCESS */
+	return thrd_success;
+}
+
+
+
+int fut_wait_timed(fut_t fut, const struct timespec* deadline, __OUT__ void** value) {
+	int state = atomic_load_explicit(&fut->state, memory_order_acquire);
+	int blocking = 0;
+	while (!(state & fut_ready)) {
+		/* The producer wakes the word up only if it sees the waiting flag */
+		if (!(state & fut_waiting)) {
+			if (!atomic_compare_exchange_weak_explicit(&fut->state, &state, state | fut_waiting, memory_order_acquire, memory_order_acquire)) {
+				continue;
+			}
+			state |= fut_waiting;
+		}
+
+		/* A worker of a pool tells it once that it blocks, the pool may run the producer meanwhile */
+		if (!blocking) {
+			tpool_begin_blocking();
+			blocking = 1;
+		}
+
+		/* ERROR: The deadline has passed */
+		if (futex_wait(&fut->state, state, deadline) == thrd_timedout
+			&& !(atomic_load_explicit(&fut->state, memory_order_acquire) & fut_ready)) {
+			tpool_end_blocking();
+			errno = ETIMEDOUT;
+			return thrd_timedout;
+		}
+		state = atomic_load_explicit(&fut->state, memory_order_acquire);
+	}
+
+	if (blocking) {
+		tpool_end_blocking();
+	}
+
+	if (value != NULL) {
+		*value = fut->value;
+	}
+	return thrd_success;
+}
+
+
+
+int fut_wait(fut_t fut, __OUT__ void** value) {
+	return fut_wait_timed(fut, NULL, value);
+}
+
+
+
+int fut_trywait(fut_t fut, __OUT__ void** value) {
+	if (!(atomic_load_explicit(&fut->state, memory_order_acquire) & fut_ready)) {
+		return thrd_busy;
+	}
+
+	if (value != NULL) {
+		*value = fut->value;
+	}
+	return thrd_success;
+}
+
+
+
+int fut_then(fut_t fut, tpool_t pool, fut_func_t func, void* arg, __OUT__ fut_t* next) {
+	/* ERROR: A continuation needs a function */
+	if (func == NULL) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	/* One reference for the caller, one for the link */
+	struct fut_state* state = fut_alloc(fut_role_then, 1, 2);
+
+	/* ERROR: No memory for the future */
+	if (state == NULL) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+	state->pool = (pool != NULL) ? pool : tpool_shared();
+	state->func = func;
+	state->arg = arg;
+
+	*next = state;
+	fut_register(fut, &state->link[0]);
+	return thrd_success;
+}
+
+
+
+int fut_async(tpool_t pool, fut_func_t func, void* arg, __OUT__ fut_t* fut) {
+	/* ERROR: A task needs a function */
+	if (func == NULL) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	/* One reference for the caller, one for the task */
+	struct fut_state* state = fut_alloc(fut_role_then, 0, 2);
+
+	/* ERROR: No memory for the future */
+	if (state == NULL) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+	state->pool = (pool != NULL) ? pool : tpool_shared();
+	state->func = func;
+	state->arg = arg;
+
+	*fut = state;
+	if (state->pool == NULL || tpool_submit(state->pool, fut_continue, state) != thrd_success) {
+		fut_continue(state);
+	}
+	return thrd_success;
+}
+
+
+
+/**
+ * Creates a fut_when_all or fut_when_any future and registers its links on futs
+ */
+static int fut_combine(int role, fut_t* futs, unsigned int count, __OUT__ fut_t* combined) {
+	/* ERROR: The references of the links would overflow */
+	if (count > INT_MAX - 1) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	/* One reference for the caller, one for each link */
+	struct fut_state* state = fut_alloc(role, count, (int) count + 1);
+
+	/* ERROR: No memory for the future */
+	if (state == NULL) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	*combined = state;
+	if (count == 0) {
+		fut_complete(state, NULL);
+	}
+	for (unsigned int i = 0; i < count; ++i) {
+		fut_register(futs[i], &state->link[i]);
+	}
+	return thrd_success;
+}
+
+
+
+int fut_when_all(fut_t* futs, unsigned int count, __OUT__ fut_t* all) {
+	return fut_combine(fut_role_all, futs, count, all);
+}
+
+
+
+int fut_when_any(fut_t* futs, unsigned int count, __OUT__ fut_t* any) {
+	/* ERROR: No future would ever be the first one */
+	if (count == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	return fut_combine(fut_role_any, futs, count, any);
+}
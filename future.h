@@ -0,0 +1,156 @@
+﻿#ifndef C11_THREADS_FUTURE_HEADER
+#define C11_THREADS_FUTURE_HEADER
+
+#include "threads.h"
+#include "tpool.h"
+
+
+
+/**
+ * Futures: a value set once by a producer and read by any number of consumers. The same handle is used to set and to read the value.
+ * The shared state is one reference-counted allocation, moved from pending to ready by a lock-free state machine:
+ * a consumer only enters the system to sleep on a futex if the value is not there yet, a producer only to wake consumers that sleep.
+ * Continuations and combinators are registered on the state without any lock and run when the value is set.
+ */
+
+
+
+/**
+ * Future, see future.c
+ */
+typedef struct fut_state* fut_t;
+
+
+
+/**
+ * The type fut_func_t is the function of a continuation, invoked as func(value, arg) on a pool, value being the value of the future it follows.
+ * It returns the value of the future created by fut_then or fut_async
+ */
+typedef void* (*fut_func_t)(void* value, void* arg);
+
+
+
+/**
+ * Creates a pending future. The caller holds one reference, a thread the future is handed over to takes its own one with fut_retain.
+ *
+ * @param fut			pointer to memory location to put the identifier of the new future
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory.
+ */
+int fut_create(__OUT__ fut_t* fut);
+
+
+
+/**
+ * Takes one more reference on a future.
+ *
+ * @param fut			identifier of the future
+ */
+void fut_retain(fut_t fut);
+
+
+
+/**
+ * Drops a reference on a future, the future is released with the last one.
+ * The continuations and combinators of a future released without a value never run.
+ *
+ * @param fut			identifier of the future
+ */
+void fut_release(fut_t fut);
+
+
+
+/**
+ * Sets the value of a future, wakes its waiters up and schedules its continuations.
+ *
+ * @param fut			identifier of the future
+ * @param value			value of the future
+ * @return				thrd_success if successful, thrd_error if the value has already been set.
+ */
+int fut_set(fut_t fut, void* value);
+
+
+
+/**
+ * Blocks until the value of a future is set. A task waiting for a future blocks its worker, fut_then does not: the pool is told, see tpool_begin_blocking.
+ *
+ * @param fut			identifier of the future
+ * @param value			pointer to memory location to put the value of the future, or NULL
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int fut_wait(fut_t fut, __OUT__ void** value);
+
+
+
+/**
+ * Same as fut_wait, but gives up at a deadline.
+ *
+ * @param fut			identifier of the future
+ * @param deadline		absolute TIME_UTC time to give up at, NULL to wait forever
+ * @param value			pointer to memory location to put the value of the future, or NULL
+ * @return				thrd_success if successful, thrd_timedout if the deadline has passed, thrd_error otherwise.
+ */
+int fut_wait_timed(fut_t fut, const struct timespec* deadline, __OUT__ void** value);
+
+
+
+/**
+ * Same as fut_wait, but returns immediately if the value is not set.
+ *
+ * @param fut			identifier of the future
+ * @param value			pointer to memory location to put the value of the future, or NULL
+ * @return				thrd_success if successful, thrd_busy if the value is not set.
+ */
+int fut_trywait(fut_t fut, __OUT__ void** value);
+
+
+
+/**
+ * Creates a future set to func(value, arg) once fut is set to value. func is submitted to pool, or run by the thread setting fut if there is no pool.
+ *
+ * @param fut			identifier of the future to follow
+ * @param pool			identifier of the pool to run func on, NULL for the shared pool
+ * @param func			function of the continuation
+ * @param arg			argument to pass to func
+ * @param next			pointer to memory location to put the identifier of the new future, the caller holds one reference
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int fut_then(fut_t fut, tpool_t pool, fut_func_t func, void* arg, __OUT__ fut_t* next);
+
+
+
+/**
+ * Submits func(NULL, arg) to pool and creates a future set to its result.
+ *
+ * @param pool			identifier of the pool to run func on, NULL for the shared pool
+ * @param func			function to run
+ * @param arg			argument to pass to func
+ * @param fut			pointer to memory location to put the identifier of the new future, the caller holds one reference
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int fut_async(tpool_t pool, fut_func_t func, void* arg, __OUT__ fut_t* fut);
+
+
+
+/**
+ * Creates a future set once all of count futures are set, to NULL: their values are read from them.
+ *
+ * @param futs			array of identifiers of futures, they do not need to outlive the call
+ * @param count			number of futures, 0 for a future already set
+ * @param all			pointer to memory location to put the identifier of the new future, the caller holds one reference
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int fut_when_all(fut_t* futs, unsigned int count, __OUT__ fut_t* all);
+
+
+
+/**
+ * Creates a future set once one of count futures is set, to the index of the first one cast to a pointer: (void*) (uintptr_t) index.
+ *
+ * @param futs			array of identifiers of futures, they do not need to outlive the call
+ * @param count			number of futures, at least 1
+ * @param any			pointer to memory location to put the identifier of the new future, the caller holds one reference
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int fut_when_any(fut_t* futs, unsigned int count, __OUT__ fut_t* any);
+
+#endif /* C11_THREADS_FUTURE_HEADER */
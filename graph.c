@@ -0,0 +1,316 @@
+﻿/**
+	Task graphs for the Cross Platform C11 Native Threads library
+
+	Topological order:
+		https://en.wikipedia.org/wiki/Topological_sorting#Kahn's_algorithm
+*/
+#include "graph.h"
+
+#include <errno.h>  /* For errno */
+#include <stdlib.h> /* For malloc(), realloc(), free() */
+
+/* Initial number of nodes of a graph and of successors of a node, the arrays double when they are full */
+#define GRAPH_SIZE 16
+
+/* Highest number of nodes of a graph */
+#define GRAPH_MAX (1u << 29)
+
+
+
+/**
+ * Node of a graph
+ *
+ * pending			number of predecessors not completed yet in the current run
+ * predecessors		number of edges to the node, pending is reset to it by every run
+ * successors		nodes the node is a predecessor of, count of them in an array of capacity
+ */
+struct graph_node {
+	atomic_uint pending;
+	unsigned int predecessors;
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int* successors;
+	tpool_func_t func;
+	void* arg;
+	struct graph* graph;
+};
+
+
+
+/**
+ * Task graph, graph_t points to it
+ *
+ * nodes		count nodes in an array of capacity
+ * order		nodes in topological order, valid while sealed is set, the roots come first
+ * roots		number of nodes without predecessor
+ * sealed		the graph has not changed since order was computed
+ * running		set while the graph runs, so that it is neither changed nor run twice at once
+ * group		task group of the nodes of the current run, its pool is the pool of the graph
+ */
+struct graph {
+	struct graph_node* nodes;
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int* order;
+	unsigned int roots;
+	int sealed;
+	atomic_int running;
+	tpool_group_t group;
+};
+
+
+
+static void graph_spawn(struct graph* graph, struct graph_node* node);
+
+
+
+/**
+ * Runs a node, then releases its successors. The first successor made ready is run right away by the same worker, the others are spawned to its deque.
+ * The node is counted as completed once its successors are released: the graph may be gone right after, only the next node is looked at
+ */
+static void graph_node_run(void* param) {
+	struct graph_node* node = (struct graph_node*) param;
+	struct graph* graph = node->graph;
+	while (node != NULL) {
+		node->func(node->arg);
+
+		struct graph_node* next = NULL;
+		for (unsigned int i = 0; i < node->count; ++i) {
+			struct graph_node* successor = &graph->nodes[node->successors[i]];
+			if (atomic_fetch_sub_explicit(&successor->pending, 1, memory_order_acq_rel) != 1) {
+				continue;
+			}
+			if (next == NULL) {
+				next = successor;
+			} else {
+				graph_spawn(graph, successor);
+			}
+		}
+
+		tpool_group_done(&graph->group);
+		node = next;
+	}
+}
+
+
+
+/**
+ * Submits a ready node to the pool of the graph, from a worker the node goes to its deque
+ */
+static void graph_spawn(struct graph* graph, struct graph_node* node) {
+	if (tpool_submit(graph->group.pool, graph_node_run, node) != thrd_success) {
+		graph_node_run(node);
+	}
+}
+
+
+
+/**
+ * Computes the topological order of a graph changed since its last run, returns thrd_error if the graph has a cycle.
+ * The pending counters are used as scratch, every run resets them
+ */
+static int graph_seal(struct graph* graph) {
+	if (graph->sealed) {
+		return thrd_success;
+	}
+
+	unsigned int* order = (unsigned int*) realloc(graph->order, (graph->count ? graph->count : 1) * sizeof(unsigned int));
+
+	/* ERROR: No memory for the order */
+	if (order == NULL) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+	graph->order = order;
+
+	unsigned int size = 0;
+	for (unsigned int i = 0; i < graph->count; ++i) {
+		atomic_store_explicit(&graph->nodes[i].pending, graph->nodes[i].predecessors, memory_order_relaxed);
+		if (graph->nodes[i].predecessors == 0) {
+			order[size++] = i;
+		}
+	}
+	graph->roots = size;
+
+	for (unsigned int head = 0; head < size; ++head) {
+		struct graph_node* node = &graph->nodes[order[head]];
+		for (unsigned int i = 0; i < node->count; ++i) {
+			if (atomic_fetch_sub_explicit(&graph->nodes[node->successors[i]].pending, 1, memory_order_relaxed) == 1) {
+				order[size++] = node->successors[i];
+			}
+		}
+	}
+
+	/* ERROR: The nodes of a cycle never get ready */
+	if (size != graph->count) {
+		errno = EDEADLK;
+		return thrd_error;
+	}
+
+	graph->sealed = 1;
+	return thrd_success;
+}
+
+
+
+int graph_create(__OUT__ graph_t* graph, tpool_t pool) {
+	struct graph* self = (struct graph*) calloc(1, sizeof(struct graph));
+
+	/* ERROR: No memory for the graph */
+	if (self == NULL) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	atomic_init(&self->running, 0);
+	tpool_group_init(&self->group, pool);
+	*graph = self;
+	return thrd_success;
+}
+
+
+
+void graph_destroy(graph_t graph) {
+	for (unsigned int i = 0; i < graph->count; ++i) {
+		free(graph->nodes[i].successors);
+	}
+	free(graph->nodes);
+	free(graph->order);
+	free(graph);
+}
+
+
+
+int graph_add(graph_t graph, tpool_func_t func, void* arg, __OUT__ graph_node_t* node) {
+	/* ERROR: A task needs a function */
+	if (func == NULL) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	/* ERROR: The nodes are read by the workers of the current run */
+	if (atomic_load_explicit(&graph->running, memory_order_acquire)) {
+		errno = EBUSY;
+		return thrd_busy;
+	}
+
+	/* ERROR: A run counts its nodes in a task group, whose counter keeps its high bits */
+	if (graph->count >= GRAPH_MAX) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	if (graph->count == graph->capacity) {
+		unsigned int capacity = (graph->capacity != 0) ? graph->capacity * 2 : GRAPH_SIZE;
+		struct graph_node* nodes = (struct graph_node*) realloc(graph->nodes, capacity * sizeof(struct graph_node));
+
+		/* ERROR: No memory for the node */
+		if (nodes == NULL) {
+			errno = ENOMEM;
+			return thrd_nomem;
+		}
+		graph->nodes = nodes;
+		graph->capacity = capacity;
+	}
+
+	struct graph_node* added = &graph->nodes[graph->count];
+	atomic_init(&added->pending, 0);
+	added->predecessors = 0;
+	added->count = 0;
+	added->capacity = 0;
+	added->successors = NULL;
+	added->func = func;
+	added->arg = arg;
+	added->graph = graph;
+
+	if (node != NULL) {
+		*node = graph->count;
+	}
+	graph->count++;
+	graph->sealed = 0;
+	return thrd_success;
+}
+
+
+
+int graph_edge(graph_t graph, graph_node_t from, graph_node_t to) {
+	/* ERROR: Unknown nodes, or a node waiting for itself */
+	if (from >= graph->count || to >= graph->count || from == to) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	/* ERROR: The edges are read by the workers of the current run */
+	if (atomic_load_explicit(&graph->running, memory_order_acquire)) {
+		errno = EBUSY;
+		return thrd_busy;
+	}
+
+	struct graph_node* node = &graph->nodes[from];
+	if (node->count == node->capacity) {
+		unsigned int capacity = (node->capacity != 0) ? node->capacity * 2 : GRAPH_SIZE;
+		unsigned int* successors = (unsigned int*) realloc(node->successors, capacity * sizeof(unsigned int));
+
+		/* ERROR: No memory for the edge */
+		if (successors == NULL) {
+			errno = ENOMEM;
+			return thrd_nomem;
+		}
+		node->successors = successors;
+		node->capacity = capacity;
+	}
+
+	node->successors[node->count++] = to;
+	graph->nodes[to].predecessors++;
+	graph->sealed = 0;
+	return thrd_success;
+}
+
+
+
+int graph_run(graph_t graph) {
+	/* ERROR: A run is not over yet */
+	int running = 0;
+	if (!atomic_compare_exchange_strong_explicit(&graph->running, &running, 1, memory_order_acquire, memory_order_relaxed)) {
+		errno = EBUSY;
+		return thrd_busy;
+	}
+
+	/* ERROR: The graph has a cycle or no memory for its order, errno is kept from graph_seal */
+	int value = graph_seal(graph);
+	if (value != thrd_success) {
+		atomic_store_explicit(&graph->running, 0, memory_order_release);
+		return value;
+	}
+
+	if (graph->group.pool == NULL) {
+		/* No pool, the nodes are run in topological order by the caller */
+		for (unsigned int i = 0; i < graph->count; ++i) {
+			struct graph_node* node = &graph->nodes[graph->order[i]];
+			node->func(node->arg);
+		}
+	} else {
+		/* The counters are published to the workers by the submission of the roots */
+		for (unsigned int i = 0; i < graph->count; ++i) {
+			atomic_store_explicit(&graph->nodes[i].pending, graph->nodes[i].predecessors, memory_order_relaxed);
+		}
+		tpool_group_add(&graph->group, (int) graph->count);
+		for (unsigned int i = 0; i < graph->roots; ++i) {
+			graph_spawn(graph, &graph->nodes[graph->order[i]]);
+		}
+		tpool_group_wait(&graph->group);
+	}
+
+	atomic_store_explicit(&graph->running, 0, memory_order_release);
+	return thrd_success;
+}
+
+
+
+int graph_run_n(graph_t graph, unsigned int count) {
+	int value = thrd_success;
+	for (unsigned int i = 0; i < count && value == thrd_success; ++i) {
+		value = graph_run(graph);
+	}
+	return value;
+}
@@ -0,0 +1,100 @@
+﻿#ifndef C11_THREADS_GRAPH_HEADER
+#define C11_THREADS_GRAPH_HEADER
+
+#include "threads.h"
+#include "tpool.h"
+
+
+
+/**
+ * Task graphs: a directed acyclic graph of tasks run on a pool, each task starting once all of its predecessors have completed.
+ * Each node carries an atomic counter of the predecessors it still waits for: the worker completing the last one runs the node right away,
+ * and pushes the other nodes it makes ready to its own deque, where they are run or stolen like any task spawned by a task.
+ * The graph is built once and run any number of times, a run resets the counters and allocates nothing.
+ */
+
+
+
+/**
+ * Task graph, see graph.c
+ */
+typedef struct graph* graph_t;
+
+
+
+/**
+ * Node of a task graph, its rank in the order of graph_add
+ */
+typedef unsigned int graph_node_t;
+
+
+
+/**
+ * Creates an empty task graph.
+ *
+ * @param graph			pointer to memory location to put the identifier of the new graph
+ * @param pool			identifier of the pool to run the graph on, NULL for the shared pool
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory.
+ */
+int graph_create(__OUT__ graph_t* graph, tpool_t pool);
+
+
+
+/**
+ * Destroys a task graph, which must not be running.
+ *
+ * @param graph			identifier of the graph
+ */
+void graph_destroy(graph_t graph);
+
+
+
+/**
+ * Adds a node to a graph, invoked as func(arg) by a worker once all of its predecessors have completed. Not allowed while the graph runs.
+ *
+ * @param graph			identifier of the graph
+ * @param func			function of the task
+ * @param arg			argument to pass to the function
+ * @param node			pointer to memory location to put the new node, or NULL
+ * @return				thrd_success if successful, thrd_busy if the graph is running. Otherwise returns thrd_nomem if there was insufficient amount of memory
+ *						or thrd_error if another error occurred.
+ */
+int graph_add(graph_t graph, tpool_func_t func, void* arg, __OUT__ graph_node_t* node);
+
+
+
+/**
+ * Adds an edge to a graph: to starts once from has completed. Not allowed while the graph runs. Cycles are reported by graph_run.
+ *
+ * @param graph			identifier of the graph
+ * @param from			predecessor
+ * @param to			successor
+ * @return				thrd_success if successful, thrd_busy if the graph is running. Otherwise returns thrd_nomem if there was insufficient amount of memory
+ *						or thrd_error if another error occurred.
+ */
+int graph_edge(graph_t graph, graph_node_t from, graph_node_t to);
+
+
+
+/**
+ * Runs every node of a graph once and blocks until they have all completed. Called from a worker of the pool, the worker runs pending tasks meanwhile.
+ * The graph is checked for cycles on the first run after a change.
+ *
+ * @param graph			identifier of the graph
+ * @return				thrd_success if successful, thrd_busy if the graph is already running. Otherwise returns thrd_nomem if there was insufficient amount of memory
+ *						or thrd_error if the graph has a cycle or another error occurred.
+ */
+int graph_run(graph_t graph);
+
+
+
+/**
+ * Runs a graph count times in a row, each run starting once the previous one has completed.
+ *
+ * @param graph			identifier of the graph
+ * @param count			number of runs
+ * @return				thrd_success if successful, see graph_run otherwise.
+ */
+int graph_run_n(graph_t graph, unsigned int count);
+
+#endif /* C11_THREADS_GRAPH_HEADER */
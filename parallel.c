@@ -0,0 +1,514 @@
+﻿/**
+	Parallel loops for the Cross Platform C11 Native Threads library
+
+	Lazy binary splitting:
+		Tzannes, Caragea, Barua, Vishkin: Lazy Binary-Splitting, PPoPP 2010
+*/
+#include "parallel.h"
+
+#include <errno.h>  /* For errno */
+#include <stdint.h> /* For uintptr_t, SIZE_MAX */
+#include <stdlib.h> /* For malloc(), free() */
+#include <string.h> /* For memcpy(), memmove() */
+
+/* Size of a cache line, partial results written by different threads are kept on different lines */
+#define THRD_PARALLEL_CACHE_LINE 64
+
+/* Number of grains per worker a range is cut into when no grain is given */
+#define THRD_PARALLEL_GRAINS 8
+
+/* Number of cache lines of partial results kept on the stack of the caller, larger arrays are allocated with malloc */
+#define THRD_PARALLEL_PARTIALS 32
+
+
+
+/**
+ * Loop being run, lives on the stack of its caller
+ *
+ * group		submitted pieces of the loop
+ */
+struct thrd_parallel_loop {
+	tpool_t pool;
+	thrd_range_func_t func;
+	void* ctx;
+	size_t grain;
+	tpool_group_t group;
+};
+
+
+
+/**
+ * Piece of a loop submitted to the pool, a task descriptor of the pool for each split in thrd_parallel_auto mode and for each chunk of the other modes
+ */
+struct thrd_parallel_range {
+	struct thrd_parallel_loop* loop;
+	size_t begin;
+	size_t end;
+};
+
+
+
+/**
+ * Array of partial results, each one aligned on its own cache lines
+ *
+ * block		allocated memory, values is aligned within it, NULL when the array fits in local
+ * stride		distance between two partial results, a multiple of THRD_PARALLEL_CACHE_LINE
+ * local		room for up to THRD_PARALLEL_PARTIALS lines, the array is not allocated for a small pool
+ */
+struct thrd_parallel_partials {
+	void* block;
+	unsigned char* values;
+	size_t stride;
+	unsigned char local[(THRD_PARALLEL_PARTIALS + 1) * THRD_PARALLEL_CACHE_LINE - 1];
+};
+
+
+
+/**
+ * Reduction being run, lives on the stack of its caller
+ *
+ * caller		index of the partial result of the calling thread in the non-deterministic mode, after the ones of the workers
+ */
+struct thrd_parallel_reduction {
+	tpool_t pool;
+	size_t begin;
+	size_t end;
+	size_t grain;
+	size_t size;
+	const void* identity;
+	thrd_reduce_func_t func;
+	void* ctx;
+	unsigned int caller;
+	struct thrd_parallel_partials partials;
+};
+
+
+
+/**
+ * Scan being run, lives on the stack of its caller. Each partial result holds the running value of a chunk, then a temporary element
+ *
+ * length		number of elements of a chunk, the last one may be shorter
+ */
+struct thrd_parallel_prefix {
+	const unsigned char* in;
+	unsigned char* out;
+	size_t count;
+	size_t size;
+	size_t length;
+	const void* identity;
+	thrd_combine_func_t combine;
+	void* ctx;
+	int flags;
+	struct thrd_parallel_partials partials;
+};
+
+
+
+static void thrd_parallel_task(void* param);
+
+
+
+/**
+ * Submits [begin, end) as a new piece of the loop, returns 0 if it could not be submitted
+ * The submitter holds a piece itself, or is the caller of the loop, so the group cannot be seen empty in between
+ */
+static int thrd_parallel_spawn(struct thrd_parallel_loop* loop, size_t begin, size_t end) {
+	struct thrd_parallel_range* range = (struct thrd_parallel_range*) tpool_task_alloc(loop->pool, sizeof(struct thrd_parallel_range));
+	if (range == NULL) {
+		return 0;
+	}
+	range->loop = loop;
+	range->begin = begin;
+	range->end = end;
+
+	tpool_group_add(&loop->group, 1);
+	if (tpool_trysubmit(loop->pool, thrd_parallel_task, range) != thrd_success) {
+		tpool_group_done(&loop->group);
+		tpool_task_free(range);
+		return 0;
+	}
+	return 1;
+}
+
+
+
+/**
+ * Runs [begin, end) grain by grain. Between two grains, the upper half of what is left is submitted if the pool is short of tasks:
+ * ranges are only split when another worker can take them, without any tuning of the chunk size
+ */
+static void thrd_parallel_run(struct thrd_parallel_loop* loop, size_t begin, size_t end) {
+	while (end - begin > loop->grain) {
+		size_t middle = begin + (end - begin) / 2;
+		if (middle - begin >= loop->grain && tpool_demand(loop->pool) && thrd_parallel_spawn(loop, middle, end)) {
+			end = middle;
+		} else {
+			loop->func(begin, begin + loop->grain, loop->ctx);
+			begin += loop->grain;
+		}
+	}
+
+	if (begin < end) {
+		loop->func(begin, end, loop->ctx);
+	}
+}
+
+
+
+/**
+ * Task of a piece split in thrd_parallel_auto mode, the piece may be split further
+ */
+static void thrd_parallel_task(void* param) {
+	struct thrd_parallel_range* range = (struct thrd_parallel_range*) param;
+	struct thrd_parallel_loop* loop = range->loop;
+	size_t begin = range->begin;
+	size_t end = range->end;
+	tpool_task_free(range);
+
+	thrd_parallel_run(loop, begin, end);
+	tpool_group_done(&loop->group);
+}
+
+
+
+/**
+ * Task of a chunk in thrd_parallel_static and thrd_parallel_affinity modes
+ */
+static void thrd_parallel_chunk(void* param) {
+	struct thrd_parallel_range* range = (struct thrd_parallel_range*) param;
+	struct thrd_parallel_loop* loop = range->loop;
+	size_t begin = range->begin;
+	size_t end = range->end;
+	tpool_task_free(range);
+
+	loop->func(begin, end, loop->ctx);
+	tpool_group_done(&loop->group);
+}
+
+
+
+/**
+ * Cuts [begin, end) into one chunk per worker, at most one per grain, and submits them. Chunk bounds only depend on the range and the pool,
+ * so in thrd_parallel_affinity mode the same indexes go to the same worker on every call. The chunk of the calling worker, or the first one, is run inline
+ */
+static int thrd_parallel_chunks(struct thrd_parallel_loop* loop, int mode, size_t begin, size_t end) {
+	size_t length = end - begin;
+	size_t count = tpool_size(loop->pool);
+	if (length / loop->grain < count) {
+		count = length / loop->grain + (length % loop->grain != 0);
+	}
+
+	int self = tpool_worker_index(loop->pool);
+	size_t inline_chunk = (mode == thrd_parallel_affinity) ? (size_t) self : 0;
+	size_t quotient = length / count;
+	size_t remainder = length % count;
+
+	/* Each submitted chunk is a task descriptor of the pool, released by the task before it runs the chunk */
+	size_t inline_first = begin;
+	size_t inline_last = begin;
+	for (size_t i = 0; i < count; ++i) {
+		size_t first = begin + i * quotient + (i < remainder ? i : remainder);
+		size_t last = first + quotient + (i < remainder);
+		if (i == inline_chunk) {
+			inline_first = first;
+			inline_last = last;
+			continue;
+		}
+
+		struct thrd_parallel_range* range = (struct thrd_parallel_range*) tpool_task_alloc(loop->pool, sizeof(struct thrd_parallel_range));
+
+		/* No memory for the chunk, it is run by the caller */
+		if (range == NULL) {
+			loop->func(first, last, loop->ctx);
+			continue;
+		}
+		range->loop = loop;
+		range->begin = first;
+		range->end = last;
+
+		tpool_group_add(&loop->group, 1);
+		int value = (mode == thrd_parallel_affinity)
+			? tpool_submit_to(loop->pool, (unsigned int) i, thrd_parallel_chunk, range)
+			: tpool_submit(loop->pool, thrd_parallel_chunk, range);
+		if (value != thrd_success) {
+			tpool_group_done(&loop->group);
+			tpool_task_free(range);
+			loop->func(first, last, loop->ctx);
+		}
+	}
+
+	if (inline_first < inline_last) {
+		loop->func(inline_first, inline_last, loop->ctx);
+	}
+	tpool_group_wait(&loop->group);
+	return thrd_success;
+}
+
+
+
+int thrd_parallel_for(size_t begin, size_t end, size_t grain, thrd_range_func_t func, void* ctx) {
+	return thrd_parallel_for_ex(NULL, thrd_parallel_auto, begin, end, grain, func, ctx);
+}
+
+
+
+int thrd_parallel_for_ex(tpool_t pool, int mode, size_t begin, size_t end, size_t grain, thrd_range_func_t func, void* ctx) {
+	/* ERROR: A loop needs a body, a valid range and a known mode */
+	if (func == NULL || begin > end || (mode != thrd_parallel_auto && mode != thrd_parallel_static && mode != thrd_parallel_affinity)) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	if (begin == end) {
+		return thrd_success;
+	}
+
+	if (pool == NULL) {
+		pool = tpool_shared();
+	}
+
+	/* No pool, the loop is run serially */
+	if (pool == NULL) {
+		func(begin, end, ctx);
+		return thrd_success;
+	}
+
+	struct thrd_parallel_loop loop;
+	loop.pool = pool;
+	loop.func = func;
+	loop.ctx = ctx;
+	loop.grain = (grain != 0) ? grain : (end - begin) / (THRD_PARALLEL_GRAINS * (size_t) tpool_size(pool));
+	if (loop.grain == 0) {
+		loop.grain = 1;
+	}
+	tpool_group_init(&loop.group, pool);
+
+	if (mode != thrd_parallel_auto) {
+		return thrd_parallel_chunks(&loop, mode, begin, end);
+	}
+
+	thrd_parallel_run(&loop, begin, end);
+	tpool_group_wait(&loop.group);
+	return thrd_success;
+}
+
+
+
+/**
+ * Allocates count partial results of size bytes, in the room of partials if they fit. Returns 0 if there is insufficient amount of memory
+ */
+static int thrd_parallel_partials_alloc(struct thrd_parallel_partials* partials, size_t count, size_t size) {
+	partials->stride = (size + THRD_PARALLEL_CACHE_LINE - 1) / THRD_PARALLEL_CACHE_LINE * THRD_PARALLEL_CACHE_LINE;
+	if (count > (SIZE_MAX - THRD_PARALLEL_CACHE_LINE) / partials->stride) {
+		return 0;
+	}
+
+	unsigned char* memory = partials->local;
+	partials->block = NULL;
+	if (count * partials->stride > THRD_PARALLEL_PARTIALS * THRD_PARALLEL_CACHE_LINE) {
+		partials->block = malloc(count * partials->stride + THRD_PARALLEL_CACHE_LINE - 1);
+		if (partials->block == NULL) {
+			return 0;
+		}
+		memory = (unsigned char*) partials->block;
+	}
+	partials->values = (unsigned char*) (((uintptr_t) memory + THRD_PARALLEL_CACHE_LINE - 1) & ~(uintptr_t) (THRD_PARALLEL_CACHE_LINE - 1));
+	return 1;
+}
+
+
+
+/**
+ * Body of a non-deterministic reduction: the pieces are folded into the partial result of the thread running them
+ */
+static void thrd_parallel_fold(size_t begin, size_t end, void* param) {
+	struct thrd_parallel_reduction* reduction = (struct thrd_parallel_reduction*) param;
+	int worker = tpool_worker_index(reduction->pool);
+	size_t index = (worker >= 0) ? (size_t) worker : reduction->caller;
+	reduction->func(begin, end, reduction->partials.values + index * reduction->partials.stride, reduction->ctx);
+}
+
+
+
+/**
+ * Body of a deterministic reduction, over chunk indexes: each chunk of grain indexes is folded into its own partial result, from the identity
+ */
+static void thrd_parallel_fold_chunks(size_t begin, size_t end, void* param) {
+	struct thrd_parallel_reduction* reduction = (struct thrd_parallel_reduction*) param;
+	for (size_t chunk = begin; chunk < end; ++chunk) {
+		unsigned char* partial = reduction->partials.values + chunk * reduction->partials.stride;
+		size_t first = reduction->begin + chunk * reduction->grain;
+		size_t last = (reduction->end - first > reduction->grain) ? first + reduction->grain : reduction->end;
+
+		memcpy(partial, reduction->identity, reduction->size);
+		reduction->func(first, last, partial, reduction->ctx);
+	}
+}
+
+
+
+int thrd_parallel_reduce(tpool_t pool, int flags, size_t begin, size_t end, size_t grain, size_t size, const void* identity,
+	thrd_reduce_func_t func, thrd_combine_func_t combine, void* ctx, __OUT__ void* result) {
+	/* ERROR: A reduction needs a type, an identity, functions, a valid range and a result */
+	if (size == 0 || identity == NULL || func == NULL || combine == NULL || result == NULL || begin > end) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	if (pool == NULL) {
+		pool = tpool_shared();
+	}
+
+	struct thrd_parallel_reduction reduction;
+	reduction.pool = pool;
+	reduction.begin = begin;
+	reduction.end = end;
+	reduction.size = size;
+	reduction.identity = identity;
+	reduction.func = func;
+	reduction.ctx = ctx;
+	reduction.caller = (pool != NULL) ? tpool_slots(pool) : 0;
+
+	size_t count;
+	if (flags & thrd_parallel_deterministic) {
+		reduction.grain = (grain != 0) ? grain : THRD_PARALLEL_GRAIN;
+		count = (end - begin) / reduction.grain + ((end - begin) % reduction.grain != 0);
+	} else {
+		reduction.grain = grain;
+		count = (size_t) reduction.caller + 1;
+	}
+
+	/* ERROR: No memory for the partial results */
+	if (!thrd_parallel_partials_alloc(&reduction.partials, count, size)) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	if (flags & thrd_parallel_deterministic) {
+		thrd_parallel_for_ex(pool, thrd_parallel_auto, 0, count, 1, thrd_parallel_fold_chunks, &reduction);
+	} else {
+		for (size_t i = 0; i < count; ++i) {
+			memcpy(reduction.partials.values + i * reduction.partials.stride, identity, size);
+		}
+		thrd_parallel_for_ex(pool, thrd_parallel_auto, begin, end, grain, thrd_parallel_fold, &reduction);
+	}
+
+	/* Partial results are combined in index order, or in worker order */
+	memmove(result, identity, size);
+	for (size_t i = 0; i < count; ++i) {
+		combine(result, reduction.partials.values + i * reduction.partials.stride, ctx);
+	}
+
+	free(reduction.partials.block);
+	return thrd_success;
+}
+
+
+
+/**
+ * First pass of a scan, over chunk indexes: each chunk is reduced into its partial result
+ */
+static void thrd_parallel_scan_reduce(size_t begin, size_t end, void* param) {
+	struct thrd_parallel_prefix* prefix = (struct thrd_parallel_prefix*) param;
+	for (size_t chunk = begin; chunk < end; ++chunk) {
+		unsigned char* partial = prefix->partials.values + chunk * prefix->partials.stride;
+		size_t first = chunk * prefix->length;
+		size_t last = (prefix->count - first > prefix->length) ? first + prefix->length : prefix->count;
+
+		memcpy(partial, prefix->identity, prefix->size);
+		for (size_t i = first; i < last; ++i) {
+			prefix->combine(partial, prefix->in + i * prefix->size, prefix->ctx);
+		}
+	}
+}
+
+
+
+/**
+ * Second pass of a scan, over chunk indexes: each chunk is scanned from its offset. The input element is copied first, in and out may be the same array
+ */
+static void thrd_parallel_scan_apply(size_t begin, size_t end, void* param) {
+	struct thrd_parallel_prefix* prefix = (struct thrd_parallel_prefix*) param;
+	for (size_t chunk = begin; chunk < end; ++chunk) {
+		unsigned char* running = prefix->partials.values + chunk * prefix->partials.stride;
+		unsigned char* element = running + prefix->size;
+		size_t first = chunk * prefix->length;
+		size_t last = (prefix->count - first > prefix->length) ? first + prefix->length : prefix->count;
+
+		for (size_t i = first; i < last; ++i) {
+			if (prefix->flags & thrd_parallel_exclusive) {
+				memcpy(element, prefix->in + i * prefix->size, prefix->size);
+				memcpy(prefix->out + i * prefix->size, running, prefix->size);
+				prefix->combine(running, element, prefix->ctx);
+			} else {
+				prefix->combine(running, prefix->in + i * prefix->size, prefix->ctx);
+				memcpy(prefix->out + i * prefix->size, running, prefix->size);
+			}
+		}
+	}
+}
+
+
+
+int thrd_parallel_scan(tpool_t pool, int flags, const void* in, void* out, size_t count, size_t size, size_t grain, const void* identity,
+	thrd_combine_func_t combine, void* ctx) {
+	/* ERROR: A scan needs arrays, a type, an identity and a function */
+	if (in == NULL || out == NULL || size == 0 || size > SIZE_MAX / 2 || identity == NULL || combine == NULL) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	if (count == 0) {
+		return thrd_success;
+	}
+
+	if (pool == NULL) {
+		pool = tpool_shared();
+	}
+
+	struct thrd_parallel_prefix prefix;
+	prefix.in = (const unsigned char*) in;
+	prefix.out = (unsigned char*) out;
+	prefix.count = count;
+	prefix.size = size;
+	prefix.identity = identity;
+	prefix.combine = combine;
+	prefix.ctx = ctx;
+	prefix.flags = flags;
+
+	/* One chunk per worker, or chunks of grain elements whatever the pool */
+	if (flags & thrd_parallel_deterministic) {
+		prefix.length = (grain != 0) ? grain : THRD_PARALLEL_GRAIN;
+	} else {
+		size_t workers = (pool != NULL) ? tpool_size(pool) : 1;
+		prefix.length = count / workers + (count % workers != 0);
+		if (prefix.length < grain) {
+			prefix.length = grain;
+		}
+	}
+	size_t chunks = count / prefix.length + (count % prefix.length != 0);
+
+	/* ERROR: No memory for the partial results, one more holds the offset while they are combined */
+	if (!thrd_parallel_partials_alloc(&prefix.partials, chunks + 1, 2 * size)) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	/* The last chunk only needs its offset */
+	thrd_parallel_for_ex(pool, thrd_parallel_auto, 0, chunks - 1, 1, thrd_parallel_scan_reduce, &prefix);
+
+	unsigned char* offset = prefix.partials.values + chunks * prefix.partials.stride;
+	unsigned char* element = offset + size;
+	memcpy(offset, identity, size);
+	for (size_t chunk = 0; chunk + 1 < chunks; ++chunk) {
+		unsigned char* partial = prefix.partials.values + chunk * prefix.partials.stride;
+		memcpy(element, partial, size);
+		memcpy(partial, offset, size);
+		combine(offset, element, ctx);
+	}
+	memcpy(prefix.partials.values + (chunks - 1) * prefix.partials.stride, offset, size);
+
+	thrd_parallel_for_ex(pool, thrd_parallel_auto, 0, chunks, 1, thrd_parallel_scan_apply, &prefix);
+
+	free(prefix.partials.block);
+	return thrd_success;
+}
@@ -0,0 +1,145 @@
+﻿#ifndef C11_THREADS_PARALLEL_HEADER
+#define C11_THREADS_PARALLEL_HEADER
+
+#include "threads.h"
+#include "tpool.h"
+
+
+
+/**
+ * Parallel loops over index ranges, run on a thread pool. The calling thread takes part in the loop and returns once every index has been processed.
+ * Reductions and scans keep one partial result per worker, or per chunk, each on its own cache lines, and combine them once the loop is over.
+ */
+
+
+
+/**
+ * The type thrd_range_func_t is the body of a parallel loop, invoked as func(begin, end, ctx) for the indexes of [begin, end)
+ */
+typedef void (*thrd_range_func_t)(size_t begin, size_t end, void* ctx);
+
+
+
+/**
+ * Parallel loop mode enum, used by thrd_parallel_for_ex
+ *
+ * thrd_parallel_auto		lazy binary splitting: a range is halved only when a worker is short of tasks, otherwise it is run grain by grain
+ * thrd_parallel_static		one chunk per worker, split upfront, for iterations of uniform cost
+ * thrd_parallel_affinity	one chunk per worker as with thrd_parallel_static, chunk i always runs on worker i,
+ *							so a loop over the same range finds its data in the same caches on each call
+ */
+enum {
+	thrd_parallel_auto,
+	thrd_parallel_static,
+	thrd_parallel_affinity
+};
+
+
+
+/**
+ * Runs func over [begin, end) on the shared pool, see tpool_shared, in thrd_parallel_auto mode.
+ * The loop is run serially by the calling thread if the shared pool cannot be created.
+ *
+ * @param begin			first index
+ * @param end			index past the last one
+ * @param grain			smallest number of indexes passed to one call of func, 0 to derive it from the range and the number of workers
+ * @param func			body of the loop
+ * @param ctx			argument to pass to func
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_parallel_for(size_t begin, size_t end, size_t grain, thrd_range_func_t func, void* ctx);
+
+
+
+/**
+ * Same as thrd_parallel_for, on a given pool and in a given mode. May be called from a task of the pool: the worker runs other tasks while it waits.
+ *
+ * @param pool			identifier of the pool, NULL for the shared pool
+ * @param mode			thrd_parallel_auto, thrd_parallel_static or thrd_parallel_affinity
+ * @param begin			first index
+ * @param end			index past the last one
+ * @param grain			smallest number of indexes passed to one call of func, 0 to derive it from the range and the number of workers
+ * @param func			body of the loop
+ * @param ctx			argument to pass to func
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_parallel_for_ex(tpool_t pool, int mode, size_t begin, size_t end, size_t grain, thrd_range_func_t func, void* ctx);
+
+
+
+/**
+ * The type thrd_reduce_func_t folds the indexes of [begin, end) into partial, a value of the reduction type, invoked as func(begin, end, partial, ctx)
+ */
+typedef void (*thrd_reduce_func_t)(size_t begin, size_t end, void* partial, void* ctx);
+
+
+
+/**
+ * The type thrd_combine_func_t combines two values of the reduction type, invoked as func(accumulator, value, ctx) to compute accumulator = accumulator op value.
+ * The operation must be associative, it does not need to be commutative: values are always combined in index order
+ */
+typedef void (*thrd_combine_func_t)(void* accumulator, const void* value, void* ctx);
+
+
+
+/**
+ * Reduction and scan flags enum, used by thrd_parallel_reduce and thrd_parallel_scan
+ *
+ * thrd_parallel_deterministic	the range is cut in chunks of grain indexes whatever the pool, each chunk is folded from the identity and
+ *								the chunks are combined in index order: the result is reproducible, for floating-point operations too
+ * thrd_parallel_exclusive		the scan writes in out[i] the combination of the elements before i, instead of up to i
+ *
+ * THRD_PARALLEL_GRAIN is the grain of a deterministic loop when none is given, fixed so that the result does not depend on the machine
+ */
+enum {
+	thrd_parallel_deterministic = 1 << 0,
+	thrd_parallel_exclusive     = 1 << 1
+};
+
+#define THRD_PARALLEL_GRAIN 1024
+
+
+
+/**
+ * Reduces [begin, end) into result. Without thrd_parallel_deterministic, the range is run as with thrd_parallel_for and each thread folds the pieces it runs
+ * into its own partial result, so the grouping of the operations depends on the scheduling. func must then not wait for a loop on the same pool.
+ *
+ * @param pool			identifier of the pool, NULL for the shared pool
+ * @param flags			0 or thrd_parallel_deterministic
+ * @param begin			first index
+ * @param end			index past the last one
+ * @param grain			smallest number of indexes passed to one call of func, 0 for a default
+ * @param size			size of a value of the reduction type
+ * @param identity		pointer to the identity value of combine, each partial result starts from a copy of it
+ * @param func			folds a range of indexes into a partial result
+ * @param combine		combines two partial results
+ * @param ctx			argument to pass to func and combine
+ * @param result		pointer to memory location to put the result, identity if the range is empty
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int thrd_parallel_reduce(tpool_t pool, int flags, size_t begin, size_t end, size_t grain, size_t size, const void* identity,
+	thrd_reduce_func_t func, thrd_combine_func_t combine, void* ctx, __OUT__ void* result);
+
+
+
+/**
+ * Computes the prefix combinations of an array in two passes: the chunks are reduced in parallel, their offsets are combined serially,
+ * then each chunk is scanned from its offset in parallel. out[i] is in[0] op ... op in[i], or in[0] op ... op in[i - 1] with thrd_parallel_exclusive.
+ * in and out may be the same array.
+ *
+ * @param pool			identifier of the pool, NULL for the shared pool
+ * @param flags			0 or a combination of thrd_parallel_deterministic and thrd_parallel_exclusive
+ * @param in			array of count elements of size bytes
+ * @param out			array of count elements of size bytes
+ * @param count			number of elements
+ * @param size			size of an element
+ * @param grain			smallest number of elements of a chunk, 0 for a default
+ * @param identity		pointer to the identity value of combine
+ * @param combine		combines two elements
+ * @param ctx			argument to pass to combine
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int thrd_parallel_scan(tpool_t pool, int flags, const void* in, void* out, size_t count, size_t size, size_t grain, const void* identity,
+	thrd_combine_func_t combine, void* ctx);
+
+#endif /* C11_THREADS_PARALLEL_HEADER */
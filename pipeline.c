@@ -0,0 +1,451 @@
+﻿/**
+	Pipelines for the Cross Platform C11 Native Threads library
+
+	Threading Building Blocks pipeline:
+		https://www.threadingbuildingblocks.org/docs/help/tbb_userguide/Working_on_the_Assembly_Line_pipeline.html
+*/
+#include "pipeline.h"
+
+#include <errno.h>  /* For errno */
+#include <stdlib.h> /* For malloc(), realloc(), free() */
+
+/* Initial number of stages of a pipeline, the array doubles when it is full */
+#define PIPELINE_STAGES 8
+
+
+
+/**
+ * Token of a pipeline, carrying one item at a time
+ *
+ * sequence		rank of the item in the input
+ * stage		next stage of the item
+ * owner		the token has been handed the serial stage it waits in, it goes through it without entering it again
+ * next			next token of the free stack, or of the waiting list of an out of order stage
+ */
+struct pipeline_token {
+	struct pipeline* pipeline;
+	void* item;
+	unsigned long long sequence;
+	unsigned int stage;
+	int owner;
+	struct pipeline_token* next;
+};
+
+
+
+/**
+ * Stage of a pipeline. The fields of a serial stage are protected by a spin lock, only held to enter and leave the stage
+ *
+ * busy			a token is in the stage
+ * sequence		sequence of the next token allowed in an in order stage
+ * ring			tokens waiting in an in order stage, by sequence modulo the number of tokens: they are never that far apart
+ * head, tail	tokens waiting in an out of order stage, first in first out
+ */
+struct pipeline_stage {
+	int mode;
+	pipeline_func_t func;
+	void* arg;
+	atomic_flag lock;
+	int busy;
+	unsigned long long sequence;
+	struct pipeline_token** ring;
+	struct pipeline_token* head;
+	struct pipeline_token* tail;
+};
+
+
+
+/**
+ * Pipeline, pipeline_t points to it
+ *
+ * stages		count stages in an array of capacity
+ * tokens		number of tokens in slots
+ * free			tokens without item, a lock-free stack only popped by the thread holding the input
+ * input		set while a thread runs the first stage
+ * done			the first stage has returned NULL
+ * sequence		sequence of the next item read, written by the thread holding the input
+ * running		set while the pipeline runs
+ * group		task group of the tasks of the current run, its pool is the pool of the pipeline
+ */
+struct pipeline {
+	struct pipeline_stage* stages;
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int tokens;
+	struct pipeline_token* slots;
+	_Atomic(struct pipeline_token*) free;
+	atomic_int input;
+	atomic_int done;
+	unsigned long long sequence;
+	atomic_int running;
+	tpool_group_t group;
+};
+
+
+
+static void pipeline_spawn(struct pipeline* pipeline, tpool_func_t func, void* arg);
+static void pipeline_feed_task(void* param);
+static void pipeline_resume_task(void* param);
+
+
+
+static void pipeline_lock(struct pipeline_stage* stage) {
+	while (atomic_flag_test_and_set_explicit(&stage->lock, memory_order_acquire)) {
+		thrd_relax();
+	}
+}
+
+
+
+static void pipeline_unlock(struct pipeline_stage* stage) {
+	atomic_flag_clear_explicit(&stage->lock, memory_order_release);
+}
+
+
+
+/**
+ * Pushes a token to the free stack
+ */
+static void pipeline_push(struct pipeline* pipeline, struct pipeline_token* token) {
+	struct pipeline_token* head = atomic_load_explicit(&pipeline->free, memory_order_relaxed);
+	do {
+		token->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&pipeline->free, &head, token, memory_order_seq_cst, memory_order_relaxed));
+}
+
+
+
+/**
+ * Pops a token from the free stack, returns NULL if it is empty. Only the thread holding the input pops: a token cannot be popped
+ * and pushed back between the read of the head and the CAS, there is no ABA
+ */
+static struct pipeline_token* pipeline_pop(struct pipeline* pipeline) {
+	struct pipeline_token* head = atomic_load_explicit(&pipeline->free, memory_order_acquire);
+	while (head != NULL && !atomic_compare_exchange_weak_explicit(&pipeline->free, &head, head->next, memory_order_acquire, memory_order_acquire)) {
+	}
+	return head;
+}
+
+
+
+/**
+ * Reads the next item into a free token, returns NULL if the input is held by another thread, exhausted, or every token is in flight.
+ * A token pushed while the input was held finds the input busy: the thread leaving the input looks at the free stack again and starts a task for it.
+ * The same task keeps the input going while tokens are left, in parallel with the item read here
+ */
+static struct pipeline_token* pipeline_feed(struct pipeline* pipeline) {
+	int input = 0;
+	if (atomic_load_explicit(&pipeline->done, memory_order_acquire)
+		|| !atomic_compare_exchange_strong_explicit(&pipeline->input, &input, 1, memory_order_seq_cst, memory_order_relaxed)) {
+		return NULL;
+	}
+
+	/* The thread that held the input may have seen its end meanwhile, the first stage is not called again */
+	if (atomic_load_explicit(&pipeline->done, memory_order_acquire)) {
+		atomic_store_explicit(&pipeline->input, 0, memory_order_seq_cst);
+		return NULL;
+	}
+
+	struct pipeline_token* token = pipeline_pop(pipeline);
+	if (token != NULL) {
+		struct pipeline_stage* first = &pipeline->stages[0];
+		token->item = first->func(NULL, first->arg);
+		if (token->item == NULL) {
+			atomic_store_explicit(&pipeline->done, 1, memory_order_release);
+			pipeline_push(pipeline, token);
+			token = NULL;
+		} else {
+			token->sequence = pipeline->sequence++;
+			token->stage = 1;
+			token->owner = 0;
+		}
+	}
+
+	atomic_store_explicit(&pipeline->input, 0, memory_order_seq_cst);
+	if (!atomic_load_explicit(&pipeline->done, memory_order_acquire) && atomic_load_explicit(&pipeline->free, memory_order_seq_cst) != NULL) {
+		pipeline_spawn(pipeline, pipeline_feed_task, pipeline);
+	}
+	return token;
+}
+
+
+
+/**
+ * Lets a token in a serial stage, returns 0 if it has to wait: it is then kept by the stage until its turn comes
+ */
+static int pipeline_enter(struct pipeline* pipeline, struct pipeline_stage* stage, struct pipeline_token* token) {
+	pipeline_lock(stage);
+	if (!stage->busy && (stage->mode == pipeline_serial_out_of_order || token->sequence == stage->sequence)) {
+		stage->busy = 1;
+		pipeline_unlock(stage);
+		return 1;
+	}
+
+	if (stage->mode == pipeline_serial_in_order) {
+		stage->ring[token->sequence % pipeline->tokens] = token;
+	} else {
+		token->next = NULL;
+		if (stage->tail != NULL) {
+			stage->tail->next = token;
+		} else {
+			stage->head = token;
+		}
+		stage->tail = token;
+	}
+	pipeline_unlock(stage);
+	return 0;
+}
+
+
+
+/**
+ * Lets a token out of a serial stage. The stage is handed over to the next waiting token, if any, which is resumed by a new task:
+ * the calling worker goes on with its own token
+ */
+static void pipeline_leave(struct pipeline* pipeline, struct pipeline_stage* stage) {
+	struct pipeline_token* next;
+	pipeline_lock(stage);
+	if (stage->mode == pipeline_serial_in_order) {
+		++stage->sequence;
+		next = stage->ring[stage->sequence % pipeline->tokens];
+		if (next != NULL && next->sequence == stage->sequence) {
+			stage->ring[stage->sequence % pipeline->tokens] = NULL;
+		} else {
+			next = NULL;
+		}
+	} else {
+		next = stage->head;
+		if (next != NULL) {
+			stage->head = next->next;
+			if (stage->head == NULL) {
+				stage->tail = NULL;
+			}
+		}
+	}
+	stage->busy = next != NULL;
+	pipeline_unlock(stage);
+
+	if (next != NULL) {
+		next->owner = 1;
+		pipeline_spawn(pipeline, pipeline_resume_task, next);
+	}
+}
+
+
+
+/**
+ * Carries a token through the stages, returns 0 if it has been left waiting in a serial stage
+ */
+static int pipeline_advance(struct pipeline* pipeline, struct pipeline_token* token) {
+	while (token->stage < pipeline->count) {
+		struct pipeline_stage* stage = &pipeline->stages[token->stage];
+		int serial = stage->mode != pipeline_parallel;
+		if (serial && !token->owner && !pipeline_enter(pipeline, stage, token)) {
+			return 0;
+		}
+
+		token->owner = 0;
+		token->item = stage->func(token->item, stage->arg);
+		if (serial) {
+			pipeline_leave(pipeline, stage);
+		}
+		token->stage++;
+	}
+	return 1;
+}
+
+
+
+/**
+ * Carries token through the pipeline, then reads a new item into it and carries it again, as long as the input goes on
+ */
+static void pipeline_carry(struct pipeline* pipeline, struct pipeline_token* token) {
+	for (;;) {
+		if (token == NULL && (token = pipeline_feed(pipeline)) == NULL) {
+			return;
+		}
+		if (!pipeline_advance(pipeline, token)) {
+			return;
+		}
+
+		pipeline_push(pipeline, token);
+		token = NULL;
+	}
+}
+
+
+
+/**
+ * Task reading new items, the pipeline outlives it: the task counts in the group of the run
+ */
+static void pipeline_feed_task(void* param) {
+	struct pipeline* pipeline = (struct pipeline*) param;
+	pipeline_carry(pipeline, NULL);
+	tpool_group_done(&pipeline->group);
+}
+
+
+
+/**
+ * Task carrying on a token that was waiting in a serial stage
+ */
+static void pipeline_resume_task(void* param) {
+	struct pipeline_token* token = (struct pipeline_token*) param;
+	struct pipeline* pipeline = token->pipeline;
+	pipeline_carry(pipeline, token);
+	tpool_group_done(&pipeline->group);
+}
+
+
+
+/**
+ * Submits a task of the current run, from a worker the task goes to its deque
+ */
+static void pipeline_spawn(struct pipeline* pipeline, tpool_func_t func, void* arg) {
+	tpool_group_add(&pipeline->group, 1);
+	if (tpool_submit(pipeline->group.pool, func, arg) != thrd_success) {
+		func(arg);
+	}
+}
+
+
+
+int pipeline_create(__OUT__ pipeline_t* pipeline, tpool_t pool, unsigned int tokens) {
+	/* ERROR: No item could ever be in flight */
+	if (tokens == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	struct pipeline* self = (struct pipeline*) calloc(1, sizeof(struct pipeline));
+	struct pipeline_token* slots = (struct pipeline_token*) calloc(tokens, sizeof(struct pipeline_token));
+
+	/* ERROR: No memory for the pipeline */
+	if (self == NULL || slots == NULL) {
+		free(self);
+		free(slots);
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	self->tokens = tokens;
+	self->slots = slots;
+	for (unsigned int i = 0; i < tokens; ++i) {
+		slots[i].pipeline = self;
+	}
+	atomic_init(&self->free, NULL);
+	atomic_init(&self->input, 0);
+	atomic_init(&self->done, 0);
+	atomic_init(&self->running, 0);
+	tpool_group_init(&self->group, pool);
+	*pipeline = self;
+	return thrd_success;
+}
+
+
+
+void pipeline_destroy(pipeline_t pipeline) {
+	for (unsigned int i = 0; i < pipeline->count; ++i) {
+		free(pipeline->stages[i].ring);
+	}
+	free(pipeline->stages);
+	free(pipeline->slots);
+	free(pipeline);
+}
+
+
+
+int pipeline_stage(pipeline_t pipeline, int mode, pipeline_func_t func, void* arg) {
+	/* ERROR: A stage needs a function and a known mode */
+	if (func == NULL || (mode != pipeline_parallel && mode != pipeline_serial_in_order && mode != pipeline_serial_out_of_order)) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	/* ERROR: The stages are read by the workers of the current run */
+	if (atomic_load_explicit(&pipeline->running, memory_order_acquire)) {
+		errno = EBUSY;
+		return thrd_busy;
+	}
+
+	if (pipeline->count == pipeline->capacity) {
+		unsigned int capacity = (pipeline->capacity != 0) ? pipeline->capacity * 2 : PIPELINE_STAGES;
+		struct pipeline_stage* stages = (struct pipeline_stage*) realloc(pipeline->stages, capacity * sizeof(struct pipeline_stage));
+
+		/* ERROR: No memory for the stage */
+		if (stages == NULL) {
+			errno = ENOMEM;
+			return thrd_nomem;
+		}
+		pipeline->stages = stages;
+		pipeline->capacity = capacity;
+	}
+
+	/* The first stage is serialized by the input flag */
+	struct pipeline_stage* stage = &pipeline->stages[pipeline->count];
+	stage->mode = (pipeline->count != 0) ? mode : pipeline_parallel;
+	stage->ring = NULL;
+	if (stage->mode == pipeline_serial_in_order) {
+		stage->ring = (struct pipeline_token**) calloc(pipeline->tokens, sizeof(struct pipeline_token*));
+
+		/* ERROR: No memory for the waiting tokens */
+		if (stage->ring == NULL) {
+			errno = ENOMEM;
+			return thrd_nomem;
+		}
+	}
+	stage->func = func;
+	stage->arg = arg;
+	atomic_flag_clear(&stage->lock);
+	pipeline->count++;
+	return thrd_success;
+}
+
+
+
+int pipeline_run(pipeline_t pipeline) {
+	/* ERROR: A pipeline reads its items with its first stage */
+	if (pipeline->count == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	/* ERROR: A run is not over yet */
+	int running = 0;
+	if (!atomic_compare_exchange_strong_explicit(&pipeline->running, &running, 1, memory_order_acquire, memory_order_relaxed)) {
+		errno = EBUSY;
+		return thrd_busy;
+	}
+
+	/* No pool, the caller carries every item through the stages */
+	if (pipeline->group.pool == NULL) {
+		void* item;
+		while ((item = pipeline->stages[0].func(NULL, pipeline->stages[0].arg)) != NULL) {
+			for (unsigned int i = 1; i < pipeline->count; ++i) {
+				item = pipeline->stages[i].func(item, pipeline->stages[i].arg);
+			}
+		}
+		atomic_store_explicit(&pipeline->running, 0, memory_order_release);
+		return thrd_success;
+	}
+
+	/* Every token of the last run has been pushed back, the stack is rebuilt in slot order */
+	atomic_store_explicit(&pipeline->free, NULL, memory_order_relaxed);
+	for (unsigned int i = pipeline->tokens; i > 0; --i) {
+		pipeline_push(pipeline, &pipeline->slots[i - 1]);
+	}
+	for (unsigned int i = 0; i < pipeline->count; ++i) {
+		pipeline->stages[i].busy = 0;
+		pipeline->stages[i].sequence = 0;
+		pipeline->stages[i].head = NULL;
+		pipeline->stages[i].tail = NULL;
+	}
+	pipeline->sequence = 0;
+	atomic_store_explicit(&pipeline->done, 0, memory_order_relaxed);
+
+	pipeline_spawn(pipeline, pipeline_feed_task, pipeline);
+	tpool_group_wait(&pipeline->group);
+
+	atomic_store_explicit(&pipeline->running, 0, memory_order_release);
+	return thrd_success;
+}
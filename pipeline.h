@@ -0,0 +1,92 @@
+﻿#ifndef C11_THREADS_PIPELINE_HEADER
+#define C11_THREADS_PIPELINE_HEADER
+
+#include "threads.h"
+#include "tpool.h"
+
+
+
+/**
+ * Pipelines: items read by a first stage flow through a chain of stages run on a pool, with at most a given number of items in flight.
+ * Each item travels on a token, carried from stage to stage by the same worker as long as it is not held up by a serial stage,
+ * so that the item stays in the cache of that worker. A token held up waits in its stage without blocking the worker,
+ * and is handed to a worker again by the token leaving the stage. A token is reused for a new item once its item has left the last stage.
+ */
+
+
+
+/**
+ * Pipeline, see pipeline.c
+ */
+typedef struct pipeline* pipeline_t;
+
+
+
+/**
+ * The type pipeline_func_t is the function of a stage, invoked as func(item, arg) on a worker. It returns the item passed to the next stage.
+ * The first stage is invoked with a NULL item and returns a new item, or NULL once the input is exhausted. The value returned by the last stage is ignored
+ */
+typedef void* (*pipeline_func_t)(void* item, void* arg);
+
+
+
+/**
+ * Stage mode enum, used by pipeline_stage
+ *
+ * pipeline_parallel				any number of items go through the stage at once
+ * pipeline_serial_in_order			one item at a time, in the order the first stage read them
+ * pipeline_serial_out_of_order		one item at a time, in any order
+ */
+enum {
+	pipeline_parallel,
+	pipeline_serial_in_order,
+	pipeline_serial_out_of_order
+};
+
+
+
+/**
+ * Creates an empty pipeline.
+ *
+ * @param pipeline		pointer to memory location to put the identifier of the new pipeline
+ * @param pool			identifier of the pool to run the stages on, NULL for the shared pool
+ * @param tokens		highest number of items in flight, at least 1
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int pipeline_create(__OUT__ pipeline_t* pipeline, tpool_t pool, unsigned int tokens);
+
+
+
+/**
+ * Destroys a pipeline, which must not be running.
+ *
+ * @param pipeline		identifier of the pipeline
+ */
+void pipeline_destroy(pipeline_t pipeline);
+
+
+
+/**
+ * Appends a stage to a pipeline. Not allowed while the pipeline runs. The first stage reads the input: it is serial and in order whatever its mode.
+ *
+ * @param pipeline		identifier of the pipeline
+ * @param mode			pipeline_parallel, pipeline_serial_in_order or pipeline_serial_out_of_order
+ * @param func			function of the stage
+ * @param arg			argument to pass to the function
+ * @return				thrd_success if successful, thrd_busy if the pipeline is running. Otherwise returns thrd_nomem if there was insufficient amount of memory
+ *						or thrd_error if another error occurred.
+ */
+int pipeline_stage(pipeline_t pipeline, int mode, pipeline_func_t func, void* arg);
+
+
+
+/**
+ * Runs a pipeline until its first stage returns NULL and every item read has left the last stage. Called from a worker of the pool, the worker runs pending tasks meanwhile.
+ * A pipeline can be run again once a run is over.
+ *
+ * @param pipeline		identifier of the pipeline
+ * @return				thrd_success if successful, thrd_busy if the pipeline is already running, thrd_error otherwise.
+ */
+int pipeline_run(pipeline_t pipeline);
+
+#endif /* C11_THREADS_PIPELINE_HEADER */
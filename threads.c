@@ -15,28 +15,1450 @@
 
 #ifdef __unix__
 	#define thrd_errno errno
-	typedef void*(*POSIX_START_ROUTINE)(void*);
+	#include <sched.h>			/* For sched_yield() */
+	#include <sys/mman.h>		/* For mmap() */
+	#include <sys/prctl.h>		/* For PR_SET_TIMERSLACK */
+	#include <sys/resource.h>	/* For setpriority() */
+	#include <sys/syscall.h>	/* For SYS_gettid */
+	#include <unistd.h>			/* For syscall() */
 #endif /* __unix__ */
 
 #ifdef _WIN32
 	#define thrd_errno GetLastError()
 #endif /* _WIN32 */
 
+#ifdef __linux__
+	#include <linux/mempolicy.h>	/* For MPOL_PREFERRED */
+#endif /* __linux__ */
+
+#include "futex.h"
+#include "topology.h"
 #include <errno.h>  /* For errno */
+#include <limits.h> /* For INT_MAX */
+#include <stdlib.h> /* For malloc(), free() */
+#include <string.h> /* For memset(), strncpy() */
+
+
+
+/**
+ * Posix: 
+ * 		http://man7.org/linux/man-pages/man3/pthread_create.3.html
+ * Windows: 
+ * 		https://msdn.microsoft.com/fr-fr/library/windows/desktop/ms682516(v=vs.85).aspx
+ * 		https://msdn.microsoft.com/fr-fr/library/windows/desktop/ms682453(v=vs.85).aspx
+*/
+int thrd_create(__OUT__ thrd_t* thr, thrd_start_t func, void* arg) {
+	return thrd_create_ex(thr, NULL, func, arg);
+}
+
+
+
+/* Attributes used when thrd_create_ex is called without attributes: nothing set */
+static const thrd_attr_t thrd_attr_default;
+
+
+
+/**
+ * Start gate of thrd_create_n, threads wait on open before calling their function
+ * The creating thread owns the gate, it waits for pending to reach 0 before returning, no thread touches the gate after that
+ *
+ * open			0 while closed, 1 once open, -1 if the creation failed and the threads must not call their function
+ * pending		number of threads that have not passed the gate yet
+ */
+typedef struct {
+	atomic_int open;
+	atomic_int pending;
+} thrd_gate_t;
+
+
+
+/**
+ * Waits for the gate to open, returns non-zero if the function of the thread must be called
+ */
+static int thrd_gate_pass(thrd_gate_t* gate) {
+	int open;
+	while ((open = atomic_load_explicit(&gate->open, memory_order_acquire)) == 0) {
+		futex_wait(&gate->open, 0, NULL);
+	}
+
+	if (atomic_fetch_sub_explicit(&gate->pending, 1, memory_order_acq_rel) == 1) {
+		futex_wake(&gate->pending, 1);
+	}
+	return open > 0;
+}
+
+
+
+/**
+ * Opens (or cancels) the gate with a single wake-up of every thread, then waits until they have all passed it
+ */
+static void thrd_gate_open(thrd_gate_t* gate, int open) {
+	atomic_store_explicit(&gate->open, open, memory_order_release);
+	futex_wake(&gate->open, INT_MAX);
+
+	int pending;
+	while ((pending = atomic_load_explicit(&gate->pending, memory_order_acquire)) != 0) {
+		futex_wait(&gate->pending, pending, NULL);
+	}
+}
+
+
+
+#ifdef __unix__
+/**
+ * Thread state enum, bits of the state word of a control block, the state word is also a futex word
+ *
+ * thrd_state_finished		the start function has returned or thrd_exit has been called, res is valid
+ * thrd_state_detached		the thread has been detached, the block is released by whoever comes last
+ * thrd_state_waiting		a thread is blocked in futex_wait on the state word
+ * thrd_state_any			a thread is blocked in thrd_join_any on thrd_finished_seq
+ */
+enum {
+	thrd_state_finished = 1 << 0,
+	thrd_state_detached = 1 << 1,
+	thrd_state_waiting  = 1 << 2,
+	thrd_state_any      = 1 << 3
+};
+
+
+
+/**
+ * Control block of a thread, thrd_t points to it.
+ * The block outlives the OS thread until it is joined, or until it is both detached and finished.
+ * A recyclable OS thread runs several blocks one after the other, its blocks are joined through the state word instead of pthread_join.
+ * Blocks of threads not created by the library (e.g. main) are adopted by thrd_current and released when their thread exits.
+ */
+struct thrd_control {
+	pthread_t handle;
+	thrd_start_t func;
+	void* arg;
+	int res;
+	atomic_int state;
+	int recyclable;
+	int adopted;
+
+	/* Set by thrd_set_affinity, a recycled thread restores its affinity before parking */
+	atomic_int repinned;
+
+	/* Stack mapped by the library for a NUMA node, including its guard area, unmapped once the thread has been joined */
+	void* stack;
+	size_t stack_size;
+
+	/* Startup handshake, attr is only valid until started is set */
+	const thrd_attr_t* attr;
+	int status;
+	atomic_int started;
+
+	/* Start gate of thrd_create_n, NULL otherwise */
+	thrd_gate_t* gate;
+
+	/* Next free block of the slab free list */
+	struct thrd_control* next;
+};
+
+
+
+/**
+ * Recyclable OS thread parked in the idle cache, it lives on the stack of its own thread.
+ * The name, priority, scheduling policy and affinity the thread had before a block changed them are saved, and restored before parking.
+ */
+struct thrd_worker {
+	pthread_t handle;
+	atomic_int wake;
+	struct thrd_control* block;
+	struct thrd_worker* next;
+	unsigned int saved;
+	unsigned int dirty;
+	char name[THRD_NAME_MAX];
+	int priority;
+	int policy;
+	struct sched_param param;
+	#ifdef __linux__
+		cpu_set_t affinity;
+	#endif /* __linux__ */
+};
+
+
+
+/* Control block of the calling thread */
+static _Thread_local struct thrd_control* thrd_self = NULL;
+
+/* Recyclable OS thread of the calling thread, NULL if it is not recyclable */
+static _Thread_local struct thrd_worker* thrd_self_worker = NULL;
+
+/* Releases adopted control blocks when their thread exits */
+static pthread_once_t thrd_adopted_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thrd_adopted_key;
+
+/* Detached threads with a library stack that have finished, they are joined and unmapped by thrd_zombie_reap */
+static _Atomic(struct thrd_control*) thrd_zombies = NULL;
+
+/* Futex word of thrd_join_any, bumped when a thread with thrd_state_any finishes. Static so that no waiter can go away under a waker */
+static atomic_int thrd_finished_seq = 0;
+
+/* Idle cache of recyclable OS threads, a LIFO so that the most recently used stacks are reused first */
+static pthread_mutex_t thrd_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thrd_worker* thrd_idle = NULL;
+static unsigned int thrd_idle_count = 0;
+static atomic_uint thrd_idle_capacity = 0;
+#endif /* __unix__ */
+
+
+
+#ifdef _WIN32
+/**
+ * Startup block of a thread, only used until the trampoline has read func and arg
+ */
+struct thrd_control {
+	thrd_start_t func;
+	void* arg;
+	thrd_gate_t* gate;
+
+	/* Next free block of the slab free list */
+	struct thrd_control* next;
+};
+#endif /* _WIN32 */
+
+
+
+/* Blocking hook of the calling thread, see thrd_set_blocking_hook */
+static _Thread_local thrd_blocking_t thrd_blocking_hook = NULL;
+
+
+
+/**
+ * Calls the blocking hook of the calling thread if it has one, blocking is 1 before the thread may sleep and 0 once it runs again
+ */
+static void thrd_blocking(int blocking) {
+	thrd_blocking_t hook = thrd_blocking_hook;
+	if (hook != NULL) {
+		hook(blocking);
+	}
+}
+
+
+
+/**
+ * Control blocks are carved from slabs of THRD_SLAB_BLOCKS blocks, creating a thread does not call malloc once the slabs are warm.
+ * Released blocks go back to a free list protected by a spin lock, slabs are never returned to the system:
+ * a late futex_wake on a released block never touches unmapped memory.
+ */
+#define THRD_SLAB_BLOCKS 64
+
+static atomic_flag thrd_slab_lock = ATOMIC_FLAG_INIT;
+static struct thrd_control* thrd_slab_free = NULL;
+
+
+
+static void thrd_slab_acquire(void) {
+	while (atomic_flag_test_and_set_explicit(&thrd_slab_lock, memory_order_acquire)) {
+		thrd_yield();
+	}
+}
+
+
+
+static void thrd_slab_release(void) {
+	atomic_flag_clear_explicit(&thrd_slab_lock, memory_order_release);
+}
+
+
+
+static struct thrd_control* thrd_control_alloc(void) {
+	thrd_slab_acquire();
+	struct thrd_control* block = thrd_slab_free;
+	if (block != NULL) {
+		thrd_slab_free = block->next;
+	}
+	thrd_slab_release();
+
+	/* Empty free list: a new slab is allocated outside of the lock, its first block is used and the others are made free */
+	if (block == NULL) {
+		struct thrd_control* slab = (struct thrd_control*) malloc(THRD_SLAB_BLOCKS * sizeof(struct thrd_control));
+		if (slab == NULL) {
+			return NULL;
+		}
+		for (int i = 1; i < THRD_SLAB_BLOCKS - 1; ++i) {
+			slab[i].next = &slab[i + 1];
+		}
+
+		thrd_slab_acquire();
+		slab[THRD_SLAB_BLOCKS - 1].next = thrd_slab_free;
+		thrd_slab_free = &slab[1];
+		thrd_slab_release();
+		block = &slab[0];
+	}
+
+	memset(block, 0, sizeof(struct thrd_control));
+	return block;
+}
+
+
+
+static void thrd_control_free(struct thrd_control* block) {
+	thrd_slab_acquire();
+	block->next = thrd_slab_free;
+	thrd_slab_free = block;
+	thrd_slab_release();
+}
+
+
+
+#ifdef __unix__
+static void thrd_adopted_release(void* param) {
+	thrd_control_free((struct thrd_control*) param);
+}
+
+
+
+static void thrd_adopted_init(void) {
+	pthread_key_create(&thrd_adopted_key, thrd_adopted_release);
+}
+
+
+
+/**
+ * Releases the block of a thread that has been joined, and the stack the library mapped for it
+ *
+ * Posix:	http://man7.org/linux/man-pages/man2/munmap.2.html
+ */
+static void thrd_control_release(struct thrd_control* block) {
+	if (block->stack != NULL) {
+		munmap(block->stack, block->stack_size);
+	}
+	thrd_control_free(block);
+}
+
+
+
+/**
+ * A thread cannot unmap the stack it runs on: a detached thread with a library stack is kept joinable, and queued here once finished
+ */
+static void thrd_zombie_push(struct thrd_control* block) {
+	struct thrd_control* head = atomic_load_explicit(&thrd_zombies, memory_order_relaxed);
+	do {
+		block->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&thrd_zombies, &head, block, memory_order_release, memory_order_relaxed));
+}
+
+
+
+/**
+ * Joins the queued threads and releases their stacks, called on each thread creation
+ */
+static void thrd_zombie_reap(void) {
+	if (atomic_load_explicit(&thrd_zombies, memory_order_relaxed) == NULL) {
+		return;
+	}
+
+	struct thrd_control* block = atomic_exchange_explicit(&thrd_zombies, NULL, memory_order_acquire);
+	while (block != NULL) {
+		struct thrd_control* next = block->next;
+		pthread_join(block->handle, NULL);
+		thrd_control_release(block);
+		block = next;
+	}
+}
+
+
+
+/**
+ * Maps a stack of the requested size and guard size, whose pages are allocated on node, returns 0 or a posix error value
+ * The policy is preferred rather than strict, a full node falls back to another one instead of failing the page fault
+ *
+ * Linux:
+ * 		http://man7.org/linux/man-pages/man2/mmap.2.html
+ * 		http://man7.org/linux/man-pages/man2/mbind.2.html
+ */
+static int thrd_stack_map(const thrd_attr_t* attr, size_t default_size, __INOUT__ struct thrd_control* block, __OUT__ void** stack, __OUT__ size_t* size) {
+	#ifdef __linux__
+		size_t page = (size_t) sysconf(_SC_PAGESIZE);
+		*size = (((attr->flags & thrd_attr_stacksize) ? attr->stack_size : default_size) + page - 1) & ~(page - 1);
+		size_t guard = (attr->flags & thrd_attr_guardsize) ? (attr->guard_size + page - 1) & ~(page - 1) : page;
+
+		char* base = (char*) mmap(NULL, guard + *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+		if (base == MAP_FAILED) {
+			return errno;
+		}
+
+		/* No page has been touched yet, every page of the stack (and the TLS placed at its top) is allocated on node */
+		unsigned long nodes[THRD_CPUSET_SIZE / THRD_CPUSET_BITS] = { 0 };
+		nodes[attr->node / THRD_CPUSET_BITS] = 1UL << (attr->node % THRD_CPUSET_BITS);
+		if ((guard != 0 && mprotect(base, guard, PROT_NONE) != 0)
+			|| syscall(SYS_mbind, base + guard, *size, MPOL_PREFERRED, nodes, (unsigned long) THRD_CPUSET_SIZE + 1, 0) != 0) {
+			int value = errno;
+			munmap(base, guard + *size);
+			return value;
+		}
+
+		block->stack = base;
+		block->stack_size = guard + *size;
+		*stack = base + guard;
+		return 0;
+	#else
+		(void) attr;
+		(void) default_size;
+		(void) block;
+		(void) stack;
+		(void) size;
+		return ENOSYS;
+	#endif /* __linux__ */
+}
+
+
+
+#ifdef __linux__
+static void thrd_cpuset_to_posix(const thrd_cpuset_t* cpuset, __OUT__ cpu_set_t* set) {
+	CPU_ZERO(set);
+	for (int cpu = 0; cpu < THRD_CPUSET_SIZE && cpu < CPU_SETSIZE; ++cpu) {
+		if (thrd_cpuset_isset(cpuset, cpu)) {
+			CPU_SET(cpu, set);
+		}
+	}
+}
+
+
+
+/**
+ * Sets the scheduling policy of the calling thread, returns 0 or a posix error value
+ * Without privileges, SCHED_FIFO falls back to SCHED_OTHER with the lowest nice value RLIMIT_NICE permits (20 - rlim_cur)
+ *
+ * Linux:
+ * 		http://man7.org/linux/man-pages/man7/sched.7.html
+ * 		http://man7.org/linux/man-pages/man3/pthread_setschedparam.3.html
+ */
+static int thrd_policy_apply(int policy, int rt_priority, pid_t tid) {
+	static const int posix[] = { SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO };
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	if (policy == thrd_sched_fifo) {
+		param.sched_priority = rt_priority;
+	}
+
+	int value = pthread_setschedparam(pthread_self(), posix[policy], &param);
+	if (value == EPERM && policy == thrd_sched_fifo) {
+		param.sched_priority = 0;
+		value = pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+		/* The nice value is best effort, the thread keeps its own one if RLIMIT_NICE does not permit a lower one */
+		struct rlimit limit;
+		if (value == 0 && getrlimit(RLIMIT_NICE, &limit) == 0) {
+			int lowest = 20 - (int) ((limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > 40) ? 40 : limit.rlim_cur);
+			errno = 0;
+			int priority = getpriority(PRIO_PROCESS, (id_t) tid);
+			if (errno == 0 && lowest < priority) {
+				setpriority(PRIO_PROCESS, (id_t) tid, lowest);
+			}
+		}
+	}
+	return value;
+}
+
+
+
+/**
+ * Saves the settings of a recyclable thread that flags is about to change, only the first time they change
+ */
+static void thrd_worker_save(struct thrd_worker* worker, unsigned int flags, pid_t tid) {
+	flags &= thrd_attr_name | thrd_attr_priority | thrd_attr_affinity | thrd_attr_policy;
+
+	if ((flags & ~worker->saved) & thrd_attr_name) {
+		pthread_getname_np(worker->handle, worker->name, THRD_NAME_MAX);
+	}
+	if ((flags & ~worker->saved) & thrd_attr_priority) {
+		errno = 0;
+		worker->priority = getpriority(PRIO_PROCESS, (id_t) tid);
+	}
+	if ((flags & ~worker->saved) & thrd_attr_affinity) {
+		pthread_getaffinity_np(worker->handle, sizeof(cpu_set_t), &worker->affinity);
+	}
+	if ((flags & ~worker->saved) & thrd_attr_policy) {
+		pthread_getschedparam(worker->handle, &worker->policy, &worker->param);
+	}
+
+	worker->saved |= flags;
+	worker->dirty |= flags;
+}
+
+
+
+/**
+ * Restores the settings changed by the last block, returns 0 or a posix error value
+ * Restoring a lower nice value, or leaving SCHED_IDLE, needs privileges: an unprivileged thread that cannot be restored is not recycled
+ */
+static int thrd_worker_restore(struct thrd_worker* worker) {
+	int value = 0;
+
+	if (worker->dirty & thrd_attr_name) {
+		value = pthread_setname_np(worker->handle, worker->name);
+	}
+	if (value == 0 && (worker->dirty & thrd_attr_policy)) {
+		value = pthread_setschedparam(worker->handle, worker->policy, &worker->param);
+	}
+	if (value == 0 && (worker->dirty & thrd_attr_priority)) {
+		if (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), worker->priority) != 0) {
+			value = errno;
+		}
+	}
+	if (value == 0 && (worker->dirty & thrd_attr_affinity)) {
+		value = pthread_setaffinity_np(worker->handle, sizeof(cpu_set_t), &worker->affinity);
+	}
+
+	worker->dirty = 0;
+	return value;
+}
+#endif /* __linux__ */
+
+
+
+/**
+ * Applies name, scheduling policy and priority to the calling thread, and affinity too if it is a recycled thread. Returns 0 or a posix error value
+ *
+ * Posix:
+ * 		http://man7.org/linux/man-pages/man3/pthread_setname_np.3.html
+ * 		http://man7.org/linux/man-pages/man2/setpriority.2.html
+ * 		http://man7.org/linux/man-pages/man3/pthread_setaffinity_np.3.html
+ */
+static int thrd_apply_self(const thrd_attr_t* attr, struct thrd_worker* worker) {
+	#ifdef __linux__
+		pid_t tid = (pid_t) syscall(SYS_gettid);
+		int value = 0;
+
+		if (worker != NULL) {
+			thrd_worker_save(worker, attr->flags, tid);
+		}
+
+		if (attr->flags & thrd_attr_name) {
+			value = pthread_setname_np(pthread_self(), attr->name);
+		}
+
+		/* The policy comes first, the nice value is then set within it */
+		if (value == 0 && (attr->flags & thrd_attr_policy)) {
+			value = thrd_policy_apply(attr->policy, attr->rt_priority, tid);
+		}
+
+		/* Linux: the nice value of a thread id only applies to that thread */
+		if (value == 0 && (attr->flags & thrd_attr_priority)) {
+			if (setpriority(PRIO_PROCESS, (id_t) tid, attr->priority) != 0) {
+				value = errno;
+			}
+		}
+
+		if (value == 0 && worker != NULL && (attr->flags & thrd_attr_affinity)) {
+			cpu_set_t set;
+			thrd_cpuset_to_posix(&attr->cpuset, &set);
+			value = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		}
+
+		return value;
+	#else
+		(void) attr;
+		(void) worker;
+		return ENOSYS;
+	#endif /* __linux__ */
+}
+
+
+
+/**
+ * Waits on the state word of block until it is finished, or until deadline (absolute TIME_UTC, may be NULL) has passed
+ */
+static int thrd_control_wait(struct thrd_control* block, const struct timespec* deadline) {
+	int state = atomic_load_explicit(&block->state, memory_order_acquire);
+	while (!(state & thrd_state_finished)) {
+		if (!(state & thrd_state_waiting)
+			&& !atomic_compare_exchange_weak_explicit(&block->state, &state, state | thrd_state_waiting, memory_order_acquire, memory_order_acquire)) {
+			continue;
+		}
+		if (futex_wait(&block->state, state | thrd_state_waiting, deadline) == thrd_timedout) {
+			state = atomic_load_explicit(&block->state, memory_order_acquire);
+			return (state & thrd_state_finished) ? thrd_success : thrd_timedout;
+		}
+		state = atomic_load_explicit(&block->state, memory_order_acquire);
+	}
+	return thrd_success;
+}
+
+
+
+/**
+ * Marks block as finished, also called by pthread_exit through the cleanup handler when thrd_exit is used
+ */
+static void thrd_finish(void* param) {
+	struct thrd_control* block = (struct thrd_control*) param;
+	thrd_self = NULL;
+
+	if (thrd_self_worker != NULL && atomic_load_explicit(&block->repinned, memory_order_relaxed)) {
+		thrd_self_worker->dirty |= thrd_attr_affinity;
+	}
+
+	int state = atomic_fetch_or_explicit(&block->state, thrd_state_finished, memory_order_acq_rel);
+	if (state & thrd_state_detached) {
+		if (block->stack != NULL) {
+			thrd_zombie_push(block);
+		} else {
+			thrd_control_free(block);
+		}
+	} else {
+		if (state & thrd_state_waiting) {
+			futex_wake(&block->state, INT_MAX);
+		}
+		if (state & thrd_state_any) {
+			atomic_fetch_add_explicit(&thrd_finished_seq, 1, memory_order_release);
+			futex_wake(&thrd_finished_seq, INT_MAX);
+		}
+	}
+}
+
+
+
+/**
+ * Runs block on the calling thread, returns 0 or the posix error value that prevented func from being called
+ */
+static int thrd_run(struct thrd_control* block, struct thrd_worker* worker) {
+	thrd_self = block;
+
+	/* The creating thread waits for the attributes to be applied, it owns block again if they could not */
+	if (block->attr != NULL) {
+		int status = thrd_apply_self(block->attr, worker);
+		block->status = status;
+		atomic_store_explicit(&block->started, 1, memory_order_release);
+		futex_wake(&block->started, 1);
+
+		if (status != 0) {
+			thrd_self = NULL;
+			return status;
+		}
+	}
+
+	/* A cancelled gate means that the creation of the group failed, the thread finishes without calling func */
+	if (block->gate != NULL && !thrd_gate_pass(block->gate)) {
+		thrd_finish(block);
+		return 0;
+	}
+
+	pthread_cleanup_push(thrd_finish, block);
+	block->res = block->func(block->arg);
+	pthread_cleanup_pop(1);
+	return 0;
+}
+
+
+
+/**
+ * Parks a recyclable thread in the idle cache until a block is handed to it, returns NULL if the thread must exit
+ */
+static struct thrd_control* thrd_park(struct thrd_worker* self) {
+	#ifdef __linux__
+		if (self->dirty != 0 && thrd_worker_restore(self) != 0) {
+			return NULL;
+		}
+	#endif /* __linux__ */
+
+	pthread_mutex_lock(&thrd_idle_lock);
+	if (thrd_idle_count >= atomic_load_explicit(&thrd_idle_capacity, memory_order_relaxed)) {
+		pthread_mutex_unlock(&thrd_idle_lock);
+		return NULL;
+	}
+	self->block = NULL;
+	atomic_store_explicit(&self->wake, 0, memory_order_relaxed);
+	self->next = thrd_idle;
+	thrd_idle = self;
+	++thrd_idle_count;
+	pthread_mutex_unlock(&thrd_idle_lock);
+
+	while (atomic_load_explicit(&self->wake, memory_order_acquire) == 0) {
+		futex_wait(&self->wake, 0, NULL);
+	}
+	return self->block;
+}
+
+
+
+static struct thrd_worker* thrd_idle_pop(void) {
+	pthread_mutex_lock(&thrd_idle_lock);
+	struct thrd_worker* worker = thrd_idle;
+	if (worker != NULL) {
+		thrd_idle = worker->next;
+		--thrd_idle_count;
+	}
+	pthread_mutex_unlock(&thrd_idle_lock);
+	return worker;
+}
+
+
+
+/**
+ * Hands block to a parked thread, a NULL block makes it exit
+ */
+static void thrd_idle_resume(struct thrd_worker* worker, struct thrd_control* block) {
+	worker->block = block;
+	atomic_store_explicit(&worker->wake, 1, memory_order_release);
+	futex_wake(&worker->wake, 1);
+}
+
+
+
+/**
+ * Start routine of every thread created by the library
+ */
+static void* thrd_main(void* param) {
+	struct thrd_control* block = (struct thrd_control*) param;
+	if (!block->recyclable) {
+		thrd_run(block, NULL);
+		return NULL;
+	}
+
+	struct thrd_worker self;
+	memset(&self, 0, sizeof(self));
+	self.handle = pthread_self();
+	thrd_self_worker = &self;
+
+	/* thrd_set_affinity may change the affinity from another thread at any time, it is saved before the first block runs */
+	#ifdef __linux__
+		if (pthread_getaffinity_np(self.handle, sizeof(cpu_set_t), &self.affinity) == 0) {
+			self.saved |= thrd_attr_affinity;
+		}
+	#endif /* __linux__ */
+
+	while (block != NULL) {
+		thrd_run(block, &self);
+		block = thrd_park(&self);
+	}
+	return NULL;
+}
+
+
+
+/**
+ * Converts attr to posix attributes, properties must be destroyed by the caller if 0 is returned
+ * Recyclable threads are created detached, they apply their affinity themselves like a recycled thread would
+ * A thread created on a NUMA node gets a stack mapped on that node, and the CPUs of the node unless an affinity is set
+ *
+ * Posix:	http://man7.org/linux/man-pages/man3/pthread_attr_init.3.html
+ */
+static int thrd_attr_to_posix(const thrd_attr_t* attr, __INOUT__ struct thrd_control* block, __OUT__ pthread_attr_t* properties) {
+	int value = pthread_attr_init(properties);
+	if (value != 0) {
+		return value;
+	}
+
+	int recyclable = block->recyclable;
+	int stack = 0;
+	if (recyclable) {
+		value = pthread_attr_setdetachstate(properties, PTHREAD_CREATE_DETACHED);
+	} else if (attr->flags & thrd_attr_stack) {
+		value = pthread_attr_setstack(properties, attr->stack_addr, attr->stack_size);
+		stack = 1;
+	} else if (attr->flags & thrd_attr_node) {
+		size_t default_size = 0;
+		void* addr = NULL;
+		size_t size = 0;
+		pthread_attr_getstacksize(properties, &default_size);
+		value = thrd_stack_map(attr, default_size, block, &addr, &size);
+		if (value == 0) {
+			value = pthread_attr_setstack(properties, addr, size);
+		}
+		stack = 1;
+	} else if (attr->flags & thrd_attr_stacksize) {
+		value = pthread_attr_setstacksize(properties, attr->stack_size);
+	}
+
+	/* The guard area of a stack given to pthread_attr_setstack is ignored, the library maps its own */
+	if (value == 0 && !recyclable && !stack && (attr->flags & thrd_attr_guardsize)) {
+		value = pthread_attr_setguardsize(properties, attr->guard_size);
+	}
+
+	/* The affinity is set by the system before the thread starts, there is no window where it runs on another CPU */
+	if (value == 0 && !recyclable && (attr->flags & (thrd_attr_affinity | thrd_attr_node))) {
+		#ifdef __linux__
+			thrd_cpuset_t cpuset = attr->cpuset;
+			if (!(attr->flags & thrd_attr_affinity) && topo_cpuset(topo_node, attr->node, &cpuset) != thrd_success) {
+				value = EINVAL;
+			}
+
+			cpu_set_t set;
+			thrd_cpuset_to_posix(&cpuset, &set);
+			if (value == 0) {
+				value = pthread_attr_setaffinity_np(properties, sizeof(set), &set);
+			}
+		#else
+			value = ENOSYS;
+		#endif /* __linux__ */
+	}
+
+	if (value != 0) {
+		pthread_attr_destroy(properties);
+	}
+	return value;
+}
+#endif /* __unix__ */
+
+
+
+#ifdef _WIN32
+/**
+ * Start routine of every thread created by the library, the int result of func becomes the exit code of the thread
+ * The calling convention of LPTHREAD_START_ROUTINE is WINAPI, func cannot be passed directly to CreateThread
+ */
+static DWORD WINAPI thrd_main(LPVOID param) {
+	struct thrd_control* block = (struct thrd_control*) param;
+	thrd_start_t func = block->func;
+	void* arg = block->arg;
+	thrd_gate_t* gate = block->gate;
+	thrd_control_free(block);
+
+	/* A cancelled gate means that the creation of the group failed, the thread exits without calling func */
+	if (gate != NULL && !thrd_gate_pass(gate)) {
+		return 0;
+	}
+	return (DWORD) func(arg);
+}
+
+
+
+/**
+ * Maps a nice value to the closest Windows thread priority level
+ */
+static int thrd_priority_to_windows(int priority) {
+	if (priority <= -15) {
+		return THREAD_PRIORITY_HIGHEST;
+	} else if (priority <= -5) {
+		return THREAD_PRIORITY_ABOVE_NORMAL;
+	} else if (priority < 5) {
+		return THREAD_PRIORITY_NORMAL;
+	} else if (priority < 15) {
+		return THREAD_PRIORITY_BELOW_NORMAL;
+	} else {
+		return THREAD_PRIORITY_LOWEST;
+	}
+}
+
+
+
+/**
+ * Maps a scheduling policy to a Windows thread priority level, within the priority class of the process
+ */
+static int thrd_policy_to_windows(int policy) {
+	if (policy == thrd_sched_batch) {
+		return THREAD_PRIORITY_BELOW_NORMAL;
+	} else if (policy == thrd_sched_idle) {
+		return THREAD_PRIORITY_IDLE;
+	} else if (policy == thrd_sched_fifo) {
+		return THREAD_PRIORITY_TIME_CRITICAL;
+	} else {
+		return THREAD_PRIORITY_NORMAL;
+	}
+}
+
+
+
+/**
+ * Applies affinity, priority, policy and name to a suspended thread, returns FALSE on error
+ *
+ * Windows:
+ * 		https://msdn.microsoft.com/en-us/library/windows/desktop/ms686247(v=vs.85).aspx
+ * 		https://msdn.microsoft.com/en-us/library/windows/desktop/ms686277(v=vs.85).aspx
+ * 		https://docs.microsoft.com/en-us/windows/win32/api/processthreadsapi/nf-processthreadsapi-setthreaddescription
+ */
+static BOOL thrd_apply_suspended(HANDLE thr, const thrd_attr_t* attr) {
+	if (attr->flags & thrd_attr_affinity) {
+		/* Only the first processor group can be represented by a DWORD_PTR mask */
+		DWORD_PTR mask = 0;
+		for (int cpu = 0; cpu < (int) (8 * sizeof(DWORD_PTR)); ++cpu) {
+			if (thrd_cpuset_isset(&attr->cpuset, cpu)) {
+				mask |= ((DWORD_PTR) 1) << cpu;
+			}
+		}
+		if (SetThreadAffinityMask(thr, mask) == 0) {
+			return FALSE;
+		}
+	}
+
+	/* The stack is committed by the thread itself once it runs on the node, its pages are local */
+	if ((attr->flags & thrd_attr_node) && !(attr->flags & thrd_attr_affinity)) {
+		GROUP_AFFINITY affinity;
+		memset(&affinity, 0, sizeof(affinity));
+		if (GetNumaNodeProcessorMaskEx((USHORT) attr->node, &affinity) == 0 || SetThreadGroupAffinity(thr, &affinity, NULL) == 0) {
+			return FALSE;
+		}
+	}
+
+	if (attr->flags & thrd_attr_priority) {
+		if (SetThreadPriority(thr, thrd_priority_to_windows(attr->priority)) == 0) {
+			return FALSE;
+		}
+	}
+
+	/* There is a single priority level per thread, a policy other than normal overrides the nice value */
+	if ((attr->flags & thrd_attr_policy) && attr->policy != thrd_sched_normal) {
+		if (SetThreadPriority(thr, thrd_policy_to_windows(attr->policy)) == 0) {
+			return FALSE;
+		}
+	}
+
+	if (attr->flags & thrd_attr_name) {
+		WCHAR name[THRD_NAME_MAX];
+		if (MultiByteToWideChar(CP_UTF8, 0, attr->name, -1, name, THRD_NAME_MAX) == 0) {
+			return FALSE;
+		}
+		if (FAILED(SetThreadDescription(thr, name))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+#endif /* _WIN32 */
+
+
+
+/**
+ * Creates a thread, gate is the start gate of thrd_create_n or NULL
+ *
+ * Posix:
+ * 		http://man7.org/linux/man-pages/man3/pthread_create.3.html
+ * 		http://man7.org/linux/man-pages/man3/pthread_attr_setaffinity_np.3.html
+ * Windows:
+ * 		https://msdn.microsoft.com/fr-fr/library/windows/desktop/ms682453(v=vs.85).aspx
+ */
+static int thrd_spawn(__OUT__ thrd_t* thr, const thrd_attr_t* attr, thrd_start_t func, void* arg, thrd_gate_t* gate) {
+	if (attr == NULL) {
+		attr = &thrd_attr_default;
+	}
+
+	#ifdef __unix__
+		struct thrd_control* block = thrd_control_alloc();
+
+		/* ERROR: No memory for the control block */
+		if (block == NULL) {
+			errno = ENOMEM;
+			return thrd_nomem;
+		}
+		thrd_zombie_reap();
+
+		/* Only threads with a system allocated default stack can be recycled */
+		block->func = func;
+		block->arg = arg;
+		block->gate = gate;
+		block->recyclable = atomic_load_explicit(&thrd_idle_capacity, memory_order_relaxed) != 0
+			&& (attr->flags & (thrd_attr_stacksize | thrd_attr_guardsize | thrd_attr_stack | thrd_attr_node)) == 0;
+
+		/* Name, priority and policy can only be set from the new thread, which reports back before calling func */
+		unsigned int self_flags = thrd_attr_name | thrd_attr_priority | thrd_attr_policy | (block->recyclable ? thrd_attr_affinity : 0);
+		if (attr->flags & self_flags) {
+			block->attr = attr;
+		}
+
+		int value = 0;
+		struct thrd_worker* worker = block->recyclable ? thrd_idle_pop() : NULL;
+		if (worker != NULL) {
+			block->handle = worker->handle;
+			thrd_idle_resume(worker, block);
+		} else {
+			pthread_attr_t properties;
+			value = thrd_attr_to_posix(attr, block, &properties);
+			if (value == 0) {
+				value = pthread_create(&block->handle, &properties, thrd_main, block);
+				pthread_attr_destroy(&properties);
+			}
+		}
+
+		if (value == 0 && block->attr != NULL) {
+			while (atomic_load_explicit(&block->started, memory_order_acquire) == 0) {
+				futex_wait(&block->started, 0, NULL);
+			}
+
+			/* The thread did not call func, a thread that is not recyclable is joined to release its resources */
+			if (block->status != 0) {
+				value = block->status;
+				if (!block->recyclable) {
+					pthread_join(block->handle, NULL);
+				}
+			}
+		}
+
+		/* ERROR: Setting standard errno with posix value returned from function */
+		if (value != 0) {
+			thrd_control_release(block);
+			errno = value;
+			return thrd_error;
+		}
+
+		*thr = block;
+	#endif /* __unix__ */
+
+	#ifdef _WIN32
+		/* ERROR: Caller-provided stacks are not supported by CreateThread */
+		if (attr->flags & thrd_attr_stack) {
+			errno = EINVAL;
+			return thrd_error;
+		}
+
+		struct thrd_control* block = thrd_control_alloc();
+
+		/* ERROR: No memory for the startup block */
+		if (block == NULL) {
+			errno = ENOMEM;
+			return thrd_nomem;
+		}
+		block->func = func;
+		block->arg = arg;
+		block->gate = gate;
+
+		/* The thread is created suspended so that nothing runs before the attributes are applied */
+		BOOL suspended = (attr->flags & (thrd_attr_affinity | thrd_attr_node | thrd_attr_priority | thrd_attr_name | thrd_attr_policy)) != 0;
+		*thr = CreateThread(
+			NULL,																// default security attributes
+			(attr->flags & thrd_attr_stacksize) ? attr->stack_size : 0,		// stack size
+			thrd_main,															// trampoline calling func
+			block,																// argument to thread function
+			(suspended ? CREATE_SUSPENDED : 0) | ((attr->flags & thrd_attr_stacksize) ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0),
+			NULL																// returns the thread identifier
+		);
+
+		/* ERROR: Setting standard errno with windows error value */
+		if (*thr == NULL) {
+			errno = thrd_errno;
+			thrd_control_free(block);
+			return thrd_error;
+		}
+
+		/* ERROR: The thread never ran, it can be safely terminated and its block released */
+		if (suspended && (!thrd_apply_suspended(*thr, attr) || ResumeThread(*thr) == (DWORD) -1)) {
+			errno = thrd_errno;
+			TerminateThread(*thr, 0);
+			CloseHandle(*thr);
+			thrd_control_free(block);
+			return thrd_error;
+		}
+	#endif /* _WIN32 */
+
+	/* SUCCESS */
+	return thrd_success;
+}
+
+
+
+int thrd_create_ex(__OUT__ thrd_t* thr, const thrd_attr_t* attr, thrd_start_t func, void* arg) {
+	return thrd_spawn(thr, attr, func, arg, NULL);
+}
+
+
+
+int thrd_create_n(__OUT__ thrd_t* thrs, unsigned int count, const thrd_attr_t* attr, int placement, thrd_start_t func, void* const* args) {
+	thrd_attr_t group;
+	thrd_cpuset_t* cpusets = NULL;
+	if (attr == NULL) {
+		attr = &thrd_attr_default;
+	}
+	group = *attr;
+
+	if (placement != THRD_PLACEMENT_NONE) {
+		cpusets = (thrd_cpuset_t*) malloc((count ? count : 1) * sizeof(thrd_cpuset_t));
+
+		/* ERROR: No memory for the CPU sets */
+		if (cpusets == NULL) {
+			errno = ENOMEM;
+			return thrd_nomem;
+		}
+
+		if (topo_place(placement, count, cpusets) != thrd_success) {
+			free(cpusets);
+			return thrd_error;
+		}
+	}
+
+	thrd_gate_t gate;
+	atomic_init(&gate.open, 0);
+	atomic_init(&gate.pending, (int) count);
+
+	int value = thrd_success;
+	unsigned int created = 0;
+	for (; created < count; ++created) {
+		if (cpusets != NULL) {
+			thrd_attr_setaffinity(&group, &cpusets[created]);
+		}
+		value = thrd_spawn(&thrs[created], &group, func, (args != NULL) ? args[created] : NULL, &gate);
+		if (value != thrd_success) {
+			break;
+		}
+	}
+	free(cpusets);
+
+	/* ERROR: The threads already created are released without calling func, and joined */
+	if (value != thrd_success) {
+		int error = errno;
+		atomic_fetch_sub_explicit(&gate.pending, (int) (count - created), memory_order_relaxed);
+		thrd_gate_open(&gate, -1);
+		thrd_join_n(thrs, created, NULL);
+		errno = error;
+		return value;
+	}
+
+	/* SUCCESS: All the threads are released by a single futex wake-up */
+	thrd_gate_open(&gate, 1);
+	return thrd_success;
+}
+
+
+
+int thrd_join_n(thrd_t* thrs, unsigned int count, __OUT__ int* res) {
+	int value = thrd_success;
+	for (unsigned int i = 0; i < count; ++i) {
+		if (thrd_join(thrs[i], (res != NULL) ? &res[i] : NULL) != thrd_success) {
+			value = thrd_error;
+		}
+	}
+	return value;
+}
+
+
+
+/**
+ * Recyclable threads are created detached and park in thrd_park, see thrd_main
+ */
+int thrd_recycle(unsigned int capacity) {
+	#ifdef __unix__
+		pthread_mutex_lock(&thrd_idle_lock);
+		atomic_store_explicit(&thrd_idle_capacity, capacity, memory_order_relaxed);
+
+		/* Parked threads beyond the new capacity are woken up without a block, they exit */
+		while (thrd_idle_count > capacity) {
+			struct thrd_worker* worker = thrd_idle;
+			thrd_idle = worker->next;
+			--thrd_idle_count;
+			thrd_idle_resume(worker, NULL);
+		}
+		pthread_mutex_unlock(&thrd_idle_lock);
+	#endif /* __unix__ */
+
+	#ifdef _WIN32
+		/* ERROR: Not supported */
+		(void) capacity;
+		errno = ENOSYS;
+		return thrd_error;
+	#endif /* _WIN32 */
+
+	/* SUCCESS */
+	return thrd_success;
+}
+
+
+
+void thrd_attr_init(__OUT__ thrd_attr_t* attr) {
+	memset(attr, 0, sizeof(*attr));
+}
+
+
+
+int thrd_attr_setstacksize(__INOUT__ thrd_attr_t* attr, size_t size) {
+	/* ERROR: A stack cannot be empty */
+	if (size == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->stack_size = size;
+	attr->stack_addr = NULL;
+	attr->flags = (attr->flags | thrd_attr_stacksize) & ~thrd_attr_stack;
+	return thrd_success;
+}
+
+
+
+int thrd_attr_setguardsize(__INOUT__ thrd_attr_t* attr, size_t size) {
+	attr->guard_size = size;
+	attr->flags |= thrd_attr_guardsize;
+	return thrd_success;
+}
+
+
+
+int thrd_attr_setstack(__INOUT__ thrd_attr_t* attr, void* addr, size_t size) {
+	/* ERROR: A stack cannot be empty */
+	if (addr == NULL || size == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->stack_addr = addr;
+	attr->stack_size = size;
+	attr->flags = (attr->flags | thrd_attr_stack) & ~thrd_attr_stacksize;
+	return thrd_success;
+}
+
+
+
+int thrd_attr_setname(__INOUT__ thrd_attr_t* attr, const char* name) {
+	/* ERROR: Missing name */
+	if (name == NULL) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	strncpy(attr->name, name, THRD_NAME_MAX - 1);
+	attr->name[THRD_NAME_MAX - 1] = '\0';
+	attr->flags |= thrd_attr_name;
+	return thrd_success;
+}
+
+
+
+int thrd_attr_setaffinity(__INOUT__ thrd_attr_t* attr, const thrd_cpuset_t* cpuset) {
+	/* ERROR: A thread must be allowed to run somewhere */
+	if (cpuset == NULL || thrd_cpuset_count(cpuset) == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->cpuset = *cpuset;
+	attr->flags |= thrd_attr_affinity;
+	return thrd_success;
+}
+
+
+
+int thrd_attr_setnode(__INOUT__ thrd_attr_t* attr, int node) {
+	/* ERROR: Out of the node range */
+	if (node < 0 || node >= THRD_CPUSET_SIZE) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->node = node;
+	attr->flags |= thrd_attr_node;
+	return thrd_success;
+}
+
+
+
+int thrd_attr_setpriority(__INOUT__ thrd_attr_t* attr, int priority) {
+	/* ERROR: Out of the nice range */
+	if (priority < -20 || priority > 19) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->priority = priority;
+	attr->flags |= thrd_attr_priority;
+	return thrd_success;
+}
+
+
+
+int thrd_attr_setpolicy(__INOUT__ thrd_attr_t* attr, int policy, int rt_priority) {
+	/* ERROR: Unknown policy, or real-time priority out of the range of SCHED_FIFO */
+	if (policy < thrd_sched_normal || policy > thrd_sched_fifo || (policy == thrd_sched_fifo && (rt_priority < 1 || rt_priority > 99))) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->policy = policy;
+	attr->rt_priority = (policy == thrd_sched_fifo) ? rt_priority : 0;
+	attr->flags |= thrd_attr_policy;
+	return thrd_success;
+}
+
+
+
+void thrd_cpuset_zero(__OUT__ thrd_cpuset_t* cpuset) {
+	memset(cpuset, 0, sizeof(*cpuset));
+}
+
+
+
+void thrd_cpuset_set(__INOUT__ thrd_cpuset_t* cpuset, int cpu) {
+	if (cpu >= 0 && cpu < THRD_CPUSET_SIZE) {
+		cpuset->bits[cpu / THRD_CPUSET_BITS] |= 1UL << (cpu % THRD_CPUSET_BITS);
+	}
+}
+
+
+
+void thrd_cpuset_clear(__INOUT__ thrd_cpuset_t* cpuset, int cpu) {
+	if (cpu >= 0 && cpu < THRD_CPUSET_SIZE) {
+		cpuset->bits[cpu / THRD_CPUSET_BITS] &= ~(1UL << (cpu % THRD_CPUSET_BITS));
+	}
+}
+
+
+
+int thrd_cpuset_isset(const thrd_cpuset_t* cpuset, int cpu) {
+	if (cpu < 0 || cpu >= THRD_CPUSET_SIZE) {
+		return 0;
+	}
+	return (cpuset->bits[cpu / THRD_CPUSET_BITS] >> (cpu % THRD_CPUSET_BITS)) & 1UL;
+}
+
+
+
+int thrd_cpuset_count(const thrd_cpuset_t* cpuset) {
+	int count = 0;
+	for (int cpu = 0; cpu < THRD_CPUSET_SIZE; ++cpu) {
+		count += thrd_cpuset_isset(cpuset, cpu);
+	}
+	return count;
+}
+
+
+
+/**
+ * Posix:	http://man7.org/linux/man-pages/man3/pthread_self.3.html
+ * Windows: https://msdn.microsoft.com/en-US/library/windows/desktop/ms683182(v=vs.85).aspx
+ */
+thrd_t thrd_current(void) {
+	#ifdef __unix__
+		/* Threads not created by the library get a control block the first time they ask for it */
+		struct thrd_control* block = thrd_self;
+		if (block == NULL) {
+			pthread_once(&thrd_adopted_once, thrd_adopted_init);
+			block = thrd_control_alloc();
+			if (block != NULL) {
+				block->handle = pthread_self();
+				block->adopted = 1;
+				pthread_setspecific(thrd_adopted_key, block);
+				thrd_self = block;
+			}
+		}
+		return block;
+	#endif /* __unix__ */
+	
+	#ifdef _WIN32
+		return GetCurrentThread();
+	#endif /* _WIN32 */
+}
+
+
+
+/**
+ * Posix:
+ * 		http://man7.org/linux/man-pages/man3/pthread_detach.3.html
+ * Windows: 
+ * 		https://msdn.microsoft.com/en-us/library/windows/desktop/ms724211.aspx
+ * 		http://stackoverflow.com/questions/12744324/how-to-detach-a-thread-on-windows-c
+ */
+int thrd_detach(thrd_t thr) {
+	#ifdef __unix__
+		/* thr may be released as soon as it is marked detached, everything needed is read before */
+		pthread_t handle = thr->handle;
+		int value = 0;
+		if (thr->adopted) {
+			value = pthread_detach(handle);
+		} else if (thr->stack != NULL) {
+			/* The thread stays joinable so that its stack can be unmapped once it has exited, see thrd_zombie_push */
+			int state = atomic_fetch_or_explicit(&thr->state, thrd_state_detached, memory_order_acq_rel);
+			if (state & thrd_state_finished) {
+				pthread_join(handle, NULL);
+				thrd_control_release(thr);
+			}
+		} else {
+			int recyclable = thr->recyclable;
+			int state = atomic_fetch_or_explicit(&thr->state, thrd_state_detached, memory_order_acq_rel);
+			if (!recyclable) {
+				value = pthread_detach(handle);
+			}
+			if (state & thrd_state_finished) {
+				thrd_control_free(thr);
+			}
+		}
+		
+		/* ERROR: Setting standard errno with posix value returned from function */
+		if (value != 0) {
+			errno = value;
+			return thrd_error;
+		}
+	#endif /* __unix__ */
+	
+	#ifdef _WIN32		
+		/* Documentation: Closing a thread handle does not terminate the associated thread or remove the thread object. */
+		if (CloseHandle(thr) == 0) {
+			/* ERROR */
+			errno = thrd_errno;
+			return thrd_error;
+		}
+	#endif /* _WIN32 */
+	
+	/* SUCCESS */
+	return thrd_success;
+}
+
+
+
+/**
+ * Posix:	http://man7.org/linux/man-pages/man3/pthread_setaffinity_np.3.html
+ * Windows:	https://msdn.microsoft.com/en-us/library/windows/desktop/ms686247(v=vs.85).aspx
+ */
+int thrd_set_affinity(thrd_t thr, const thrd_cpuset_t* cpuset) {
+	/* ERROR: A thread must be allowed to run somewhere */
+	if (cpuset == NULL || thrd_cpuset_count(cpuset) == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	#ifdef __unix__
+		#ifdef __linux__
+			cpu_set_t set;
+			thrd_cpuset_to_posix(cpuset, &set);
+			if (thr->recyclable) {
+				atomic_store_explicit(&thr->repinned, 1, memory_order_relaxed);
+			}
+			int value = pthread_setaffinity_np(thr->handle, sizeof(set), &set);
+		#else
+			(void) thr;
+			int value = ENOSYS;
+		#endif /* __linux__ */
+
+		/* ERROR: Setting standard errno with posix value returned from function */
+		if (value != 0) {
+			errno = value;
+			return thrd_error;
+		}
+	#endif /* __unix__ */
+
+	#ifdef _WIN32
+		/* Only the first processor group can be represented by a DWORD_PTR mask */
+		DWORD_PTR mask = 0;
+		for (int cpu = 0; cpu < (int) (8 * sizeof(DWORD_PTR)); ++cpu) {
+			if (thrd_cpuset_isset(cpuset, cpu)) {
+				mask |= ((DWORD_PTR) 1) << cpu;
+			}
+		}
+
+		/* ERROR: Setting standard errno with windows error value */
+		if (SetThreadAffinityMask(thr, mask) == 0) {
+			errno = thrd_errno;
+			return thrd_error;
+		}
+	#endif /* _WIN32 */
+
+	/* SUCCESS */
+	return thrd_success;
+}
 
 
 
 /**
- * Posix: 
- * 		http://man7.org/linux/man-pages/man3/pthread_create.3.html
- * Windows: 
- * 		https://msdn.microsoft.com/fr-fr/library/windows/desktop/ms682516(v=vs.85).aspx
- * 		https://msdn.microsoft.com/fr-fr/library/windows/desktop/ms682453(v=vs.85).aspx
-*/
-int thrd_create(__OUT__ thrd_t* thr, thrd_start_t func, void* arg) {
+ * Posix:	http://man7.org/linux/man-pages/man3/pthread_getaffinity_np.3.html
+ * Windows:	https://docs.microsoft.com/en-us/windows/win32/api/processtopologyapi/nf-processtopologyapi-getthreadgroupaffinity
+ */
+int thrd_get_affinity(thrd_t thr, __OUT__ thrd_cpuset_t* cpuset) {
+	thrd_cpuset_zero(cpuset);
+
 	#ifdef __unix__
-		int value = pthread_create(thr, NULL, (POSIX_START_ROUTINE) func, arg);
-		
+		#ifdef __linux__
+			cpu_set_t set;
+			int value = pthread_getaffinity_np(thr->handle, sizeof(set), &set);
+			for (int cpu = 0; value == 0 && cpu < THRD_CPUSET_SIZE && cpu < CPU_SETSIZE; ++cpu) {
+				if (CPU_ISSET(cpu, &set)) {
+					thrd_cpuset_set(cpuset, cpu);
+				}
+			}
+		#else
+			(void) thr;
+			int value = ENOSYS;
+		#endif /* __linux__ */
+
 		/* ERROR: Setting standard errno with posix value returned from function */
 		if (value != 0) {
 			errno = value;
@@ -45,22 +1467,20 @@ int thrd_create(__OUT__ thrd_t* thr, thrd_start_t func, void* arg) {
 	#endif /* __unix__ */
 
 	#ifdef _WIN32
-		*thr = CreateThread(
-			NULL,							// default security attributes
-			0,								// use default stack size
-			(LPTHREAD_START_ROUTINE) func,	// thread function name
-			arg,							// argument to thread function
-			0,								// use default creation flags
-			NULL							// returns the thread identifier
-		);
-		
+		GROUP_AFFINITY affinity;
+
 		/* ERROR: Setting standard errno with windows error value */
-		if(*thr == NULL) {
+		if (GetThreadGroupAffinity(thr, &affinity) == 0) {
 			errno = thrd_errno;
 			return thrd_error;
 		}
+		for (int cpu = 0; cpu < (int) (8 * sizeof(KAFFINITY)); ++cpu) {
+			if ((affinity.Mask >> cpu) & 1) {
+				thrd_cpuset_set(cpuset, affinity.Group * (int) (8 * sizeof(KAFFINITY)) + cpu);
+			}
+		}
 	#endif /* _WIN32 */
-	
+
 	/* SUCCESS */
 	return thrd_success;
 }
@@ -68,48 +1488,150 @@ int thrd_create(__OUT__ thrd_t* thr, thrd_start_t func, void* arg) {
 
 
 /**
- * Posix:	http://man7.org/linux/man-pages/man3/pthread_self.3.html
- * Windows: https://msdn.microsoft.com/en-US/library/windows/desktop/ms683182(v=vs.85).aspx
+ * Posix:	http://man7.org/linux/man-pages/man3/pthread_setschedparam.3.html
+ * Windows:	https://msdn.microsoft.com/en-us/library/windows/desktop/ms686277(v=vs.85).aspx
  */
-thrd_t thrd_current(void) {
+int thrd_set_policy(int policy, int rt_priority) {
+	/* ERROR: Unknown policy, or real-time priority out of the range of SCHED_FIFO */
+	if (policy < thrd_sched_normal || policy > thrd_sched_fifo || (policy == thrd_sched_fifo && (rt_priority < 1 || rt_priority > 99))) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
 	#ifdef __unix__
-		return pthread_self();
+		#ifdef __linux__
+			pid_t tid = (pid_t) syscall(SYS_gettid);
+			if (thrd_self_worker != NULL) {
+				thrd_worker_save(thrd_self_worker, thrd_attr_policy | thrd_attr_priority, tid);
+			}
+			int value = thrd_policy_apply(policy, rt_priority, tid);
+		#else
+			int value = ENOSYS;
+		#endif /* __linux__ */
+
+		/* ERROR: Setting standard errno with posix value returned from function */
+		if (value != 0) {
+			errno = value;
+			return thrd_error;
+		}
 	#endif /* __unix__ */
-	
+
 	#ifdef _WIN32
-		return GetCurrentThread();
+		/* ERROR: Setting standard errno with windows error value */
+		if (SetThreadPriority(GetCurrentThread(), thrd_policy_to_windows(policy)) == 0) {
+			errno = thrd_errno;
+			return thrd_error;
+		}
 	#endif /* _WIN32 */
+
+	/* SUCCESS */
+	return thrd_success;
 }
 
 
 
 /**
- * Posix:
- * 		http://man7.org/linux/man-pages/man3/pthread_detach.3.html
- * Windows: 
- * 		https://msdn.microsoft.com/en-us/library/windows/desktop/ms724211.aspx
- * 		http://stackoverflow.com/questions/12744324/how-to-detach-a-thread-on-windows-c
+ * Posix:	http://man7.org/linux/man-pages/man3/pthread_getschedparam.3.html
+ * Windows:	https://msdn.microsoft.com/en-us/library/windows/desktop/ms683235(v=vs.85).aspx
  */
-int thrd_detach(thrd_t thr) {
+int thrd_get_policy(__OUT__ int* policy, __OUT__ int* rt_priority) {
+	int priority = 0;
+
 	#ifdef __unix__
-		int value = pthread_detach(thr);
-		
+		#ifdef __linux__
+			int posix = SCHED_OTHER;
+			struct sched_param param;
+			int value = pthread_getschedparam(pthread_self(), &posix, &param);
+		#else
+			int value = ENOSYS;
+		#endif /* __linux__ */
+
 		/* ERROR: Setting standard errno with posix value returned from function */
 		if (value != 0) {
 			errno = value;
 			return thrd_error;
 		}
+
+		#ifdef __linux__
+			/* SCHED_RR is reported as the closest policy, SCHED_FIFO */
+			if (posix == SCHED_BATCH) {
+				*policy = thrd_sched_batch;
+			} else if (posix == SCHED_IDLE) {
+				*policy = thrd_sched_idle;
+			} else if (posix == SCHED_FIFO || posix == SCHED_RR) {
+				*policy = thrd_sched_fifo;
+				priority = param.sched_priority;
+			} else {
+				*policy = thrd_sched_normal;
+			}
+		#endif /* __linux__ */
 	#endif /* __unix__ */
-	
-	#ifdef _WIN32		
-		/* Documentation: Closing a thread handle does not terminate the associated thread or remove the thread object. */
-		if (CloseHandle(thr) == 0) {
-			/* ERROR */
+
+	#ifdef _WIN32
+		int level = GetThreadPriority(GetCurrentThread());
+
+		/* ERROR: Setting standard errno with windows error value */
+		if (level == THREAD_PRIORITY_ERROR_RETURN) {
 			errno = thrd_errno;
 			return thrd_error;
 		}
+
+		if (level <= THREAD_PRIORITY_IDLE) {
+			*policy = thrd_sched_idle;
+		} else if (level >= THREAD_PRIORITY_TIME_CRITICAL) {
+			*policy = thrd_sched_fifo;
+		} else {
+			*policy = thrd_sched_normal;
+		}
 	#endif /* _WIN32 */
-	
+
+	if (rt_priority != NULL) {
+		*rt_priority = priority;
+	}
+
+	/* SUCCESS */
+	return thrd_success;
+}
+
+
+
+/**
+ * Posix:	http://man7.org/linux/man-pages/man2/setpriority.2.html
+ * Windows:	https://msdn.microsoft.com/en-us/library/windows/desktop/ms686277(v=vs.85).aspx
+ */
+int thrd_set_priority(int priority) {
+	/* ERROR: Out of the nice range */
+	if (priority < -20 || priority > 19) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	#ifdef __unix__
+		#ifdef __linux__
+			/* Linux: the nice value of a thread id only applies to that thread */
+			pid_t tid = (pid_t) syscall(SYS_gettid);
+			if (thrd_self_worker != NULL) {
+				thrd_worker_save(thrd_self_worker, thrd_attr_priority, tid);
+			}
+			if (setpriority(PRIO_PROCESS, (id_t) tid, priority) != 0) {
+				/* ERROR */
+				return thrd_error;
+			}
+		#else
+			/* ERROR: Not supported, the nice value of a Posix thread is the one of its process */
+			errno = ENOSYS;
+			return thrd_error;
+		#endif /* __linux__ */
+	#endif /* __unix__ */
+
+	#ifdef _WIN32
+		/* ERROR: Setting standard errno with windows error value */
+		if (SetThreadPriority(GetCurrentThread(), thrd_priority_to_windows(priority)) == 0) {
+			errno = thrd_errno;
+			return thrd_error;
+		}
+	#endif /* _WIN32 */
+
 	/* SUCCESS */
 	return thrd_success;
 }
@@ -151,7 +1673,11 @@ int thrd_equal(thrd_t lhs, thrd_t rhs) {
  */
 void thrd_exit(int res) {
 	#ifdef __unix__
-		pthread_exit((void*) &res);
+		/* The cleanup handler pushed by thrd_run finishes the control block, the thread is not recycled */
+		if (thrd_self != NULL) {
+			thrd_self->res = res;
+		}
+		pthread_exit(NULL);
 	#endif /* __unix__ */
 	
 	#ifdef _WIN32
@@ -167,25 +1693,53 @@ void thrd_exit(int res) {
  */
 int thrd_join(thrd_t thr, __OUT__ int* res) {
 	#ifdef __unix__
-		int value = pthread_join(thr, (void**) &res);
+		/* The block of an adopted thread is released by the thread itself before pthread_join returns, it is not read afterwards */
+		int adopted = thr->adopted;
+
+		/* A thread that has already finished is joined without sleeping */
+		int blocking = adopted || !(atomic_load_explicit(&thr->state, memory_order_acquire) & thrd_state_finished);
+		if (blocking) {
+			thrd_blocking(1);
+		}
+
+		int value = 0;
+		if (adopted) {
+			value = pthread_join(thr->handle, NULL);
+		} else if (thr->recyclable) {
+			/* The OS thread lives on, only the block is waited for */
+			thrd_control_wait(thr, NULL);
+		} else {
+			value = pthread_join(thr->handle, NULL);
+		}
+
+		if (blocking) {
+			thrd_blocking(0);
+		}
 		
 		/* ERROR: Setting standard errno with posix value returned from function */
 		if (value != 0) {
 			errno = value;
 			return thrd_error;
 		}
+
+		/* Setting res value */
+		if (!adopted) {
+			if (res != NULL) {
+				*res = thr->res;
+			}
+			thrd_control_release(thr);
+		} else if (res != NULL) {
+			*res = 0;
+		}
 	#endif /* __unix__ */
 	
 	#ifdef _WIN32		
+		thrd_blocking(1);
 		DWORD status = WaitForSingleObject(
 			thr,
 			INFINITE
 		);
-		
-		/* Setting res value */
-		if (res != NULL) {
-			*res = (int) status;
-		}
+		thrd_blocking(0);
 		
 		/* ERROR: Setting standard errno with windows error value */
 		if (status != WAIT_OBJECT_0) {
@@ -197,6 +1751,17 @@ int thrd_join(thrd_t thr, __OUT__ int* res) {
 
 			return thrd_error;
 		}
+
+		/* Setting res value: the exit code is the value returned by thrd_main or passed to thrd_exit */
+		DWORD code = 0;
+		if (GetExitCodeThread(thr, &code) == 0) {
+			errno = thrd_errno;
+			return thrd_error;
+		}
+		if (res != NULL) {
+			*res = (int) code;
+		}
+		CloseHandle(thr);
 	#endif /* _WIN32 */
 	
 	/* SUCCESS */
@@ -205,17 +1770,167 @@ int thrd_join(thrd_t thr, __OUT__ int* res) {
 
 
 
+#ifdef _WIN32
+/**
+ * Converts an absolute TIME_UTC deadline to a relative timeout for the wait functions, 0 if it has passed
+ */
+static DWORD thrd_milliseconds_until(const struct timespec* deadline) {
+	if (deadline == NULL) {
+		return INFINITE;
+	}
+
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	long long remaining = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+	if (remaining <= 0) {
+		return 0;
+	}
+	return (remaining >= INFINITE) ? INFINITE - 1 : (DWORD) remaining;
+}
+#endif /* _WIN32 */
+
+
+
+/**
+ * Posix:	the state word of the control block is waited on with a deadline, pthread_join only reclaims a thread that has already finished
+ * 			http://man7.org/linux/man-pages/man3/pthread_tryjoin_np.3.html
+ * Windows: https://msdn.microsoft.com/fr-fr/library/windows/desktop/ms687032(v=vs.85).aspx
+ */
+int thrd_join_timed(thrd_t thr, const struct timespec* deadline, __OUT__ int* res) {
+	#ifdef __unix__
+		if (thr->adopted) {
+			/* Adopted threads have no state word, only glibc can bound their join */
+			#ifdef __GLIBC__
+				thrd_blocking(1);
+				int value = (deadline != NULL) ? pthread_timedjoin_np(thr->handle, NULL, deadline) : pthread_join(thr->handle, NULL);
+				thrd_blocking(0);
+			#else
+				int value = ENOSYS;
+			#endif /* __GLIBC__ */
+			if (value == ETIMEDOUT) {
+				return thrd_timedout;
+			}
+
+			/* ERROR: Setting standard errno with posix value returned from function */
+			if (value != 0) {
+				errno = value;
+				return thrd_error;
+			}
+			if (res != NULL) {
+				*res = 0;
+			}
+			return thrd_success;
+		}
+
+		thrd_blocking(1);
+		int timedout = (thrd_control_wait(thr, deadline) == thrd_timedout);
+		thrd_blocking(0);
+		if (timedout) {
+			return thrd_timedout;
+		}
+	#endif /* __unix__ */
+
+	#ifdef _WIN32
+		thrd_blocking(1);
+		DWORD status = WaitForSingleObject(thr, thrd_milliseconds_until(deadline));
+		thrd_blocking(0);
+		if (status == WAIT_TIMEOUT) {
+			return thrd_timedout;
+		}
+	#endif /* _WIN32 */
+
+	/* The thread has finished, thrd_join does not block anymore */
+	return thrd_join(thr, res);
+}
+
+
+
+/**
+ * Posix:	every waiter sleeps on the single futex word thrd_finished_seq, the threads it waits for are flagged thrd_state_any
+ * 			so that finishing one of them bumps the word. Concurrent thrd_join_any calls may wake each other spuriously.
+ * Windows: https://msdn.microsoft.com/en-us/library/windows/desktop/ms687025(v=vs.85).aspx
+ */
+int thrd_join_any(thrd_t* thrs, unsigned int count, const struct timespec* deadline, __OUT__ unsigned int* index, __OUT__ int* res) {
+	/* ERROR: There must be a thread to wait for */
+	if (thrs == NULL || count == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	#ifdef __unix__
+		/* ERROR: Adopted threads have no state word to wait on */
+		for (unsigned int i = 0; i < count; ++i) {
+			if (thrs[i]->adopted) {
+				errno = EINVAL;
+				return thrd_error;
+			}
+		}
+
+		unsigned int found = count;
+		int timedout = 0;
+		while (found == count) {
+			/* The sequence is read before the states: a thread finishing after its state has been checked bumps it */
+			int seq = atomic_load_explicit(&thrd_finished_seq, memory_order_acquire);
+			for (unsigned int i = 0; found == count && i < count; ++i) {
+				int state = atomic_load_explicit(&thrs[i]->state, memory_order_acquire);
+				while (!(state & (thrd_state_finished | thrd_state_any))
+					&& !atomic_compare_exchange_weak_explicit(&thrs[i]->state, &state, state | thrd_state_any, memory_order_acq_rel, memory_order_acquire)) {
+				}
+				if (state & thrd_state_finished) {
+					found = i;
+				}
+			}
+
+			if (found == count) {
+				if (timedout) {
+					return thrd_timedout;
+				}
+				thrd_blocking(1);
+				timedout = (futex_wait(&thrd_finished_seq, seq, deadline) == thrd_timedout);
+				thrd_blocking(0);
+			}
+		}
+	#endif /* __unix__ */
+
+	#ifdef _WIN32
+		/* ERROR: WaitForMultipleObjects is limited to MAXIMUM_WAIT_OBJECTS handles */
+		if (count > MAXIMUM_WAIT_OBJECTS) {
+			errno = EINVAL;
+			return thrd_error;
+		}
+
+		thrd_blocking(1);
+		DWORD status = WaitForMultipleObjects(count, thrs, FALSE, thrd_milliseconds_until(deadline));
+		thrd_blocking(0);
+		if (status == WAIT_TIMEOUT) {
+			return thrd_timedout;
+		}
+
+		/* ERROR: Setting standard errno with windows error value */
+		if (status >= WAIT_OBJECT_0 + count) {
+			errno = (status == WAIT_FAILED) ? thrd_errno : status;
+			return thrd_error;
+		}
+		unsigned int found = status - WAIT_OBJECT_0;
+	#endif /* _WIN32 */
+
+	if (index != NULL) {
+		*index = found;
+	}
+	return thrd_join(thrs[found], res);
+}
+
+
+
 /**
- * Posix:	https://linux.die.net/man/3/pthread_yield
+ * Posix:	http://man7.org/linux/man-pages/man2/sched_yield.2.html
  * Windows: https://msdn.microsoft.com/en-US/library/windows/desktop/ms686352(v=vs.85).aspx
  */
 void thrd_yield(void) {
 	#ifdef __unix__
-		int value = pthread_yield();
-
-		/* ERROR: Setting standard errno with posix value returned from function */
-		if (value != 0) {
-			errno = value;
+		/* pthread_yield() is deprecated, sched_yield() is the standard equivalent */
+		if (sched_yield() != 0) {
+			/* ERROR: errno has been set by the function */
 			/* This standard function needs a return value... */
 		}
 	#endif /* __unix__ */
@@ -227,6 +1942,199 @@ void thrd_yield(void) {
 
 
 
+/**
+ * x86:		https://www.felixcloutier.com/x86/pause
+ * ARM:		https://developer.arm.com/documentation/dui0802/b/A64-General-Instructions/YIELD
+ * Windows:	https://docs.microsoft.com/en-us/windows/win32/api/winnt/nf-winnt-yieldprocessor
+ */
+void thrd_relax(void) {
+	#if defined(_WIN32)
+		YieldProcessor();
+	#elif defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+	#elif defined(__aarch64__) || defined(__arm__)
+		__asm__ __volatile__("yield" ::: "memory");
+	#elif defined(__powerpc__) || defined(__powerpc64__)
+		__asm__ __volatile__("or 27,27,27" ::: "memory");
+	#else
+		atomic_signal_fence(memory_order_seq_cst);
+	#endif
+}
+
+
+
+void thrd_backoff_init(__OUT__ thrd_backoff_t* backoff, unsigned int spins, unsigned int yields, long sleep) {
+	backoff->spins = spins;
+	backoff->yields = yields;
+	backoff->sleep = (sleep < 0) ? 0 : sleep;
+	backoff->step = 0;
+}
+
+
+
+void thrd_backoff_reset(__INOUT__ thrd_backoff_t* backoff) {
+	backoff->step = 0;
+}
+
+
+
+void thrd_backoff_wait(__INOUT__ thrd_backoff_t* backoff) {
+	if (backoff->step < backoff->spins) {
+		/* Pause phase: the number of pauses doubles at each step, up to 2^THRD_BACKOFF_SHIFT */
+		unsigned int shift = (backoff->step < THRD_BACKOFF_SHIFT) ? backoff->step : THRD_BACKOFF_SHIFT;
+		for (unsigned int i = 0; i < (1u << shift); ++i) {
+			thrd_relax();
+		}
+		++backoff->step;
+	} else if (backoff->step - backoff->spins < backoff->yields) {
+		thrd_yield();
+		++backoff->step;
+	} else if (backoff->sleep > 0) {
+		struct timespec duration;
+		duration.tv_sec = backoff->sleep / 1000000000L;
+		duration.tv_nsec = backoff->sleep % 1000000000L;
+
+		/* A backoff polls, it does not block: the sleep is kept from the blocking hook, or a pool worker waiting for its tasks would count as blocked */
+		thrd_blocking_t hook = thrd_blocking_hook;
+		thrd_blocking_hook = NULL;
+		thrd_sleep(&duration, NULL);
+		thrd_blocking_hook = hook;
+	} else {
+		thrd_yield();
+	}
+}
+
+
+
+/* Length of the spin at the end of thrd_sleep for the calling thread, 0 when the precise mode is disabled */
+static _Thread_local long thrd_sleep_spin = 0;
+
+
+
+/**
+ * Monotonic clock in nanoseconds, used for sleep deadlines
+ *
+ * Posix:	http://man7.org/linux/man-pages/man2/clock_gettime.2.html
+ * Windows:	https://msdn.microsoft.com/en-us/library/windows/desktop/ms644904(v=vs.85).aspx
+ */
+static long long thrd_monotonic(void) {
+	#ifdef __unix__
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec * 1000000000LL + now.tv_nsec;
+	#endif /* __unix__ */
+
+	#ifdef _WIN32
+		LARGE_INTEGER counter, frequency;
+		QueryPerformanceCounter(&counter);
+		QueryPerformanceFrequency(&frequency);
+		return (long long) ((double) counter.QuadPart * 1e9 / (double) frequency.QuadPart);
+	#endif /* _WIN32 */
+}
+
+
+
+/**
+ * Posix:	http://man7.org/linux/man-pages/man2/clock_nanosleep.2.html
+ * Windows:	https://msdn.microsoft.com/en-us/library/windows/desktop/ms686298(v=vs.85).aspx
+ */
+int thrd_sleep(const struct timespec* duration, __OUT__ struct timespec* remaining) {
+	/* ERROR: Invalid duration */
+	if (duration->tv_sec < 0 || duration->tv_nsec < 0 || duration->tv_nsec >= 1000000000L) {
+		errno = EINVAL;
+		return -2;
+	}
+
+	long long start = thrd_monotonic();
+	long long deadline = (duration->tv_sec >= (LLONG_MAX - start) / 1000000000LL)
+		? LLONG_MAX
+		: start + duration->tv_sec * 1000000000LL + duration->tv_nsec;
+	long long wake = deadline - thrd_sleep_spin;
+
+	if (wake > start) {
+		thrd_blocking(1);
+
+		#ifdef __unix__
+			/* TIMER_ABSTIME: the deadline does not drift with the time spent in this function */
+			struct timespec until;
+			until.tv_sec = (time_t) (wake / 1000000000LL);
+			until.tv_nsec = (long) (wake % 1000000000LL);
+			int value = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+			thrd_blocking(0);
+
+			/* INTERRUPTED: Setting remaining time from the absolute deadline */
+			if (value == EINTR) {
+				if (remaining != NULL) {
+					long long left = deadline - thrd_monotonic();
+					left = (left < 0) ? 0 : left;
+					remaining->tv_sec = (time_t) (left / 1000000000LL);
+					remaining->tv_nsec = (long) (left % 1000000000LL);
+				}
+				return -1;
+			}
+
+			/* ERROR: Setting standard errno with posix value returned from function */
+			if (value != 0) {
+				errno = value;
+				return -2;
+			}
+		#endif /* __unix__ */
+
+		#ifdef _WIN32
+			/* Sleep() has a millisecond resolution, the remainder is spun */
+			(void) remaining;
+			for (long long now = start; wake - now >= 1000000LL; now = thrd_monotonic()) {
+				Sleep((DWORD) (((wake - now) / 1000000LL > 0x7FFFFFFFLL) ? 0x7FFFFFFF : (wake - now) / 1000000LL));
+			}
+			thrd_blocking(0);
+		#endif /* _WIN32 */
+	}
+
+	/* Precise mode: spinning the last part of the sleep */
+	while (thrd_monotonic() < deadline) {
+		thrd_relax();
+	}
+
+	/* SUCCESS */
+	return 0;
+}
+
+
+
+void thrd_set_sleep_spin(long nanoseconds) {
+	thrd_sleep_spin = (nanoseconds < 0) ? 0 : nanoseconds;
+}
+
+
+
+void thrd_set_blocking_hook(thrd_blocking_t hook) {
+	thrd_blocking_hook = hook;
+}
+
+
+
+/**
+ * Posix:	http://man7.org/linux/man-pages/man2/prctl.2.html
+ */
+int thrd_set_timerslack(unsigned long nanoseconds) {
+	#ifdef __linux__
+		if (prctl(PR_SET_TIMERSLACK, nanoseconds, 0, 0, 0) != 0) {
+			/* ERROR */
+			return thrd_error;
+		}
+	#else
+		/* ERROR: Not supported */
+		(void) nanoseconds;
+		errno = ENOSYS;
+		return thrd_error;
+	#endif /* __linux__ */
+
+	/* SUCCESS */
+	return thrd_success;
+}
+
+
+
 /**
  * Posix:	https://linux.die.net/man/3/pthread_mutex_destroy
  * Windows:	https://msdn.microsoft.com/en-US/library/windows/desktop/ms724211(v=vs.85).aspx
@@ -311,7 +2219,13 @@ int mtx_init(__OUT__ mtx_t* mutex, int type) {
  */
 int mtx_lock(__OUT__ mtx_t* mutex) {
 	#ifdef __unix__
-		int value = pthread_mutex_lock(mutex);
+		/* With a blocking hook, an uncontended mutex is taken without calling it */
+		int value = (thrd_blocking_hook != NULL) ? pthread_mutex_trylock(mutex) : EBUSY;
+		if (value == EBUSY) {
+			thrd_blocking(1);
+			value = pthread_mutex_lock(mutex);
+			thrd_blocking(0);
+		}
 		
 		/* ERROR: Setting standard errno with posix value returned from function */
 		if (value != 0) {
@@ -321,7 +2235,13 @@ int mtx_lock(__OUT__ mtx_t* mutex) {
 	#endif /* __unix__ */
 	
 	#ifdef _WIN32
-		DWORD status = WaitForSingleObject(*mutex, INFINITE);
+		/* With a blocking hook, an uncontended mutex is taken without calling it */
+		DWORD status = (thrd_blocking_hook != NULL) ? WaitForSingleObject(*mutex, 0) : WAIT_TIMEOUT;
+		if (status == WAIT_TIMEOUT) {
+			thrd_blocking(1);
+			status = WaitForSingleObject(*mutex, INFINITE);
+			thrd_blocking(0);
+		}
 		
 		/* ERROR: Setting standard errno with windows error value */
 		if (status != WAIT_OBJECT_0) {
@@ -2,10 +2,11 @@
 #define C11_THREADS_HEADER
 
 #ifdef __unix__
-	/* _GNU_SOURCE for pthread_yield() */
+	/* _GNU_SOURCE for pthread_setaffinity_np(), pthread_setname_np() and cpu_set_t */
 	#define _GNU_SOURCE
 	#include <pthread.h>
-	typedef pthread_t thrd_t;
+	/* Control block of the thread, see threads.c */
+	typedef struct thrd_control* thrd_t;
 	typedef pthread_mutex_t mtx_t;
 #endif /* __unix__ */
 #ifdef _WIN32
@@ -14,6 +15,9 @@
 	typedef HANDLE mtx_t;
 #endif /* _WIN32 */
 
+#include <stddef.h> /* For size_t */
+#include <time.h>   /* For struct timespec */
+
 
 
 /* Common constants */
@@ -25,6 +29,7 @@
 /**
  * The type thrd_start_t is a typedef of int (*)(void*), which differs from the POSIX equivalent void* (*)(void*)
  * Windows equivalent is LPTHREAD_START_ROUTINE : https://msdn.microsoft.com/en-US/library/aa964928(v=vs.110).aspx
+ * Threads are started through a trampoline which keeps the int result for thrd_join, func is never cast to the system type
  */
 typedef int (*thrd_start_t)(void*);
 
@@ -66,6 +71,113 @@ enum {
 
 
 
+/**
+ * CPU set used for thread affinity, independent from cpu_set_t (Posix) and KAFFINITY (Windows)
+ * THRD_CPUSET_SIZE is the highest number of CPUs that can be represented, it matches glibc's CPU_SETSIZE
+ */
+#define THRD_CPUSET_SIZE 1024
+#define THRD_CPUSET_BITS (8 * sizeof(unsigned long))
+
+typedef struct {
+	unsigned long bits[THRD_CPUSET_SIZE / THRD_CPUSET_BITS];
+} thrd_cpuset_t;
+
+
+
+/**
+ * Backoff for spin-wait loops, each thrd_backoff_wait escalates from CPU pause hints, to thrd_yield, to a short thrd_sleep.
+ *
+ * spins		number of waits spent in the pause phase, the number of pauses doubles at each wait up to 2^THRD_BACKOFF_SHIFT
+ * yields		number of waits spent calling thrd_yield after the pause phase
+ * sleep		duration in nanoseconds of each wait after the yield phase, 0 keeps yielding
+ * step			current wait, reset by thrd_backoff_reset once the awaited condition is met
+ *
+ * THRD_BACKOFF_SPINS, THRD_BACKOFF_YIELDS and THRD_BACKOFF_SLEEP are reasonable defaults for thrd_backoff_init
+ */
+#define THRD_BACKOFF_SHIFT 6
+#define THRD_BACKOFF_SPINS 10
+#define THRD_BACKOFF_YIELDS 8
+#define THRD_BACKOFF_SLEEP 50000L
+
+typedef struct {
+	unsigned int spins;
+	unsigned int yields;
+	long sleep;
+	unsigned int step;
+} thrd_backoff_t;
+
+
+
+/**
+ * Thread attributes enum, flags telling which fields of thrd_attr_t have been set
+ *
+ * thrd_attr_stacksize	stack_size has been set
+ * thrd_attr_guardsize	guard_size has been set
+ * thrd_attr_stack		stack_addr and stack_size describe a caller-provided stack
+ * thrd_attr_name		name has been set
+ * thrd_attr_affinity	cpuset has been set
+ * thrd_attr_priority	priority has been set
+ * thrd_attr_node		node has been set
+ * thrd_attr_policy		policy and rt_priority have been set
+ */
+enum {
+	thrd_attr_stacksize = 1 << 0,
+	thrd_attr_guardsize = 1 << 1,
+	thrd_attr_stack     = 1 << 2,
+	thrd_attr_name      = 1 << 3,
+	thrd_attr_affinity  = 1 << 4,
+	thrd_attr_priority  = 1 << 5,
+	thrd_attr_node      = 1 << 6,
+	thrd_attr_policy    = 1 << 7
+};
+
+
+
+/**
+ * Scheduling policy enum, hints telling the system how the CPU time of a thread should be shared
+ *
+ * thrd_sched_normal	default time-sharing policy, the nice value sets the share of the thread
+ * thrd_sched_batch		CPU-bound background work, never preempts the other threads on wake-up (SCHED_BATCH)
+ * thrd_sched_idle		only runs when nothing else wants the CPU (SCHED_IDLE)
+ * thrd_sched_fifo		real-time policy, falls back to thrd_sched_normal with the lowest permitted nice value (highest priority) without privileges (SCHED_FIFO)
+ */
+enum {
+	thrd_sched_normal,
+	thrd_sched_batch,
+	thrd_sched_idle,
+	thrd_sched_fifo
+};
+
+
+
+/**
+ * Placement value of thrd_create_n that does not pin the threads
+ */
+#define THRD_PLACEMENT_NONE (-1)
+
+
+
+/**
+ * Thread attributes used by thrd_create_ex, must be initialized with thrd_attr_init and filled with the thrd_attr_set* functions
+ * THRD_NAME_MAX is the size of the name buffer including the terminating null byte (Linux limit)
+ */
+#define THRD_NAME_MAX 16
+
+typedef struct {
+	unsigned int flags;
+	size_t stack_size;
+	size_t guard_size;
+	void* stack_addr;
+	char name[THRD_NAME_MAX];
+	thrd_cpuset_t cpuset;
+	int priority;
+	int node;
+	int policy;
+	int rt_priority;
+} thrd_attr_t;
+
+
+
 /**
  * Creates a new thread executing the function func. The function is invoked as func(arg).
  * If successful, the object pointed to by thr is set to the identifier of the new thread.
@@ -80,6 +192,218 @@ int thrd_create(__OUT__ thrd_t* thr, thrd_start_t func, void* arg);
 
 
 
+/**
+ * Same as thrd_create, but the new thread is created with the attributes pointed to by attr.
+ * Stack, affinity, name, priority and scheduling policy are all applied before func is invoked, the thread never runs user code with the wrong settings.
+ *
+ * @param thr			pointer to memory location to put the identifier of the new thread
+ * @param attr			attributes of the new thread, NULL is equivalent to thrd_create
+ * @param func			function to execute
+ * @param arg			argument to pass to the function
+ * @return				thrd_success if the creation of the new thread was successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int thrd_create_ex(__OUT__ thrd_t* thr, const thrd_attr_t* attr, thrd_start_t func, void* arg);
+
+
+
+/**
+ * Creates count threads that all begin at the same time: they wait on a start gate released by a single futex wake-up once all are created.
+ * The thread i is invoked as func(args[i]), and pinned according to placement if it is not THRD_PLACEMENT_NONE.
+ * If a creation fails, the threads already created are joined without calling func.
+ *
+ * @param thrs			array of count identifiers to fill
+ * @param count			number of threads
+ * @param attr			attributes of the threads, NULL for defaults. The affinity is replaced by the placement if there is one
+ * @param placement		THRD_PLACEMENT_NONE or a placement policy of topology.h (topo_compact, topo_scatter, topo_one_per_core)
+ * @param func			function to execute
+ * @param args			array of count arguments, NULL to pass NULL to every thread
+ * @return				thrd_success if all the threads were created. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int thrd_create_n(__OUT__ thrd_t* thrs, unsigned int count, const thrd_attr_t* attr, int placement, thrd_start_t func, void* const* args);
+
+
+
+/**
+ * Joins count threads, typically created by thrd_create_n. Every thread is joined even if some joins fail.
+ *
+ * @param thrs			array of count identifiers
+ * @param count			number of threads
+ * @param res			array of count locations to put the result codes to, may be NULL
+ * @return				thrd_success if all the joins were successful, thrd_error otherwise.
+ */
+int thrd_join_n(thrd_t* thrs, unsigned int count, __OUT__ int* res);
+
+
+
+/**
+ * Enables the recycling of OS threads. A thread whose start function returns parks in a bounded idle cache,
+ * and a later thrd_create or thrd_create_ex hands its function to an idle thread instead of spawning a new one.
+ * thrd_join and thrd_detach behave the same. Threads created with stack attributes, or ending with thrd_exit, are never recycled.
+ * Not supported under Windows.
+ *
+ * @param capacity		maximal number of idle threads, 0 disables recycling and terminates the idle threads
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_recycle(unsigned int capacity);
+
+
+
+/**
+ * Initializes attr with default values: nothing set, thrd_create_ex then behaves like thrd_create.
+ *
+ * @param attr			pointer to the attributes to initialize
+ */
+void thrd_attr_init(__OUT__ thrd_attr_t* attr);
+
+
+
+/**
+ * Sets the stack size of the thread, the system allocates the stack.
+ *
+ * @param attr			pointer to the attributes
+ * @param size			size of the stack in bytes, must be at least PTHREAD_STACK_MIN under Posix
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_attr_setstacksize(__INOUT__ thrd_attr_t* attr, size_t size);
+
+
+
+/**
+ * Sets the size of the guard area placed after the stack, 0 disables the guard area.
+ * Ignored when a caller-provided stack is used and under Windows, where the guard page is managed by the system.
+ *
+ * @param attr			pointer to the attributes
+ * @param size			size of the guard area in bytes
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_attr_setguardsize(__INOUT__ thrd_attr_t* attr, size_t size);
+
+
+
+/**
+ * Sets a caller-provided stack. The memory must stay valid until the thread has been joined, it cannot be used with a detached thread.
+ * Not supported under Windows.
+ *
+ * @param attr			pointer to the attributes
+ * @param addr			lowest address of the stack
+ * @param size			size of the stack in bytes
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_attr_setstack(__INOUT__ thrd_attr_t* attr, void* addr, size_t size);
+
+
+
+/**
+ * Sets the name of the thread, visible in tools like top, perf or gdb. Names longer than THRD_NAME_MAX - 1 characters are truncated.
+ *
+ * @param attr			pointer to the attributes
+ * @param name			null-terminated name of the thread
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_attr_setname(__INOUT__ thrd_attr_t* attr, const char* name);
+
+
+
+/**
+ * Sets the CPUs the thread is allowed to run on.
+ *
+ * @param attr			pointer to the attributes
+ * @param cpuset		pointer to the set of allowed CPUs, must not be empty
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_attr_setaffinity(__INOUT__ thrd_attr_t* attr, const thrd_cpuset_t* cpuset);
+
+
+
+/**
+ * Creates the thread on a NUMA node: its stack is mapped by the library with its pages allocated on node,
+ * and the thread is pinned to the CPUs of node before it runs, unless an affinity is also set.
+ * A thread created on a node is not recycled, and the stack of a detached one is unmapped by a later thread creation.
+ * Under Windows only the affinity is applied, the stack is committed by the thread itself once it runs on node.
+ *
+ * @param attr			pointer to the attributes
+ * @param node			NUMA node id, see topology.h
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_attr_setnode(__INOUT__ thrd_attr_t* attr, int node);
+
+
+
+/**
+ * Sets the priority of the thread as a nice value, from -20 (highest priority) to 19 (lowest priority).
+ * Under Windows the nice value is mapped to the closest thread priority level.
+ *
+ * @param attr			pointer to the attributes
+ * @param priority		nice value of the thread
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_attr_setpriority(__INOUT__ thrd_attr_t* attr, int priority);
+
+
+
+/**
+ * Sets the scheduling policy of the thread, applied before func is invoked. A nice value set with thrd_attr_setpriority is applied after it.
+ * See thrd_set_policy for the fallback of thrd_sched_fifo.
+ *
+ * @param attr			pointer to the attributes
+ * @param policy		one of the scheduling policy enum values
+ * @param rt_priority	real-time priority from 1 to 99 for thrd_sched_fifo, ignored by the other policies
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_attr_setpolicy(__INOUT__ thrd_attr_t* attr, int policy, int rt_priority);
+
+
+
+/**
+ * Removes all CPUs from cpuset.
+ *
+ * @param cpuset		pointer to the CPU set
+ */
+void thrd_cpuset_zero(__OUT__ thrd_cpuset_t* cpuset);
+
+
+
+/**
+ * Adds cpu to cpuset, does nothing if cpu is out of range.
+ *
+ * @param cpuset		pointer to the CPU set
+ * @param cpu			index of the CPU
+ */
+void thrd_cpuset_set(__INOUT__ thrd_cpuset_t* cpuset, int cpu);
+
+
+
+/**
+ * Removes cpu from cpuset, does nothing if cpu is out of range.
+ *
+ * @param cpuset		pointer to the CPU set
+ * @param cpu			index of the CPU
+ */
+void thrd_cpuset_clear(__INOUT__ thrd_cpuset_t* cpuset, int cpu);
+
+
+
+/**
+ * Checks whether cpu belongs to cpuset.
+ *
+ * @param cpuset		pointer to the CPU set
+ * @param cpu			index of the CPU
+ * @return				Non-zero value if cpu is in cpuset, 0 otherwise.
+ */
+int thrd_cpuset_isset(const thrd_cpuset_t* cpuset, int cpu);
+
+
+
+/**
+ * Counts the CPUs of cpuset.
+ *
+ * @param cpuset		pointer to the CPU set
+ * @return				number of CPUs in cpuset
+ */
+int thrd_cpuset_count(const thrd_cpuset_t* cpuset);
+
+
+
 /**
  * Returns the identifier of the calling thread. 
  *
@@ -99,6 +423,66 @@ int thrd_detach(thrd_t thr);
 
 
 
+/**
+ * Sets the CPUs the thread identified by thr is allowed to run on, it is moved immediately if it runs elsewhere.
+ * See topology.h for CPU discovery and placement policies.
+ *
+ * @param thr			identifier of the thread
+ * @param cpuset		pointer to the set of allowed CPUs, must not be empty
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_set_affinity(thrd_t thr, const thrd_cpuset_t* cpuset);
+
+
+
+/**
+ * Gets the CPUs the thread identified by thr is allowed to run on.
+ *
+ * @param thr			identifier of the thread
+ * @param cpuset		pointer to the CPU set to fill
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_get_affinity(thrd_t thr, __OUT__ thrd_cpuset_t* cpuset);
+
+
+
+/**
+ * Sets the scheduling policy of the calling thread, e.g. thrd_sched_idle for a background thread that must yield to the others.
+ * thrd_sched_fifo needs privileges (CAP_SYS_NICE or RLIMIT_RTPRIO): without them the thread falls back to thrd_sched_normal
+ * with the highest priority RLIMIT_NICE permits, and thrd_success is still returned, thrd_get_policy tells which policy is in effect.
+ * Leaving thrd_sched_idle needs RLIMIT_NICE to permit the nice value of the thread under Linux.
+ * Under Windows the policies are mapped to thread priority levels.
+ *
+ * @param policy		one of the scheduling policy enum values
+ * @param rt_priority	real-time priority from 1 to 99 for thrd_sched_fifo, ignored by the other policies
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_set_policy(int policy, int rt_priority);
+
+
+
+/**
+ * Gets the scheduling policy of the calling thread.
+ *
+ * @param policy		location to put the scheduling policy enum value to
+ * @param rt_priority	location to put the real-time priority to, 0 unless the policy is thrd_sched_fifo, may be NULL
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_get_policy(__OUT__ int* policy, __OUT__ int* rt_priority);
+
+
+
+/**
+ * Sets the priority of the calling thread as a nice value, from -20 (highest priority) to 19 (lowest priority).
+ * Lowering the nice value needs privileges or a high enough RLIMIT_NICE under Linux.
+ *
+ * @param priority		nice value of the thread
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_set_priority(int priority);
+
+
+
 /**
  * Checks whether lhs and rhs refer to the same thread.
  *
@@ -133,6 +517,34 @@ int thrd_join(thrd_t thr, __OUT__ int* res);
 
 
 
+/**
+ * Same as thrd_join, but gives up once deadline has passed. The thread is left joinable when the join times out.
+ * The wait is done on the completion futex of the thread, there is no polling.
+ *
+ * @param thr			identifier of the thread to join
+ * @param deadline		absolute TIME_UTC point in time to wait until, NULL to wait without time limit
+ * @param res			location to put the result code to, may be NULL
+ * @return				thrd_success if successful, thrd_timedout if the thread has not finished before deadline, thrd_error otherwise.
+ */
+int thrd_join_timed(thrd_t thr, const struct timespec* deadline, __OUT__ int* res);
+
+
+
+/**
+ * Joins the first of count threads to finish, the others are left joinable. If several have finished, the lowest index is joined.
+ * Threads not created by the library (e.g. main) are not supported. Under Windows count is limited to MAXIMUM_WAIT_OBJECTS.
+ *
+ * @param thrs			array of count identifiers
+ * @param count			number of threads
+ * @param deadline		absolute TIME_UTC point in time to wait until, NULL to wait without time limit
+ * @param index			location to put the index of the joined thread to, may be NULL
+ * @param res			location to put the result code to, may be NULL
+ * @return				thrd_success if a thread has been joined, thrd_timedout if none has finished before deadline, thrd_error otherwise.
+ */
+int thrd_join_any(thrd_t* thrs, unsigned int count, const struct timespec* deadline, __OUT__ unsigned int* index, __OUT__ int* res);
+
+
+
 /**
  * Provides a hint to the implementation to reschedule the execution of threads, allowing other threads to run.
  */
@@ -140,6 +552,94 @@ void thrd_yield(void);
 
 
 
+/**
+ * Provides a hint to the processor that the calling thread is in a spin-wait loop (pause on x86, yield on ARM).
+ * Unlike thrd_yield, it does not enter the system, it only lets the sibling hyper-thread and the memory system make progress.
+ */
+void thrd_relax(void);
+
+
+
+/**
+ * Initializes a backoff with its escalation thresholds.
+ *
+ * @param backoff		pointer to the backoff to initialize
+ * @param spins			number of waits in the pause phase
+ * @param yields		number of waits in the yield phase
+ * @param sleep			duration in nanoseconds of each wait after the yield phase, 0 keeps yielding
+ */
+void thrd_backoff_init(__OUT__ thrd_backoff_t* backoff, unsigned int spins, unsigned int yields, long sleep);
+
+
+
+/**
+ * Waits once, the wait becomes longer as the backoff escalates. Its sleeps do not call the blocking hook, see thrd_set_blocking_hook.
+ *
+ * @param backoff		pointer to the backoff
+ */
+void thrd_backoff_wait(__INOUT__ thrd_backoff_t* backoff);
+
+
+
+/**
+ * Resets the backoff to the pause phase, typically once the awaited condition is met.
+ *
+ * @param backoff		pointer to the backoff
+ */
+void thrd_backoff_reset(__INOUT__ thrd_backoff_t* backoff);
+
+
+
+/**
+ * Blocks the execution of the current thread for at least the time period pointed to by duration.
+ * The sleep is done against an absolute monotonic deadline, so an interrupted sleep can be resumed with remaining without drift.
+ * If thrd_set_sleep_spin has been called, the last part of the sleep is spun instead of slept for precise wake-ups.
+ *
+ * @param duration		pointer to the duration to sleep for
+ * @param remaining		pointer to the object to put the remaining time on interruption, may be NULL
+ * @return				0 on successful sleep, -1 if a signal occurred, other negative value if an error occurred.
+ */
+int thrd_sleep(const struct timespec* duration, __OUT__ struct timespec* remaining);
+
+
+
+/**
+ * Sets the precise sleep mode of the calling thread: thrd_sleep sleeps until nanoseconds before the deadline, then spins the remainder.
+ * The spin must cover the timer slack and wake-up latency of the system, 50 microseconds under Linux by default.
+ *
+ * @param nanoseconds	length of the spin at the end of each thrd_sleep, 0 disables the precise mode (default)
+ */
+void thrd_set_sleep_spin(long nanoseconds);
+
+
+
+/**
+ * The type thrd_blocking_t is a blocking hook, called as hook(1) before the calling thread may sleep in a function of the library and as hook(0) once it runs again
+ */
+typedef void (*thrd_blocking_t)(int blocking);
+
+
+
+/**
+ * Sets the blocking hook of the calling thread, called by mtx_lock on a contended mutex, thrd_join, thrd_join_timed and thrd_join_any on a thread still running,
+ * and thrd_sleep, but not by the sleeps of thrd_backoff_wait, which polls. The thread pool sets it on its workers to make up for the blocked ones, see tpool_begin_blocking.
+ *
+ * @param hook			blocking hook, NULL for none (default)
+ */
+void thrd_set_blocking_hook(thrd_blocking_t hook);
+
+
+
+/**
+ * Sets the timer slack of the calling thread, the time the kernel may delay its timers to group wake-ups (Linux only).
+ *
+ * @param nanoseconds	timer slack, 0 restores the default value of the thread
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int thrd_set_timerslack(unsigned long nanoseconds);
+
+
+
 /**
  * Destroys the mutex pointed to by mutex.
  * If there are threads waiting on mutex, the behavior is undefined.
@@ -0,0 +1,581 @@
+﻿/**
+	Timer service for the Cross Platform C11 Native Threads library
+*/
+#include "timer.h"
+#include "futex.h"
+
+#include <errno.h>  /* For errno */
+#include <limits.h> /* For LLONG_MAX, LLONG_MIN */
+#include <stdint.h> /* For uint64_t */
+#include <stdlib.h> /* For malloc(), free() */
+
+
+
+/* Each level of the wheel has 1 << TMR_LEVEL_BITS slots, a slot of level l spans 1 << (l * TMR_LEVEL_BITS) ticks */
+#define TMR_LEVEL_BITS 6
+#define TMR_SLOTS (1 << TMR_LEVEL_BITS)
+#define TMR_LEVELS 6
+
+/* Largest number of timers run by one task of the pool */
+#define TMR_BATCH 64
+
+/* Cache line size assumed for padding */
+#define TMR_CACHE_LINE 64
+
+
+
+/**
+ * Timer state enum
+ *
+ * tmr_armed		the timer expires at its deadline
+ * tmr_expired		a one-shot timer has been dispatched
+ * tmr_cancelled	the timer has been cancelled before it was dispatched
+ */
+enum {
+	tmr_armed,
+	tmr_expired,
+	tmr_cancelled
+};
+
+
+
+/**
+ * Timer, allocated by tmr_schedule and reference-counted: one reference for the caller, one while it is posted,
+ * one while it is in the wheel and one per dispatched run
+ *
+ * deadline		next expiration in TIME_UTC nanoseconds
+ * posted		1 while the timer is in the post list of the service, the driver then looks at it again
+ * post			next timer of the post list
+ * next, prev	neighbours in the list of a slot, prev points to the link pointing to the timer. Only the driver uses them
+ * level, slot	position of the timer in the wheel, level is -1 if it is not in it
+ */
+struct tmr_timer {
+	atomic_int state;
+	atomic_int references;
+	_Atomic(long long) deadline;
+	atomic_int posted;
+	struct tmr_timer* post;
+
+	struct tmr_timer* next;
+	struct tmr_timer** prev;
+	int level;
+	int slot;
+
+	long long period;
+	tpool_func_t func;
+	void* arg;
+};
+
+
+
+/**
+ * Timer service. The wheel is only read and written by the driver thread, the other threads post their timers to it
+ *
+ * posts		lock-free stack of the timers scheduled, cancelled or rescheduled since the driver last looked
+ * signal		futex word the driver sleeps on, incremented to wake it up
+ * sleeping		tick the driver sleeps until, LLONG_MIN while it is awake: a timer expiring before that wakes it up
+ * origin		TIME_UTC time of tick 0 in nanoseconds
+ * tick			last tick processed by the driver
+ * count		number of timers in the wheel
+ * occupied		bitmap of the non-empty slots of each level
+ */
+struct tmr_service {
+	_Atomic(struct tmr_timer*) posts;
+	atomic_int signal;
+	_Atomic(long long) sleeping;
+	atomic_int stop;
+	char pad0[TMR_CACHE_LINE];
+
+	tpool_t pool;
+	long long resolution;
+	long long origin;
+	long long tick;
+	size_t count;
+	uint64_t occupied[TMR_LEVELS];
+	struct tmr_timer* slots[TMR_LEVELS][TMR_SLOTS];
+	thrd_t thread;
+};
+
+
+
+/**
+ * Timers expiring together, run by one task of the pool
+ */
+struct tmr_batch {
+	unsigned int count;
+	struct tmr_timer* timers[TMR_BATCH];
+};
+
+
+
+/**
+ * Current TIME_UTC time in nanoseconds, the clock of the deadlines
+ */
+static long long tmr_clock(void) {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+/**
+ * First tick at or after time, so that a timer never expires early
+ */
+static long long tmr_tick(struct tmr_service* service, long long time) {
+	if (time <= service->origin) {
+		return 0;
+	}
+	return (time - service->origin + service->resolution - 1) / service->resolution;
+}
+
+
+
+void tmr_release(tmr_timer_t timer) {
+	if (atomic_fetch_sub_explicit(&timer->references, 1, memory_order_acq_rel) == 1) {
+		free(timer);
+	}
+}
+
+
+
+/**
+ * Pushes a timer to the post list, then wakes the driver up if wake is set and deadline comes before the tick the driver sleeps until.
+ * The timer may be released by the driver as soon as it is pushed, its deadline is read by the caller before
+ */
+static void tmr_post(struct tmr_service* service, struct tmr_timer* timer, int wake, long long deadline) {
+	struct tmr_timer* head = atomic_load_explicit(&service->posts, memory_order_relaxed);
+	do {
+		timer->post = head;
+	} while (!atomic_compare_exchange_weak_explicit(&service->posts, &head, timer, memory_order_release, memory_order_relaxed));
+
+	/* Pairs with the fence of tmr_main: either the driver sees the post, or this thread sees the tick it sleeps until */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (wake && tmr_tick(service, deadline) < atomic_load_explicit(&service->sleeping, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&service->signal, 1, memory_order_release);
+		futex_wake(&service->signal, 1);
+	}
+}
+
+
+
+/**
+ * Posts a timer whose state or deadline has changed, unless it is already posted: the driver has not looked at it yet and will see the change
+ */
+static void tmr_touch(struct tmr_service* service, struct tmr_timer* timer, int wake, long long deadline) {
+	if (!atomic_exchange_explicit(&timer->posted, 1, memory_order_acq_rel)) {
+		atomic_fetch_add_explicit(&timer->references, 1, memory_order_relaxed);
+		tmr_post(service, timer, wake, deadline);
+	}
+}
+
+
+
+/**
+ * Runs the timers of a batch and drops the references of their runs
+ */
+static void tmr_batch_run(void* arg) {
+	struct tmr_batch* batch = (struct tmr_batch*) arg;
+	for (unsigned int i = 0; i < batch->count; ++i) {
+		struct tmr_timer* timer = batch->timers[i];
+		timer->func(timer->arg);
+		tmr_release(timer);
+	}
+	free(batch);
+}
+
+
+
+/**
+ * Submits the batch being filled by the driver, or runs it on the driver if it cannot be submitted
+ */
+static void tmr_flush(struct tmr_service* service, struct tmr_batch** batch) {
+	if (*batch == NULL) {
+		return;
+	}
+
+	if (service->pool == NULL || tpool_submit(service->pool, tmr_batch_run, *batch) != thrd_success) {
+		tmr_batch_run(*batch);
+	}
+	*batch = NULL;
+}
+
+
+
+/**
+ * Adds an expired timer to the batch being filled, its reference goes with it. Runs it on the driver if there is no memory for a batch
+ */
+static void tmr_dispatch(struct tmr_service* service, struct tmr_batch** batch, struct tmr_timer* timer) {
+	if (*batch == NULL) {
+		*batch = (struct tmr_batch*) malloc(sizeof(struct tmr_batch));
+		if (*batch == NULL) {
+			timer->func(timer->arg);
+			tmr_release(timer);
+			return;
+		}
+		(*batch)->count = 0;
+	}
+
+	(*batch)->timers[(*batch)->count++] = timer;
+	if ((*batch)->count == TMR_BATCH) {
+		tmr_flush(service, batch);
+	}
+}
+
+
+
+/**
+ * Links a timer in the slot of its deadline, returns 0 if the deadline is not after the current tick. Deadlines out of the range of the wheel
+ * go to the farthest slot and are placed again when it is reached
+ */
+static int tmr_link(struct tmr_service* service, struct tmr_timer* timer) {
+	long long tick = tmr_tick(service, atomic_load_explicit(&timer->deadline, memory_order_relaxed));
+	long long delta = tick - service->tick;
+	if (delta <= 0) {
+		return 0;
+	}
+
+	int level = 0;
+	while (level < TMR_LEVELS - 1 && delta >= 1LL << ((level + 1) * TMR_LEVEL_BITS)) {
+		++level;
+	}
+	if (delta >= 1LL << (TMR_LEVELS * TMR_LEVEL_BITS)) {
+		tick = service->tick + (1LL << (TMR_LEVELS * TMR_LEVEL_BITS)) - 1;
+	}
+
+	int slot = (int) ((tick >> (level * TMR_LEVEL_BITS)) & (TMR_SLOTS - 1));
+	struct tmr_timer** head = &service->slots[level][slot];
+	timer->next = *head;
+	timer->prev = head;
+	if (*head != NULL) {
+		(*head)->prev = &timer->next;
+	}
+	*head = timer;
+	timer->level = level;
+	timer->slot = slot;
+
+	service->occupied[level] |= (uint64_t) 1 << slot;
+	++service->count;
+	return 1;
+}
+
+
+
+/**
+ * Unlinks a timer from its slot, the reference of the wheel is kept by the caller
+ */
+static void tmr_unlink(struct tmr_service* service, struct tmr_timer* timer) {
+	*timer->prev = timer->next;
+	if (timer->next != NULL) {
+		timer->next->prev = timer->prev;
+	}
+	if (service->slots[timer->level][timer->slot] == NULL) {
+		service->occupied[timer->level] &= ~((uint64_t) 1 << timer->slot);
+	}
+
+	timer->level = -1;
+	--service->count;
+}
+
+
+
+/**
+ * Decides what becomes of a timer the driver holds one reference on: dropped if it is not armed, linked if its deadline is ahead,
+ * dispatched otherwise. A periodic timer is linked again at its next period
+ */
+static void tmr_place(struct tmr_service* service, struct tmr_batch** batch, struct tmr_timer* timer) {
+	int state = atomic_load_explicit(&timer->state, memory_order_acquire);
+	if (state != tmr_armed) {
+		tmr_release(timer);
+		return;
+	}
+	if (tmr_link(service, timer)) {
+		return;
+	}
+
+	/* Expired: the dispatch races with tmr_cancel on the state */
+	if (timer->period == 0) {
+		if (atomic_compare_exchange_strong_explicit(&timer->state, &state, tmr_expired, memory_order_acq_rel, memory_order_acquire)) {
+			tmr_dispatch(service, batch, timer);
+		} else {
+			tmr_release(timer);
+		}
+		return;
+	}
+	if (!atomic_compare_exchange_strong_explicit(&timer->state, &state, tmr_armed, memory_order_acq_rel, memory_order_acquire)) {
+		tmr_release(timer);
+		return;
+	}
+
+	/* Next period after the current tick, the periods the timer is late for are skipped. A concurrent tmr_reschedule wins and posts the timer */
+	long long deadline = atomic_load_explicit(&timer->deadline, memory_order_relaxed);
+	long long now = service->origin + service->tick * service->resolution;
+	long long next = deadline + ((now - deadline) / timer->period + 1) * timer->period;
+	atomic_fetch_add_explicit(&timer->references, 1, memory_order_relaxed);
+	if (atomic_compare_exchange_strong_explicit(&timer->deadline, &deadline, next, memory_order_relaxed, memory_order_relaxed)) {
+		tmr_link(service, timer);
+	} else {
+		tmr_release(timer);
+	}
+	tmr_dispatch(service, batch, timer);
+}
+
+
+
+/**
+ * Takes the post list and places each timer again, from its current state and deadline
+ */
+static void tmr_drain(struct tmr_service* service, struct tmr_batch** batch) {
+	struct tmr_timer* timer = atomic_exchange_explicit(&service->posts, NULL, memory_order_acquire);
+	while (timer != NULL) {
+		struct tmr_timer* next = timer->post;
+
+		/* A change made from now on posts the timer again, the exchange reads the last change made before */
+		atomic_exchange_explicit(&timer->posted, 0, memory_order_acq_rel);
+
+		/* The reference of the post list replaces the one of the wheel */
+		if (timer->level >= 0) {
+			tmr_unlink(service, timer);
+			tmr_release(timer);
+		}
+		tmr_place(service, batch, timer);
+		timer = next;
+	}
+}
+
+
+
+/**
+ * Next tick after the current one at which a non-empty slot is reached, LLONG_MAX if the wheel is empty
+ */
+static long long tmr_next(struct tmr_service* service) {
+	long long next = LLONG_MAX;
+	if (service->count == 0) {
+		return next;
+	}
+
+	for (int level = 0; level < TMR_LEVELS; ++level) {
+		if (service->occupied[level] == 0) {
+			continue;
+		}
+
+		int shift = level * TMR_LEVEL_BITS;
+		long long base = service->tick >> shift;
+		for (long long k = 1; k <= TMR_SLOTS; ++k) {
+			if (service->occupied[level] & ((uint64_t) 1 << ((base + k) & (TMR_SLOTS - 1)))) {
+				if (((base + k) << shift) < next) {
+					next = (base + k) << shift;
+				}
+				break;
+			}
+		}
+	}
+	return next;
+}
+
+
+
+/**
+ * Processes a tick: the slots of the upper levels it reaches are cascaded, then the timers of the slot of level 0 are placed
+ */
+static void tmr_advance(struct tmr_service* service, struct tmr_batch** batch, long long tick) {
+	service->tick = tick;
+	for (int level = TMR_LEVELS - 1; level >= 0; --level) {
+		int shift = level * TMR_LEVEL_BITS;
+		if (level != 0 && (tick & ((1LL << shift) - 1)) != 0) {
+			continue;
+		}
+
+		int slot = (int) ((tick >> shift) & (TMR_SLOTS - 1));
+		struct tmr_timer* timer = service->slots[level][slot];
+		service->slots[level][slot] = NULL;
+		service->occupied[level] &= ~((uint64_t) 1 << slot);
+		while (timer != NULL) {
+			struct tmr_timer* next = timer->next;
+			timer->level = -1;
+			--service->count;
+			tmr_place(service, batch, timer);
+			timer = next;
+		}
+	}
+}
+
+
+
+/**
+ * Driver thread: places the posted timers, processes the ticks that have passed, submits their timers, then sleeps until the next tick holding a timer
+ */
+static int tmr_main(void* arg) {
+	struct tmr_service* service = (struct tmr_service*) arg;
+	struct tmr_batch* batch = NULL;
+
+	while (!atomic_load_explicit(&service->stop, memory_order_acquire)) {
+		tmr_drain(service, &batch);
+
+		/* Ticks without a timer are skipped */
+		long long now = (tmr_clock() - service->origin) / service->resolution;
+		long long next;
+		while ((next = tmr_next(service)) <= now) {
+			tmr_advance(service, &batch, next);
+		}
+		if (now > service->tick) {
+			service->tick = now;
+		}
+		tmr_flush(service, &batch);
+
+		/* Pairs with the fence of tmr_post */
+		int signal = atomic_load_explicit(&service->signal, memory_order_acquire);
+		atomic_store_explicit(&service->sleeping, next, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load_explicit(&service->posts, memory_order_relaxed) == NULL && !atomic_load_explicit(&service->stop, memory_order_relaxed)) {
+			if (next == LLONG_MAX) {
+				futex_wait(&service->signal, signal, NULL);
+			} else {
+				long long time = service->origin + next * service->resolution;
+				struct timespec deadline = { time / 1000000000LL, time % 1000000000LL };
+				futex_wait(&service->signal, signal, &deadline);
+			}
+		}
+		atomic_store_explicit(&service->sleeping, LLONG_MIN, memory_order_relaxed);
+	}
+	return 0;
+}
+
+
+
+int tmr_create(__OUT__ tmr_t* service, tpool_t pool, long long resolution) {
+	/* ERROR: A tick has a duration */
+	if (resolution < 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	struct tmr_service* self = (struct tmr_service*) calloc(1, sizeof(struct tmr_service));
+
+	/* ERROR: No memory for the service */
+	if (self == NULL) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	atomic_init(&self->posts, NULL);
+	atomic_init(&self->signal, 0);
+	atomic_init(&self->sleeping, LLONG_MIN);
+	atomic_init(&self->stop, 0);
+	self->pool = (pool != NULL) ? pool : tpool_shared();
+	self->resolution = (resolution != 0) ? resolution : TMR_RESOLUTION;
+	self->origin = tmr_clock();
+
+	thrd_attr_t attr;
+	thrd_attr_init(&attr);
+	thrd_attr_setname(&attr, "tmr");
+	int value = thrd_create_ex(&self->thread, &attr, tmr_main, self);
+
+	/* ERROR: errno is kept from thrd_create_ex */
+	if (value != thrd_success) {
+		free(self);
+		return value;
+	}
+
+	*service = self;
+	return thrd_success;
+}
+
+
+
+void tmr_destroy(tmr_t service) {
+	atomic_store_explicit(&service->stop, 1, memory_order_release);
+	atomic_fetch_add_explicit(&service->signal, 1, memory_order_release);
+	futex_wake(&service->signal, 1);
+	thrd_join(service->thread, NULL);
+
+	/* A posted timer in the wheel keeps the reference of the wheel, it is released after */
+	struct tmr_timer* timer = atomic_exchange_explicit(&service->posts, NULL, memory_order_acquire);
+	while (timer != NULL) {
+		struct tmr_timer* next = timer->post;
+		tmr_release(timer);
+		timer = next;
+	}
+
+	for (int level = 0; level < TMR_LEVELS; ++level) {
+		for (int slot = 0; slot < TMR_SLOTS; ++slot) {
+			timer = service->slots[level][slot];
+			while (timer != NULL) {
+				struct tmr_timer* next = timer->next;
+				tmr_release(timer);
+				timer = next;
+			}
+		}
+	}
+	free(service);
+}
+
+
+
+int tmr_schedule(tmr_t service, const struct timespec* deadline, long long period, tpool_func_t func, void* arg, __OUT__ tmr_timer_t* timer) {
+	/* ERROR: A timer needs a function, a deadline and a period that is not negative */
+	if (func == NULL || deadline == NULL || period < 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	struct tmr_timer* self = (struct tmr_timer*) malloc(sizeof(struct tmr_timer));
+
+	/* ERROR: No memory for the timer */
+	if (self == NULL) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	/* One reference for the post list, one for the caller if it keeps the timer */
+	long long time = deadline->tv_sec * 1000000000LL + deadline->tv_nsec;
+	atomic_init(&self->state, tmr_armed);
+	atomic_init(&self->references, (timer != NULL) ? 2 : 1);
+	atomic_init(&self->deadline, time);
+	atomic_init(&self->posted, 1);
+	self->post = NULL;
+	self->next = NULL;
+	self->prev = NULL;
+	self->level = -1;
+	self->slot = 0;
+	self->period = period;
+	self->func = func;
+	self->arg = arg;
+
+	if (timer != NULL) {
+		*timer = self;
+	}
+	tmr_post(service, self, 1, time);
+	return thrd_success;
+}
+
+
+
+int tmr_cancel(tmr_t service, tmr_timer_t timer) {
+	int state = tmr_armed;
+
+	/* ERROR: The timer has already expired or been cancelled */
+	if (!atomic_compare_exchange_strong_explicit(&timer->state, &state, tmr_cancelled, memory_order_acq_rel, memory_order_acquire)) {
+		return thrd_busy;
+	}
+
+	/* The driver drops it from the wheel the next time it wakes up, there is no need to wake it now */
+	tmr_touch(service, timer, 0, 0);
+	return thrd_success;
+}
+
+
+
+int tmr_reschedule(tmr_t service, tmr_timer_t timer, const struct timespec* deadline) {
+	/* ERROR: A timer needs a deadline */
+	if (deadline == NULL) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	long long time = deadline->tv_sec * 1000000000LL + deadline->tv_nsec;
+	atomic_store_explicit(&timer->deadline, time, memory_order_relaxed);
+	atomic_store_explicit(&timer->state, tmr_armed, memory_order_release);
+	tmr_touch(service, timer, 1, time);
+	return thrd_success;
+}
@@ -0,0 +1,107 @@
+﻿#ifndef C11_THREADS_TIMER_HEADER
+#define C11_THREADS_TIMER_HEADER
+
+#include "threads.h"
+#include "tpool.h"
+
+
+
+/**
+ * Timer service: delayed and periodic tasks kept in a hierarchical hashed timing wheel. Scheduling, cancelling and rescheduling a timer
+ * are O(1) and lock-free from any thread: they only post the timer to a single driver thread, which owns the wheel.
+ * The driver sleeps until the next tick holding a timer, with an absolute deadline, and submits the timers expiring together to a pool in batches.
+ */
+
+
+
+/**
+ * Timer service, see timer.c
+ */
+typedef struct tmr_service* tmr_t;
+
+
+
+/**
+ * Timer, see timer.c
+ */
+typedef struct tmr_timer* tmr_timer_t;
+
+
+
+/**
+ * TMR_RESOLUTION is the default duration of a tick of the wheel in nanoseconds, a timer never expires before its deadline
+ * and is dispatched at most one tick after it
+ */
+#define TMR_RESOLUTION 1000000LL
+
+
+
+/**
+ * Creates a timer service and starts its driver thread, named "tmr".
+ *
+ * @param service		pointer to memory location to put the identifier of the new service
+ * @param pool			identifier of the pool to run the timers on, NULL for the shared pool. The driver runs them itself if there is none
+ * @param resolution	duration of a tick in nanoseconds, 0 for TMR_RESOLUTION
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int tmr_create(__OUT__ tmr_t* service, tpool_t pool, long long resolution);
+
+
+
+/**
+ * Stops the driver thread and destroys a service. Pending timers never run, tasks already submitted to the pool still do.
+ * The timers of the service must not be scheduled, cancelled or rescheduled any more, they still have to be released.
+ *
+ * @param service		identifier of the service
+ */
+void tmr_destroy(tmr_t service);
+
+
+
+/**
+ * Schedules func(arg) at a deadline, then every period nanoseconds if period is not 0. A periodic timer skips the periods it is late for.
+ *
+ * @param service		identifier of the service
+ * @param deadline		absolute TIME_UTC time of the first expiration
+ * @param period		period in nanoseconds, 0 for a one-shot timer
+ * @param func			function to run
+ * @param arg			argument to pass to func
+ * @param timer			pointer to memory location to put the identifier of the new timer, the caller then holds a reference released by tmr_release. May be NULL
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int tmr_schedule(tmr_t service, const struct timespec* deadline, long long period, tpool_func_t func, void* arg, __OUT__ tmr_timer_t* timer);
+
+
+
+/**
+ * Cancels a timer. Once it returns thrd_success, no expiration of the timer is dispatched any more,
+ * only a run of a periodic timer dispatched before may still be in progress.
+ *
+ * @param service		identifier of the service of the timer
+ * @param timer			identifier of the timer
+ * @return				thrd_success if the timer was armed, thrd_busy if it has already expired or been cancelled.
+ */
+int tmr_cancel(tmr_t service, tmr_timer_t timer);
+
+
+
+/**
+ * Moves the deadline of a timer, arming it again if it has expired or been cancelled. The period of the timer is kept.
+ *
+ * @param service		identifier of the service of the timer
+ * @param timer			identifier of the timer
+ * @param deadline		absolute TIME_UTC time of the next expiration
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tmr_reschedule(tmr_t service, tmr_timer_t timer, const struct timespec* deadline);
+
+
+
+/**
+ * Drops the reference of the caller on a timer. Releasing a timer does not cancel it.
+ *
+ * @param timer			identifier of the timer
+ */
+void tmr_release(tmr_timer_t timer);
+
+#endif /* C11_THREADS_TIMER_HEADER */
@@ -0,0 +1,731 @@
+﻿/**
+	CPU topology for the Cross Platform C11 Native Threads library
+
+	Linux:
+		https://www.kernel.org/doc/Documentation/cputopology.txt
+		https://www.kernel.org/doc/Documentation/ABI/testing/sysfs-devices-system-cpu
+		https://www.kernel.org/doc/Documentation/admin-guide/cgroup-v2.rst
+		https://www.kernel.org/doc/Documentation/scheduler/sched-bwc.txt
+*/
+#include "topology.h"
+
+#ifdef __unix__
+	#include <sched.h>			/* For sched_getaffinity() */
+	#include <unistd.h>			/* For sysconf() */
+#endif /* __unix__ */
+
+#include <errno.h>  /* For errno */
+#include <limits.h> /* For LLONG_MIN */
+#include <stdatomic.h> /* For atomic_uint */
+#include <stdio.h>  /* For fopen(), snprintf() */
+#include <stdlib.h> /* For calloc(), qsort() */
+#include <string.h> /* For memset(), strchr() */
+
+/* Root of the sysfs CPU and node directories, can be overridden at build time */
+#ifndef TOPO_SYSFS
+	#define TOPO_SYSFS "/sys/devices/system"
+#endif /* TOPO_SYSFS */
+
+/* Mount point of the cgroup file systems and root of procfs, can be overridden at build time */
+#ifndef TOPO_CGROUP
+	#define TOPO_CGROUP "/sys/fs/cgroup"
+#endif /* TOPO_CGROUP */
+#ifndef TOPO_PROC
+	#define TOPO_PROC "/proc"
+#endif /* TOPO_PROC */
+
+
+
+/**
+ * Ranks used by the placement policies, parallel to topo.cpus
+ *
+ * core_rank		rank of the core of the CPU among the cores of its L3 domain
+ * l3_rank			rank of the L3 domain of the CPU among the domains of its package
+ */
+typedef struct {
+	int core_rank;
+	int l3_rank;
+} topo_rank_t;
+
+static topo_t topo;
+static topo_cpu_t* topo_cpus = NULL;
+static topo_rank_t* topo_ranks = NULL;
+static int topo_index[THRD_CPUSET_SIZE];
+
+#ifdef __unix__
+	static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+#endif /* __unix__ */
+#ifdef _WIN32
+	static INIT_ONCE topo_once = INIT_ONCE_STATIC_INIT;
+#endif /* _WIN32 */
+
+/* Last answer of thrd_hardware_concurrency and the TIME_UTC time it was computed at, racing refreshes compute the same value */
+static atomic_uint topo_concurrency = 0;
+static _Atomic(long long) topo_concurrency_at = LLONG_MIN;
+
+
+
+/**
+ * Reads an integer from a sysfs file, returns 0 if successful
+ */
+static int topo_read_int(const char* path, __OUT__ int* value) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+	int count = fscanf(file, "%d", value);
+	fclose(file);
+	return (count == 1) ? 0 : -1;
+}
+
+
+
+/**
+ * Reads a sysfs CPU list like "0-3,8-11" into cpuset, returns 0 if successful
+ */
+static int topo_read_list(const char* path, __OUT__ thrd_cpuset_t* cpuset) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+
+	thrd_cpuset_zero(cpuset);
+	int first, last;
+	char separator;
+	while (fscanf(file, "%d", &first) == 1) {
+		last = first;
+		separator = (char) fgetc(file);
+		if (separator == '-') {
+			if (fscanf(file, "%d", &last) != 1) {
+				break;
+			}
+			separator = (char) fgetc(file);
+		}
+		for (int cpu = first; cpu <= last; ++cpu) {
+			thrd_cpuset_set(cpuset, cpu);
+		}
+		if (separator != ',') {
+			break;
+		}
+	}
+
+	fclose(file);
+	return 0;
+}
+
+
+
+static int topo_first(const thrd_cpuset_t* cpuset) {
+	for (int cpu = 0; cpu < THRD_CPUSET_SIZE; ++cpu) {
+		if (thrd_cpuset_isset(cpuset, cpu)) {
+			return cpu;
+		}
+	}
+	return -1;
+}
+
+
+
+/**
+ * Fills the CPUs the process is allowed to run on
+ */
+static void topo_allowed(__OUT__ thrd_cpuset_t* cpuset) {
+	thrd_cpuset_zero(cpuset);
+
+	#ifdef __linux__
+		cpu_set_t set;
+		if (sched_getaffinity(getpid(), sizeof(set), &set) == 0) {
+			for (int cpu = 0; cpu < THRD_CPUSET_SIZE && cpu < CPU_SETSIZE; ++cpu) {
+				if (CPU_ISSET(cpu, &set)) {
+					thrd_cpuset_set(cpuset, cpu);
+				}
+			}
+			return;
+		}
+	#endif /* __linux__ */
+
+	#ifdef _WIN32
+		DWORD_PTR process, system;
+		if (GetProcessAffinityMask(GetCurrentProcess(), &process, &system) != 0) {
+			for (int cpu = 0; cpu < (int) (8 * sizeof(DWORD_PTR)); ++cpu) {
+				if ((process >> cpu) & 1) {
+					thrd_cpuset_set(cpuset, cpu);
+				}
+			}
+			return;
+		}
+	#endif /* _WIN32 */
+
+	for (int i = 0; i < topo.cpu_count; ++i) {
+		thrd_cpuset_set(cpuset, topo_cpus[i].cpu);
+	}
+}
+
+
+
+/**
+ * Number of CPUs when sysfs is not available
+ */
+static int topo_fallback_count(void) {
+	#ifdef __unix__
+		long count = sysconf(_SC_NPROCESSORS_ONLN);
+	#endif /* __unix__ */
+
+	#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		long count = (long) info.dwNumberOfProcessors;
+	#endif /* _WIN32 */
+
+	if (count < 1) {
+		count = 1;
+	}
+	return (count > THRD_CPUSET_SIZE) ? THRD_CPUSET_SIZE : (int) count;
+}
+
+
+
+static void topo_discover(void) {
+	char path[256];
+	thrd_cpuset_t online;
+	int sysfs = (topo_read_list(TOPO_SYSFS "/cpu/online", &online) == 0 && thrd_cpuset_count(&online) > 0);
+	if (!sysfs) {
+		thrd_cpuset_zero(&online);
+		int count = topo_fallback_count();
+		for (int cpu = 0; cpu < count; ++cpu) {
+			thrd_cpuset_set(&online, cpu);
+		}
+	}
+
+	int count = thrd_cpuset_count(&online);
+	topo_cpus = (topo_cpu_t*) calloc((size_t) count, sizeof(topo_cpu_t));
+	topo_ranks = (topo_rank_t*) calloc((size_t) count, sizeof(topo_rank_t));
+	int* core_ids = (int*) calloc((size_t) count, sizeof(int));
+	int* l3_keys = (int*) calloc((size_t) count, sizeof(int));
+	if (topo_cpus == NULL || topo_ranks == NULL || core_ids == NULL || l3_keys == NULL) {
+		free(topo_cpus);
+		free(topo_ranks);
+		free(core_ids);
+		free(l3_keys);
+		topo_cpus = NULL;
+		return;
+	}
+
+	for (int cpu = 0; cpu < THRD_CPUSET_SIZE; ++cpu) {
+		topo_index[cpu] = -1;
+	}
+
+	/* Raw ids: package, core id within the package, lowest CPU sharing the L3 cache */
+	int i = 0;
+	for (int cpu = 0; cpu < THRD_CPUSET_SIZE; ++cpu) {
+		if (!thrd_cpuset_isset(&online, cpu)) {
+			continue;
+		}
+		topo_cpu_t* desc = &topo_cpus[i];
+		desc->cpu = cpu;
+		core_ids[i] = cpu;
+		l3_keys[i] = -1;
+		topo_index[cpu] = i++;
+
+		if (!sysfs) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), TOPO_SYSFS "/cpu/cpu%d/topology/physical_package_id", cpu);
+		if (topo_read_int(path, &desc->package) != 0 || desc->package < 0) {
+			desc->package = 0;
+		}
+		snprintf(path, sizeof(path), TOPO_SYSFS "/cpu/cpu%d/topology/core_id", cpu);
+		topo_read_int(path, &core_ids[i - 1]);
+
+		thrd_cpuset_t siblings;
+		snprintf(path, sizeof(path), TOPO_SYSFS "/cpu/cpu%d/topology/thread_siblings_list", cpu);
+		if (topo_read_list(path, &siblings) == 0) {
+			for (int sibling = 0; sibling < cpu; ++sibling) {
+				desc->smt += thrd_cpuset_isset(&siblings, sibling) && thrd_cpuset_isset(&online, sibling);
+			}
+		}
+
+		for (int index = 0; index < 16; ++index) {
+			int level;
+			snprintf(path, sizeof(path), TOPO_SYSFS "/cpu/cpu%d/cache/index%d/level", cpu, index);
+			if (topo_read_int(path, &level) != 0) {
+				break;
+			}
+			thrd_cpuset_t shared;
+			snprintf(path, sizeof(path), TOPO_SYSFS "/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+			if (level == 3 && topo_read_list(path, &shared) == 0) {
+				l3_keys[i - 1] = topo_first(&shared);
+			}
+		}
+	}
+	topo.cpu_count = count;
+
+	/* NUMA nodes: every CPU listed by a node belongs to it */
+	thrd_cpuset_t nodes;
+	if (sysfs && topo_read_list(TOPO_SYSFS "/node/online", &nodes) == 0) {
+		for (int node = 0; node < THRD_CPUSET_SIZE; ++node) {
+			thrd_cpuset_t cpus;
+			snprintf(path, sizeof(path), TOPO_SYSFS "/node/node%d/cpulist", node);
+			if (!thrd_cpuset_isset(&nodes, node) || topo_read_list(path, &cpus) != 0) {
+				continue;
+			}
+			for (int cpu = 0; cpu < THRD_CPUSET_SIZE; ++cpu) {
+				if (thrd_cpuset_isset(&cpus, cpu) && topo_index[cpu] >= 0) {
+					topo_cpus[topo_index[cpu]].node = node;
+				}
+			}
+		}
+	}
+
+	/* Dense indexes: cores are (package, core id) pairs, a CPU without L3 information has its package as domain */
+	for (i = 0; i < count; ++i) {
+		topo_cpu_t* desc = &topo_cpus[i];
+		if (l3_keys[i] < 0) {
+			l3_keys[i] = -1 - desc->package;
+		}
+		desc->core = -1;
+		desc->l3 = -1;
+		for (int j = 0; j < i; ++j) {
+			if (desc->core < 0 && topo_cpus[j].package == desc->package && core_ids[j] == core_ids[i]) {
+				desc->core = topo_cpus[j].core;
+			}
+			if (desc->l3 < 0 && l3_keys[j] == l3_keys[i]) {
+				desc->l3 = topo_cpus[j].l3;
+			}
+		}
+		if (desc->core < 0) {
+			desc->core = topo.core_count++;
+		}
+		if (desc->l3 < 0) {
+			desc->l3 = topo.l3_count++;
+		}
+		if (desc->package >= topo.package_count) {
+			topo.package_count = desc->package + 1;
+		}
+		if (desc->node >= topo.node_count) {
+			topo.node_count = desc->node + 1;
+		}
+	}
+
+	/* Ranks: dense indexes follow CPU order, the rank of a core (domain) counts the lower cores (domains) of the same domain (package) */
+	int* core_l3 = core_ids;
+	int* l3_package = l3_keys;
+	for (i = 0; i < count; ++i) {
+		core_l3[topo_cpus[i].core] = topo_cpus[i].l3;
+		l3_package[topo_cpus[i].l3] = topo_cpus[i].package;
+	}
+	for (i = 0; i < count; ++i) {
+		for (int core = 0; core < topo_cpus[i].core; ++core) {
+			topo_ranks[i].core_rank += (core_l3[core] == topo_cpus[i].l3);
+		}
+		for (int l3 = 0; l3 < topo_cpus[i].l3; ++l3) {
+			topo_ranks[i].l3_rank += (l3_package[l3] == topo_cpus[i].package);
+		}
+	}
+
+	free(core_ids);
+	free(l3_keys);
+	topo.cpus = topo_cpus;
+}
+
+
+
+#ifdef _WIN32
+static BOOL CALLBACK topo_discover_once(PINIT_ONCE once, PVOID param, PVOID* context) {
+	(void) once;
+	(void) param;
+	(void) context;
+	topo_discover();
+	return TRUE;
+}
+#endif /* _WIN32 */
+
+
+
+/**
+ * Posix:	http://man7.org/linux/man-pages/man3/pthread_once.3p.html
+ * Windows:	https://docs.microsoft.com/en-us/windows/win32/api/synchapi/nf-synchapi-initonceexecuteonce
+ */
+const topo_t* topo_get(void) {
+	#ifdef __unix__
+		pthread_once(&topo_once, topo_discover);
+	#endif /* __unix__ */
+
+	#ifdef _WIN32
+		InitOnceExecuteOnce(&topo_once, topo_discover_once, NULL, NULL);
+	#endif /* _WIN32 */
+
+	/* ERROR: Discovery could not allocate its arrays */
+	if (topo_cpus == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return &topo;
+}
+
+
+
+const topo_cpu_t* topo_cpu(int cpu) {
+	if (topo_get() == NULL || cpu < 0 || cpu >= THRD_CPUSET_SIZE || topo_index[cpu] < 0) {
+		return NULL;
+	}
+	return &topo_cpus[topo_index[cpu]];
+}
+
+
+
+int topo_cpuset(int level, int index, __OUT__ thrd_cpuset_t* cpuset) {
+	if (topo_get() == NULL) {
+		return thrd_error;
+	}
+
+	thrd_cpuset_zero(cpuset);
+	for (int i = 0; i < topo.cpu_count; ++i) {
+		const topo_cpu_t* desc = &topo_cpus[i];
+		int value;
+		switch (level) {
+			case topo_package:	value = desc->package;	break;
+			case topo_node:		value = desc->node;		break;
+			case topo_l3:		value = desc->l3;		break;
+			case topo_core:		value = desc->core;		break;
+			default:
+				/* ERROR: Unknown level */
+				errno = EINVAL;
+				return thrd_error;
+		}
+		if (value == index) {
+			thrd_cpuset_set(cpuset, desc->cpu);
+		}
+	}
+
+	/* ERROR: Unknown index */
+	if (thrd_cpuset_count(cpuset) == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+	return thrd_success;
+}
+
+
+
+/**
+ * Compact order: package, node, L3 domain, core, SMT sibling
+ */
+static int topo_compare_compact(const void* lhs, const void* rhs) {
+	const topo_cpu_t* a = &topo_cpus[*(const int*) lhs];
+	const topo_cpu_t* b = &topo_cpus[*(const int*) rhs];
+	if (a->package != b->package) {
+		return a->package - b->package;
+	}
+	if (a->node != b->node) {
+		return a->node - b->node;
+	}
+	if (a->l3 != b->l3) {
+		return a->l3 - b->l3;
+	}
+	if (a->core != b->core) {
+		return a->core - b->core;
+	}
+	return a->smt - b->smt;
+}
+
+
+
+/**
+ * Scatter order: SMT sibling, core rank in its domain, domain rank in its package, package
+ */
+static int topo_compare_scatter(const void* lhs, const void* rhs) {
+	int i = *(const int*) lhs, j = *(const int*) rhs;
+	const topo_cpu_t* a = &topo_cpus[i];
+	const topo_cpu_t* b = &topo_cpus[j];
+	if (a->smt != b->smt) {
+		return a->smt - b->smt;
+	}
+	if (topo_ranks[i].core_rank != topo_ranks[j].core_rank) {
+		return topo_ranks[i].core_rank - topo_ranks[j].core_rank;
+	}
+	if (topo_ranks[i].l3_rank != topo_ranks[j].l3_rank) {
+		return topo_ranks[i].l3_rank - topo_ranks[j].l3_rank;
+	}
+	if (a->package != b->package) {
+		return a->package - b->package;
+	}
+	return a->cpu - b->cpu;
+}
+
+
+
+int topo_place(int policy, unsigned int count, __OUT__ thrd_cpuset_t* cpusets) {
+	if (topo_get() == NULL) {
+		return thrd_error;
+	}
+
+	/* ERROR: Unknown policy */
+	if (policy != topo_compact && policy != topo_scatter && policy != topo_one_per_core) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	thrd_cpuset_t allowed;
+	topo_allowed(&allowed);
+
+	int order[THRD_CPUSET_SIZE];
+	int size = 0;
+	for (int i = 0; i < topo.cpu_count; ++i) {
+		if (thrd_cpuset_isset(&allowed, topo_cpus[i].cpu)) {
+			order[size++] = i;
+		}
+	}
+
+	/* ERROR: The process is not allowed to run on any online CPU */
+	if (size == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+	qsort(order, (size_t) size, sizeof(int), (policy == topo_scatter) ? topo_compare_scatter : topo_compare_compact);
+
+	/* One per core: only the first allowed sibling of each core is kept, the thread gets all allowed siblings */
+	if (policy == topo_one_per_core) {
+		int cores = 0;
+		for (int i = 0; i < size; ++i) {
+			if (cores == 0 || topo_cpus[order[cores - 1]].core != topo_cpus[order[i]].core) {
+				order[cores++] = order[i];
+			}
+		}
+		size = cores;
+	}
+
+	for (unsigned int thread = 0; thread < count; ++thread) {
+		const topo_cpu_t* desc = &topo_cpus[order[thread % (unsigned int) size]];
+		thrd_cpuset_zero(&cpusets[thread]);
+		if (policy == topo_one_per_core) {
+			for (int i = 0; i < topo.cpu_count; ++i) {
+				if (topo_cpus[i].core == desc->core && thrd_cpuset_isset(&allowed, topo_cpus[i].cpu)) {
+					thrd_cpuset_set(&cpusets[thread], topo_cpus[i].cpu);
+				}
+			}
+		} else {
+			thrd_cpuset_set(&cpusets[thread], desc->cpu);
+		}
+	}
+	return thrd_success;
+}
+
+
+
+int topo_pin(int policy, unsigned int count, const thrd_t* threads) {
+	thrd_cpuset_t* cpusets = (thrd_cpuset_t*) malloc((count ? count : 1) * sizeof(thrd_cpuset_t));
+
+	/* ERROR: No memory for the CPU sets */
+	if (cpusets == NULL) {
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	int value = topo_place(policy, count, cpusets);
+	for (unsigned int i = 0; value == thrd_success && i < count; ++i) {
+		value = thrd_set_affinity(threads[i], &cpusets[i]);
+	}
+
+	free(cpusets);
+	return value;
+}
+
+
+
+#ifdef __linux__
+/**
+ * Tells whether the comma-separated list holds token
+ */
+static int topo_has_token(const char* list, const char* token) {
+	size_t length = strlen(token);
+	while (*list != '\0') {
+		size_t size = strcspn(list, ",");
+		if (size == length && strncmp(list, token, length) == 0) {
+			return 1;
+		}
+		list += size + (list[size] == ',');
+	}
+	return 0;
+}
+
+
+
+/**
+ * Reads from /proc/self/cgroup the path of the cgroup of the process: the v2 one if controller is NULL,
+ * otherwise the v1 one of the hierarchy holding controller. Returns 0 if successful
+ */
+static int topo_cgroup_path(const char* controller, __OUT__ char* path, size_t size) {
+	FILE* file = fopen(TOPO_PROC "/self/cgroup", "r");
+	if (file == NULL) {
+		return -1;
+	}
+
+	/* Lines are hierarchy-ID:controller-list:cgroup-path, the v2 hierarchy is 0 with an empty list */
+	char line[1024];
+	int found = -1;
+	while (found != 0 && fgets(line, sizeof(line), file) != NULL) {
+		char* controllers = strchr(line, ':');
+		char* relative = (controllers != NULL) ? strchr(controllers + 1, ':') : NULL;
+		if (relative == NULL) {
+			continue;
+		}
+		*controllers++ = '\0';
+		*relative++ = '\0';
+		relative[strcspn(relative, "\n")] = '\0';
+
+		if ((controller == NULL) ? (strcmp(line, "0") == 0 && *controllers == '\0') : topo_has_token(controllers, controller)) {
+			snprintf(path, size, "%s", relative);
+			found = 0;
+		}
+	}
+
+	fclose(file);
+	return found;
+}
+
+
+
+/**
+ * Smallest CPU quota of the cgroups from root/relative up to root, in CPUs, 0 if none is set. A path that does not exist,
+ * as seen from a container without its own cgroup namespace, is skipped up to the root, which is then the cgroup of the container
+ */
+static double topo_cgroup_quota(const char* root, const char* relative, int version) {
+	char directory[512];
+	char path[576];
+	snprintf(directory, sizeof(directory), "%s%s", root, relative);
+
+	size_t length = strlen(root);
+	double quota = 0;
+	for (;;) {
+		double cpus = 0;
+		if (version == 2) {
+			/* cpu.max is "$MAX $PERIOD", $MAX being "max" without limit */
+			snprintf(path, sizeof(path), "%s/cpu.max", directory);
+			FILE* file = fopen(path, "r");
+			if (file != NULL) {
+				char max[32];
+				long long period;
+				if (fscanf(file, "%31s %lld", max, &period) == 2 && strcmp(max, "max") != 0 && period > 0) {
+					cpus = (double) atoll(max) / (double) period;
+				}
+				fclose(file);
+			}
+		} else {
+			/* cpu.cfs_quota_us is -1 without limit */
+			int limit, period;
+			snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", directory);
+			if (topo_read_int(path, &limit) == 0 && limit > 0) {
+				snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", directory);
+				if (topo_read_int(path, &period) == 0 && period > 0) {
+					cpus = (double) limit / (double) period;
+				}
+			}
+		}
+		if (cpus > 0 && (quota == 0 || cpus < quota)) {
+			quota = cpus;
+		}
+
+		char* slash = strrchr(directory + length, '/');
+		if (slash == NULL) {
+			break;
+		}
+		*slash = '\0';
+	}
+	return quota;
+}
+
+
+
+/**
+ * Reads the cpuset of the cgroup root/relative from file, or of the root cgroup if the path does not exist. Returns 0 if successful
+ */
+static int topo_cgroup_cpuset(const char* root, const char* relative, const char* file, __OUT__ thrd_cpuset_t* cpuset) {
+	char path[576];
+	snprintf(path, sizeof(path), "%s%s/%s", root, relative, file);
+	if (topo_read_list(path, cpuset) == 0 && thrd_cpuset_count(cpuset) > 0) {
+		return 0;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", root, file);
+	return (topo_read_list(path, cpuset) == 0 && thrd_cpuset_count(cpuset) > 0) ? 0 : -1;
+}
+#endif /* __linux__ */
+
+
+
+/**
+ * Computes the answer of thrd_hardware_concurrency
+ */
+static unsigned int topo_concurrency_read(void) {
+	thrd_cpuset_t allowed;
+	topo_allowed(&allowed);
+	int count = thrd_cpuset_count(&allowed);
+
+	#ifdef __linux__
+		char relative[256];
+		double quota = 0;
+		thrd_cpuset_t cpuset;
+		int restricted = 0;
+
+		/* cgroup v2, then the v1 hierarchies of the cpu and cpuset controllers */
+		if (topo_cgroup_path(NULL, relative, sizeof(relative)) == 0) {
+			quota = topo_cgroup_quota(TOPO_CGROUP, relative, 2);
+			restricted = (topo_cgroup_cpuset(TOPO_CGROUP, relative, "cpuset.cpus.effective", &cpuset) == 0);
+		}
+		if (quota == 0 && topo_cgroup_path("cpu", relative, sizeof(relative)) == 0) {
+			quota = topo_cgroup_quota(TOPO_CGROUP "/cpu,cpuacct", relative, 1);
+			if (quota == 0) {
+				quota = topo_cgroup_quota(TOPO_CGROUP "/cpu", relative, 1);
+			}
+		}
+		if (!restricted && topo_cgroup_path("cpuset", relative, sizeof(relative)) == 0) {
+			restricted = (topo_cgroup_cpuset(TOPO_CGROUP "/cpuset", relative, "cpuset.effective_cpus", &cpuset) == 0
+				|| topo_cgroup_cpuset(TOPO_CGROUP "/cpuset", relative, "cpuset.cpus", &cpuset) == 0);
+		}
+
+		/* The affinity mask is normally within the cpuset already, the cpuset only lowers the count if it is not */
+		if (restricted) {
+			int both = 0;
+			for (int cpu = 0; cpu < THRD_CPUSET_SIZE; ++cpu) {
+				both += thrd_cpuset_isset(&allowed, cpu) && thrd_cpuset_isset(&cpuset, cpu);
+			}
+			if (both > 0 && both < count) {
+				count = both;
+			}
+		}
+
+		/* A quota of 2.5 CPUs keeps 3 threads busy part of the time */
+		if (quota > 0) {
+			int cpus = (int) quota + ((double) (int) quota < quota);
+			if (cpus < count) {
+				count = cpus;
+			}
+		}
+	#endif /* __linux__ */
+
+	return (count > 0) ? (unsigned int) count : 1;
+}
+
+
+
+unsigned int thrd_hardware_concurrency(void) {
+	/* topo_allowed falls back to the online CPUs */
+	if (topo_get() == NULL) {
+		return 1;
+	}
+
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	long long time = now.tv_sec * 1000000000LL + now.tv_nsec;
+	long long at = atomic_load_explicit(&topo_concurrency_at, memory_order_acquire);
+	if (at != LLONG_MIN && time >= at && time - at < THRD_CONCURRENCY_REFRESH) {
+		return atomic_load_explicit(&topo_concurrency, memory_order_relaxed);
+	}
+
+	unsigned int count = topo_concurrency_read();
+	atomic_store_explicit(&topo_concurrency, count, memory_order_relaxed);
+	atomic_store_explicit(&topo_concurrency_at, time, memory_order_release);
+	return count;
+}
@@ -0,0 +1,155 @@
+﻿#ifndef C11_THREADS_TOPOLOGY_HEADER
+#define C11_THREADS_TOPOLOGY_HEADER
+
+#include "threads.h"
+
+
+
+/**
+ * CPU topology, discovered once from /sys/devices/system/cpu and /sys/devices/system/node under Linux.
+ * Other systems are described as one package, one NUMA node and one L3 domain where every CPU is its own core.
+ * The number of CPUs the process can actually use also accounts for the cgroup CPU quota and cpuset under Linux, see thrd_hardware_concurrency.
+ */
+
+
+
+/**
+ * Topology level enum, used by topo_cpuset
+ *
+ * topo_package		physical package (socket), index is physical_package_id
+ * topo_node		NUMA node, index is the node id
+ * topo_l3			CPUs sharing a last level cache, index is dense from 0
+ * topo_core		SMT siblings of a physical core, index is dense from 0
+ */
+enum {
+	topo_package,
+	topo_node,
+	topo_l3,
+	topo_core
+};
+
+
+
+/**
+ * Placement policy enum, used by topo_place and topo_pin
+ *
+ * topo_compact		threads are packed on neighbour CPUs: SMT siblings, then cores of the same L3 domain, then the next domain
+ * topo_scatter		threads are spread over packages and L3 domains first, SMT siblings are only used once every core has a thread
+ * topo_one_per_core	each thread gets all the SMT siblings of its own core, cores are taken in compact order
+ */
+enum {
+	topo_compact,
+	topo_scatter,
+	topo_one_per_core
+};
+
+
+
+/**
+ * Description of one online CPU
+ *
+ * cpu				index of the CPU, as used by thrd_cpuset_t
+ * package			physical package id
+ * node				NUMA node id, 0 without NUMA
+ * l3				index of the L3 domain
+ * core				index of the physical core
+ * smt				rank of the CPU among the SMT siblings of its core, 0 for the first one
+ */
+typedef struct {
+	int cpu;
+	int package;
+	int node;
+	int l3;
+	int core;
+	int smt;
+} topo_cpu_t;
+
+
+
+/**
+ * Topology of the machine, cpus is sorted by CPU index. The counts are highest index + 1 for package and node ids.
+ */
+typedef struct {
+	int cpu_count;
+	int package_count;
+	int node_count;
+	int l3_count;
+	int core_count;
+	const topo_cpu_t* cpus;
+} topo_t;
+
+
+
+/**
+ * Returns the topology of the machine, discovered on the first call. The returned object is never released.
+ *
+ * @return				pointer to the topology, NULL if there was insufficient amount of memory
+ */
+const topo_t* topo_get(void);
+
+
+
+/**
+ * Returns the description of cpu.
+ *
+ * @param cpu			index of the CPU
+ * @return				pointer to the description, NULL if cpu is not online
+ */
+const topo_cpu_t* topo_cpu(int cpu);
+
+
+
+/**
+ * Fills cpuset with the online CPUs of a package, NUMA node, L3 domain or core.
+ *
+ * @param level			topo_package, topo_node, topo_l3 or topo_core
+ * @param index			index of the package, node, domain or core
+ * @param cpuset		pointer to the CPU set to fill
+ * @return				thrd_success if successful, thrd_error if level or index is unknown.
+ */
+int topo_cpuset(int level, int index, __OUT__ thrd_cpuset_t* cpuset);
+
+
+
+/**
+ * Computes the CPU sets of count threads placed with policy, among the CPUs the process is allowed to run on.
+ * When there are more threads than CPUs (or cores), placement wraps around.
+ *
+ * @param policy		topo_compact, topo_scatter or topo_one_per_core
+ * @param count			number of threads
+ * @param cpusets		array of count CPU sets to fill, cpusets[i] is for the thread i
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int topo_place(int policy, unsigned int count, __OUT__ thrd_cpuset_t* cpusets);
+
+
+
+/**
+ * Pins count existing threads with policy, see topo_place.
+ *
+ * @param policy		topo_compact, topo_scatter or topo_one_per_core
+ * @param count			number of threads
+ * @param threads		array of count threads, threads[i] is placed as the thread i
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int topo_pin(int policy, unsigned int count, const thrd_t* threads);
+
+
+
+/**
+ * THRD_CONCURRENCY_REFRESH is the time in nanoseconds thrd_hardware_concurrency keeps its answer before reading the limits again
+ */
+#define THRD_CONCURRENCY_REFRESH 1000000000LL
+
+
+
+/**
+ * Returns the number of CPUs the process can keep busy: the CPUs of its affinity mask, restricted to the cpuset of its cgroup
+ * and capped by the CPU quota of its cgroup and of the cgroups above it (cgroup v2 cpu.max, or v1 cpu.cfs_quota_us), rounded up.
+ * The limits are read again after THRD_CONCURRENCY_REFRESH, so that a quota changed while the process runs is seen. Default pool sizes use it.
+ *
+ * @return				number of usable CPUs, at least 1
+ */
+unsigned int thrd_hardware_concurrency(void);
+
+#endif /* C11_THREADS_TOPOLOGY_HEADER */
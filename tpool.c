@@ -0,0 +1,2221 @@
+﻿/**
+	Thread pool for the Cross Platform C11 Native Threads library
+
+	Bounded MPMC queue:
+		http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+	Work-stealing deque:
+		https://www.dre.vanderbilt.edu/~schmidt/PDF/work-stealing-dequeue.pdf
+		https://fzn.fr/readings/ppopp13.pdf
+*/
+#include "tpool.h"
+#include "futex.h"
+#include "topology.h"
+
+#ifdef __linux__
+	#include <sched.h>			/* For sched_getcpu() */
+#endif /* __linux__ */
+
+#include <errno.h>  /* For errno */
+#include <limits.h> /* For INT_MAX, LLONG_MAX */
+#include <stddef.h> /* For max_align_t, offsetof() */
+#include <stdint.h> /* For intptr_t, uintptr_t */
+#include <stdlib.h> /* For malloc(), free() */
+#include <string.h> /* For memset() */
+
+/* Size of a cache line, fields written by different threads are kept on different lines */
+#define TPOOL_CACHE_LINE 64
+
+/* Number of looks for a task an idle worker spins for before parking, each one is preceded by a thrd_relax */
+#define TPOOL_SPINS 256
+
+/* Initial size of the array of a work-stealing deque, a power of two. The array doubles when it is full */
+#define TPOOL_DEQUE_SIZE 256
+
+/* Number of tasks the mailbox of a worker can hold, a power of two */
+#define TPOOL_MAILBOX_SIZE 64
+
+/* Bit of the pending word of a task group, set while a thread sleeps on the word */
+#define TPOOL_GROUP_WAITING (1 << 30)
+
+/* Initial number of tasks of a priority queue, the array doubles when it is full */
+#define TPOOL_HEAP_SIZE 64
+
+/* Deadline of the tasks without one */
+#define TPOOL_NO_DEADLINE LLONG_MAX
+
+/* Number of task descriptor blocks a cache allocates at once when its lists are empty */
+#define TPOOL_SLAB_BLOCKS 64
+
+/* Number of blocks of another worker a worker frees before it returns them, with a single CAS */
+#define TPOOL_TASK_BATCH 32
+
+
+
+/**
+ * Worker state enum, the state of a slot of the array of workers. An elastic pool starts and retires workers in their slots,
+ * a pool with spare workers starts them in the slots after its workers
+ *
+ * tpool_worker_dead		no thread runs in the slot
+ * tpool_worker_alive		a thread runs in the slot
+ * tpool_worker_starting	a thread is being created for the slot
+ * tpool_worker_joining		the pool is stopping and joins the thread of the slot, it cannot retire any more
+ * tpool_worker_exiting		the thread of the slot has retired and is handing the slot back, the slot is not reused and the pool not released meanwhile
+ */
+enum {
+	tpool_worker_dead,
+	tpool_worker_alive,
+	tpool_worker_starting,
+	tpool_worker_joining,
+	tpool_worker_exiting
+};
+
+
+
+/**
+ * Cell of a bounded queue, sequence tells whether the cell is ready to be written (position) or read (position + 1)
+ * enqueued is the submission time of the task in an elastic pool, read without owning the cell to measure how long the oldest task has waited
+ */
+struct tpool_cell {
+	atomic_size_t sequence;
+	tpool_func_t func;
+	void* arg;
+	_Atomic(long long) enqueued;
+};
+
+
+
+/**
+ * Bounded MPMC queue, used for the submission queues of the pool and for the mailboxes of the workers
+ *
+ * tail			next position to write, shared by the producers
+ * head			next position to read, shared by the consumers
+ */
+struct tpool_queue {
+	struct tpool_cell* cells;
+	size_t mask;
+	char pad0[TPOOL_CACHE_LINE - sizeof(struct tpool_cell*) - sizeof(size_t)];
+
+	atomic_size_t tail;
+	char pad1[TPOOL_CACHE_LINE - sizeof(atomic_size_t)];
+
+	atomic_size_t head;
+	char pad2[TPOOL_CACHE_LINE - sizeof(atomic_size_t)];
+};
+
+
+
+/**
+ * Slot of a work-stealing deque. A thief may read a slot the owner is overwriting, its CAS on top then fails:
+ * the fields are atomics read and written relaxed, so such a torn read is harmless
+ */
+struct tpool_slot {
+	_Atomic(tpool_func_t) func;
+	_Atomic(void*) arg;
+};
+
+
+
+/**
+ * Circular array of a deque, size is a power of two. Replaced arrays are kept in the previous list until the pool is destroyed,
+ * a thief may still be reading them
+ */
+struct tpool_buffer {
+	ptrdiff_t size;
+	struct tpool_buffer* previous;
+	struct tpool_slot slots[];
+};
+
+
+
+/**
+ * Task of a priority queue, ordered by key, then by priority, then by submission
+ *
+ * key			virtual deadline of the task in nanoseconds, depends on the order of the pool
+ * deadline		deadline of the task in TIME_UTC nanoseconds, TPOOL_NO_DEADLINE if there is none
+ * enqueued		submission time of the task in TIME_UTC nanoseconds
+ */
+struct tpool_entry {
+	long long key;
+	long long deadline;
+	long long enqueued;
+	unsigned long long sequence;
+	int priority;
+	tpool_func_t func;
+	void* arg;
+};
+
+
+
+/**
+ * Priority queue of a worker, a binary heap protected by a spin lock. Any worker may take its first task
+ *
+ * size			number of tasks, read without the lock
+ * top			key of the first task, read without the lock to choose between the queues
+ */
+struct tpool_heap {
+	atomic_flag lock;
+	atomic_size_t size;
+	_Atomic(long long) top;
+	unsigned long long sequence;
+	size_t capacity;
+	struct tpool_entry* entries;
+};
+
+
+
+/**
+ * Task descriptor block of tpool_task_alloc, a cache line with its header on common targets
+ *
+ * cache		cache the block comes back to, NULL for a descriptor larger than TPOOL_TASK_SIZE allocated on its own
+ * next			next block of a free list, of a return list or of a batch
+ * data			memory of the descriptor
+ */
+struct tpool_block {
+	struct tpool_cache* cache;
+	struct tpool_block* next;
+	union {
+		max_align_t align;
+		unsigned char bytes[TPOOL_TASK_SIZE];
+	} data;
+};
+
+
+
+/**
+ * Slab of TPOOL_SLAB_BLOCKS blocks aligned on a cache line after its header, released with the pool
+ */
+struct tpool_slab {
+	struct tpool_slab* next;
+};
+
+
+
+/**
+ * Task descriptor cache, one per worker and one shared by the threads outside the pool
+ *
+ * free			free blocks, only used by the worker, or under lock by the threads outside the pool
+ * slabs		slabs allocated by the cache
+ * returned		blocks freed by other threads, a lock-free stack the owner empties at once when free runs out
+ */
+struct tpool_cache {
+	struct tpool_block* free;
+	struct tpool_slab* slabs;
+	struct tpool* pool;
+	atomic_flag lock;
+	char pad0[TPOOL_CACHE_LINE];
+
+	_Atomic(struct tpool_block*) returned;
+	char pad1[TPOOL_CACHE_LINE - sizeof(struct tpool_block*)];
+};
+
+
+
+/**
+ * Worker of a pool, owning a Chase-Lev deque: the worker pushes and pops at bottom, thieves steal at top
+ *
+ * top			next position to steal, written by the thieves
+ * bottom		next position to push, only written by the owner
+ * spawned		number of tasks pushed to the deque, only written by the owner
+ * completed	number of tasks run by the worker, only written by the owner
+ * domain		index of the submission queue of the worker, the rank of its NUMA node among the nodes of the pool, 0 without NUMA mode
+ * node			NUMA node id of the worker in NUMA mode
+ * l3			L3 domain of the worker in NUMA mode
+ * victims		indices of the other workers in NUMA mode, the workers of the same L3 domain and node up to near,
+ *				then of the same node up to local, then of the other nodes up to far. NULL without NUMA mode, every worker is then a victim up to far
+ * cpuset		CPUs the worker is pinned to in NUMA mode, the allowed CPUs of its L3 domain within its node
+ * blocking		nesting depth of the blocking regions of the task running on the worker, only the outermost one counts, only used by the owner
+ * deadline		deadline of the task about to run, set when it is taken from a priority queue
+ * prioritized	statistics of the tasks taken from a priority queue, only written by the owner, see tpool_stats_t
+ * parked		futex word of the worker, 1 while it is parked or about to park, set back to 0 by whoever wakes it up
+ * state		state of the slot of the worker, see tpool_worker_dead
+ * seed			state of the random victim selection
+ * mailbox		tasks submitted to this worker by tpool_submit_to, only the worker takes them
+ * heap			tasks submitted to this worker by tpool_submit_prio, taken by any worker
+ * cache		task descriptors allocated by the worker
+ * batch		blocks of another cache freed by the worker, returned to it together, up to TPOOL_TASK_BATCH of them. Only used by the owner
+ */
+struct tpool_worker {
+	_Atomic(ptrdiff_t) top;
+	char pad0[TPOOL_CACHE_LINE - sizeof(ptrdiff_t)];
+
+	_Atomic(ptrdiff_t) bottom;
+	_Atomic(struct tpool_buffer*) buffer;
+	atomic_size_t spawned;
+	atomic_size_t completed;
+	struct tpool* pool;
+	unsigned int index;
+	unsigned int seed;
+	unsigned int domain;
+	int node;
+	int l3;
+	const unsigned int* victims;
+	unsigned int near;
+	unsigned int local;
+	unsigned int far;
+	thrd_cpuset_t cpuset;
+	thrd_t thread;
+	unsigned int blocking;
+	long long deadline;
+	atomic_ullong prioritized;
+	atomic_ullong deadlines;
+	atomic_ullong misses;
+	atomic_ullong late;
+	atomic_ullong aged;
+	atomic_ullong waited;
+	atomic_ullong waited_max;
+	char pad1[TPOOL_CACHE_LINE];
+
+	atomic_int parked;
+	atomic_int state;
+	char pad2[TPOOL_CACHE_LINE - 2 * sizeof(atomic_int)];
+
+	struct tpool_queue mailbox;
+
+	struct tpool_heap heap;
+	char pad3[TPOOL_CACHE_LINE];
+
+	struct tpool_cache cache;
+	struct tpool_block* batch;
+	struct tpool_block* batch_last;
+	unsigned int batched;
+};
+
+
+
+/**
+ * Pool, tpool_t points to it
+ *
+ * count		number of slots, the workers and the spare workers: the array of workers is allocated once with every slot
+ * size			number of workers, the maximum of an elastic pool
+ * spare		number of spare workers started in place of the workers blocked in a blocking region
+ * thread		attributes the workers are started with, the node and the CPUs of the worker are added in NUMA mode
+ * live			number of running workers
+ * blocked		number of running workers inside a blocking region, see tpool_begin_blocking
+ * spawned_at	last time a worker was started, in TIME_UTC nanoseconds
+ * order		order of the priority queues, see tpool_order_priority
+ * aging		aging of the priority queues in nanoseconds
+ * domains		number of submission queues, one per NUMA node of the workers in NUMA mode, 1 otherwise
+ * nodes		NUMA node id of each submission queue
+ * victims		arrays of victims of the workers, see tpool_worker
+ * queues		submission queues of the tasks submitted from outside the pool
+ * cache		task descriptors allocated by the threads outside the pool
+ * queued		number of tasks in the priority queues, they are not looked at while it is 0
+ * turn			next priority queue a task submitted from outside the pool goes to
+ * spinning		number of workers polling for tasks, a submission does not wake anyone while it is not 0
+ * sleepers		number of workers parked, or about to park
+ * submitted	number of tasks submitted to the queue or to a mailbox
+ * idle			futex word of tpool_wait, bumped when a worker runs out of tasks while waiters is not 0
+ * waiters		number of threads blocked in tpool_wait
+ */
+struct tpool {
+	unsigned int count;
+	unsigned int size;
+	unsigned int spare;
+	struct tpool_worker* workers;
+	atomic_int stop;
+	int order;
+	long long aging;
+	int elastic;
+	unsigned int minimum;
+	long long keepalive;
+	long long threshold;
+	thrd_attr_t thread;
+	int numa;
+	unsigned int domains;
+	int* nodes;
+	unsigned int* victims;
+	struct tpool_queue* queues;
+	char pad0[TPOOL_CACHE_LINE];
+
+	struct tpool_cache cache;
+
+	atomic_uint live;
+	atomic_uint blocked;
+	_Atomic(long long) spawned_at;
+	char pad4[TPOOL_CACHE_LINE];
+
+	atomic_size_t queued;
+	atomic_uint turn;
+	char pad3[TPOOL_CACHE_LINE];
+
+	atomic_int spinning;
+	atomic_int sleepers;
+	char pad1[TPOOL_CACHE_LINE - 2 * sizeof(atomic_int)];
+
+	atomic_size_t submitted;
+	atomic_int idle;
+	atomic_int waiters;
+	char pad2[TPOOL_CACHE_LINE];
+};
+
+
+
+/**
+ * Task spawned in a group, allocated by tpool_group_spawn from the descriptor caches and released by the worker before it runs the function
+ */
+struct tpool_group_task {
+	tpool_group_t* group;
+	tpool_func_t func;
+	void* arg;
+};
+
+
+
+/* Worker of the calling thread, NULL if it is not a worker */
+static _Thread_local struct tpool_worker* tpool_self = NULL;
+
+/* Pool returned by tpool_shared, created by its first call and never destroyed */
+static struct tpool* tpool_shared_pool = NULL;
+
+#ifdef __unix__
+	static pthread_once_t tpool_shared_once = PTHREAD_ONCE_INIT;
+#endif /* __unix__ */
+
+#ifdef _WIN32
+	static INIT_ONCE tpool_shared_once = INIT_ONCE_STATIC_INIT;
+#endif /* _WIN32 */
+
+
+
+/**
+ * Allocates the cells of a queue, size is a power of two. Returns 0 if there is insufficient amount of memory
+ */
+static int tpool_queue_init(struct tpool_queue* queue, size_t size) {
+	queue->cells = (struct tpool_cell*) malloc(size * sizeof(struct tpool_cell));
+	if (queue->cells == NULL) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < size; ++i) {
+		atomic_init(&queue->cells[i].sequence, i);
+	}
+	queue->mask = size - 1;
+	return 1;
+}
+
+
+
+/**
+ * Writes a task in a queue, enqueued being its submission time or 0. Returns 0 if the queue is full
+ */
+static int tpool_queue_push(struct tpool_queue* queue, tpool_func_t func, void* arg, long long enqueued) {
+	size_t position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	for (;;) {
+		struct tpool_cell* cell = &queue->cells[position & queue->mask];
+		size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+
+		if (difference == 0) {
+			if (atomic_compare_exchange_weak_explicit(&queue->tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+				cell->func = func;
+				cell->arg = arg;
+				atomic_store_explicit(&cell->enqueued, enqueued, memory_order_relaxed);
+				atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+				return 1;
+			}
+		} else if (difference < 0) {
+			/* The cell still holds the task of the previous lap */
+			return 0;
+		} else {
+			position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+		}
+	}
+}
+
+
+
+/**
+ * Reads a task from a queue, returns 0 if the queue is empty
+ */
+static int tpool_queue_pop(struct tpool_queue* queue, __OUT__ tpool_func_t* func, __OUT__ void** arg) {
+	size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	for (;;) {
+		struct tpool_cell* cell = &queue->cells[position & queue->mask];
+		size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t difference = (intptr_t) sequence - (intptr_t) (position + 1);
+
+		if (difference == 0) {
+			if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+				*func = cell->func;
+				*arg = cell->arg;
+				atomic_store_explicit(&cell->sequence, position + queue->mask + 1, memory_order_release);
+				return 1;
+			}
+		} else if (difference < 0) {
+			/* The cell has not been written in this lap yet */
+			return 0;
+		} else {
+			position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+		}
+	}
+}
+
+
+
+/**
+ * Submission time of the oldest task of a queue, LLONG_MAX if it is empty. The cell may be reused meanwhile, the answer is only a hint
+ */
+static long long tpool_queue_oldest(struct tpool_queue* queue) {
+	size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	struct tpool_cell* cell = &queue->cells[position & queue->mask];
+	if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != position + 1) {
+		return LLONG_MAX;
+	}
+	return atomic_load_explicit(&cell->enqueued, memory_order_relaxed);
+}
+
+
+
+static struct tpool_buffer* tpool_buffer_alloc(ptrdiff_t size) {
+	struct tpool_buffer* buffer = (struct tpool_buffer*) malloc(sizeof(struct tpool_buffer) + (size_t) size * sizeof(struct tpool_slot));
+	if (buffer != NULL) {
+		buffer->size = size;
+		buffer->previous = NULL;
+	}
+	return buffer;
+}
+
+
+
+/**
+ * Doubles the array of the deque of the calling worker, returns NULL if there is insufficient amount of memory
+ */
+static struct tpool_buffer* tpool_deque_grow(struct tpool_worker* self, struct tpool_buffer* buffer, ptrdiff_t top, ptrdiff_t bottom) {
+	struct tpool_buffer* grown = tpool_buffer_alloc(buffer->size * 2);
+	if (grown == NULL) {
+		return NULL;
+	}
+
+	for (ptrdiff_t i = top; i < bottom; ++i) {
+		struct tpool_slot* from = &buffer->slots[i & (buffer->size - 1)];
+		struct tpool_slot* to = &grown->slots[i & (grown->size - 1)];
+		atomic_store_explicit(&to->func, atomic_load_explicit(&from->func, memory_order_relaxed), memory_order_relaxed);
+		atomic_store_explicit(&to->arg, atomic_load_explicit(&from->arg, memory_order_relaxed), memory_order_relaxed);
+	}
+	grown->previous = buffer;
+	atomic_store_explicit(&self->buffer, grown, memory_order_release);
+	return grown;
+}
+
+
+
+/**
+ * Pushes a task at the bottom of the deque of the calling worker, returns 0 if the deque could not grow
+ * There is no read-modify-write: the slot and bottom are plain stores, the release store of bottom publishes the slot to the thieves
+ *
+ * C11 Chase-Lev deque: https://fzn.fr/readings/ppopp13.pdf
+ */
+static int tpool_deque_push(struct tpool_worker* self, tpool_func_t func, void* arg) {
+	ptrdiff_t bottom = atomic_load_explicit(&self->bottom, memory_order_relaxed);
+	ptrdiff_t top = atomic_load_explicit(&self->top, memory_order_acquire);
+	struct tpool_buffer* buffer = atomic_load_explicit(&self->buffer, memory_order_relaxed);
+
+	if (bottom - top > buffer->size - 1) {
+		buffer = tpool_deque_grow(self, buffer, top, bottom);
+		if (buffer == NULL) {
+			return 0;
+		}
+	}
+
+	struct tpool_slot* slot = &buffer->slots[bottom & (buffer->size - 1)];
+	atomic_store_explicit(&slot->func, func, memory_order_relaxed);
+	atomic_store_explicit(&slot->arg, arg, memory_order_relaxed);
+	atomic_store_explicit(&self->bottom, bottom + 1, memory_order_release);
+	return 1;
+}
+
+
+
+/**
+ * Pops the most recently pushed task of the deque of the calling worker, returns 0 if the deque is empty
+ * Only the last task is raced for with the thieves, with a CAS on top
+ */
+static int tpool_deque_pop(struct tpool_worker* self, __OUT__ tpool_func_t* func, __OUT__ void** arg) {
+	ptrdiff_t bottom = atomic_load_explicit(&self->bottom, memory_order_relaxed) - 1;
+	struct tpool_buffer* buffer = atomic_load_explicit(&self->buffer, memory_order_relaxed);
+	atomic_store_explicit(&self->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	ptrdiff_t top = atomic_load_explicit(&self->top, memory_order_relaxed);
+
+	if (top > bottom) {
+		atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+		return 0;
+	}
+
+	struct tpool_slot* slot = &buffer->slots[bottom & (buffer->size - 1)];
+	*func = atomic_load_explicit(&slot->func, memory_order_relaxed);
+	*arg = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+
+	int found = 1;
+	if (top == bottom) {
+		found = atomic_compare_exchange_strong_explicit(&self->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+		atomic_store_explicit(&self->bottom, bottom + 1, memory_order_relaxed);
+	}
+	return found;
+}
+
+
+
+/**
+ * Steals the oldest task of the deque of victim, returns 1 if a task has been stolen, 0 if the deque is empty, -1 if another thread won the race
+ */
+static int tpool_deque_steal(struct tpool_worker* victim, __OUT__ tpool_func_t* func, __OUT__ void** arg) {
+	ptrdiff_t top = atomic_load_explicit(&victim->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	ptrdiff_t bottom = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+
+	if (top >= bottom) {
+		return 0;
+	}
+
+	struct tpool_buffer* buffer = atomic_load_explicit(&victim->buffer, memory_order_acquire);
+	struct tpool_slot* slot = &buffer->slots[top & (buffer->size - 1)];
+	*func = atomic_load_explicit(&slot->func, memory_order_relaxed);
+	*arg = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+
+	if (!atomic_compare_exchange_strong_explicit(&victim->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+		return -1;
+	}
+	return 1;
+}
+
+
+
+/**
+ * Current TIME_UTC time in nanoseconds, the clock of the deadlines
+ */
+static long long tpool_clock(void) {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+/**
+ * Tells whether entry a is taken before entry b
+ */
+static int tpool_entry_before(const struct tpool_entry* a, const struct tpool_entry* b) {
+	if (a->key != b->key) {
+		return a->key < b->key;
+	} else if (a->priority != b->priority) {
+		return a->priority > b->priority;
+	}
+	return a->sequence < b->sequence;
+}
+
+
+
+static void tpool_heap_lock(struct tpool_heap* heap) {
+	while (atomic_flag_test_and_set_explicit(&heap->lock, memory_order_acquire)) {
+		thrd_relax();
+	}
+}
+
+
+
+static void tpool_heap_unlock(struct tpool_heap* heap) {
+	atomic_flag_clear_explicit(&heap->lock, memory_order_release);
+}
+
+
+
+/**
+ * Inserts entry in a heap whose lock is held, returns 0 if the heap could not grow
+ */
+static int tpool_heap_push(struct tpool_heap* heap, struct tpool_entry* entry) {
+	size_t size = atomic_load_explicit(&heap->size, memory_order_relaxed);
+	if (size == heap->capacity) {
+		size_t capacity = (heap->capacity != 0) ? heap->capacity * 2 : TPOOL_HEAP_SIZE;
+		struct tpool_entry* entries = (struct tpool_entry*) realloc(heap->entries, capacity * sizeof(struct tpool_entry));
+		if (entries == NULL) {
+			return 0;
+		}
+		heap->entries = entries;
+		heap->capacity = capacity;
+	}
+
+	entry->sequence = heap->sequence++;
+	size_t index = size;
+	while (index > 0 && tpool_entry_before(entry, &heap->entries[(index - 1) / 2])) {
+		heap->entries[index] = heap->entries[(index - 1) / 2];
+		index = (index - 1) / 2;
+	}
+	heap->entries[index] = *entry;
+
+	atomic_store_explicit(&heap->top, heap->entries[0].key, memory_order_relaxed);
+	atomic_store_explicit(&heap->size, size + 1, memory_order_relaxed);
+	return 1;
+}
+
+
+
+/**
+ * Removes the first entry of a heap whose lock is held, returns 0 if the heap is empty
+ */
+static int tpool_heap_pop(struct tpool_heap* heap, __OUT__ struct tpool_entry* entry) {
+	size_t size = atomic_load_explicit(&heap->size, memory_order_relaxed);
+	if (size == 0) {
+		return 0;
+	}
+
+	*entry = heap->entries[0];
+	struct tpool_entry* last = &heap->entries[--size];
+	size_t index = 0;
+	for (;;) {
+		size_t child = 2 * index + 1;
+		if (child >= size) {
+			break;
+		}
+		if (child + 1 < size && tpool_entry_before(&heap->entries[child + 1], &heap->entries[child])) {
+			++child;
+		}
+		if (!tpool_entry_before(&heap->entries[child], last)) {
+			break;
+		}
+		heap->entries[index] = heap->entries[child];
+		index = child;
+	}
+	heap->entries[index] = *last;
+
+	atomic_store_explicit(&heap->top, (size != 0) ? heap->entries[0].key : TPOOL_NO_DEADLINE, memory_order_relaxed);
+	atomic_store_explicit(&heap->size, size, memory_order_relaxed);
+	return 1;
+}
+
+
+
+/**
+ * Takes the prioritized task with the best key over the queues of all the workers, the one of the calling worker wins ties.
+ * The deadline of the task is kept for tpool_run, the statistics of its start are recorded
+ */
+static int tpool_heap_take(struct tpool_worker* self, __OUT__ tpool_func_t* func, __OUT__ void** arg) {
+	struct tpool* pool = self->pool;
+	while (atomic_load_explicit(&pool->queued, memory_order_acquire) != 0) {
+		struct tpool_worker* best = NULL;
+		long long key = TPOOL_NO_DEADLINE;
+		for (unsigned int i = 0; i < pool->count; ++i) {
+			struct tpool_worker* worker = &pool->workers[(self->index + i) % pool->count];
+			long long top = atomic_load_explicit(&worker->heap.top, memory_order_relaxed);
+			if (atomic_load_explicit(&worker->heap.size, memory_order_relaxed) != 0 && (best == NULL || top < key)) {
+				best = worker;
+				key = top;
+			}
+		}
+		if (best == NULL) {
+			return 0;
+		}
+
+		struct tpool_entry entry;
+		tpool_heap_lock(&best->heap);
+		int found = tpool_heap_pop(&best->heap, &entry);
+		int aged = found && atomic_load_explicit(&best->heap.size, memory_order_relaxed) != 0 && best->heap.entries[0].priority > entry.priority;
+		tpool_heap_unlock(&best->heap);
+
+		/* Another worker took it first, the queues are looked at again */
+		if (!found) {
+			continue;
+		}
+		atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+
+		long long now = tpool_clock();
+		unsigned long long waited = (now > entry.enqueued) ? (unsigned long long) (now - entry.enqueued) : 0;
+		atomic_store_explicit(&self->prioritized, atomic_load_explicit(&self->prioritized, memory_order_relaxed) + 1, memory_order_relaxed);
+		atomic_store_explicit(&self->waited, atomic_load_explicit(&self->waited, memory_order_relaxed) + waited, memory_order_relaxed);
+		if (waited > atomic_load_explicit(&self->waited_max, memory_order_relaxed)) {
+			atomic_store_explicit(&self->waited_max, waited, memory_order_relaxed);
+		}
+		if (aged) {
+			atomic_store_explicit(&self->aged, atomic_load_explicit(&self->aged, memory_order_relaxed) + 1, memory_order_relaxed);
+		}
+		if (entry.deadline != TPOOL_NO_DEADLINE) {
+			atomic_store_explicit(&self->deadlines, atomic_load_explicit(&self->deadlines, memory_order_relaxed) + 1, memory_order_relaxed);
+			if (now > entry.deadline) {
+				atomic_store_explicit(&self->late, atomic_load_explicit(&self->late, memory_order_relaxed) + 1, memory_order_relaxed);
+			}
+		}
+
+		self->deadline = entry.deadline;
+		*func = entry.func;
+		*arg = entry.arg;
+		return 1;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Initializes an empty task descriptor cache
+ */
+static void tpool_cache_init(struct tpool_cache* cache, struct tpool* pool) {
+	cache->free = NULL;
+	cache->slabs = NULL;
+	cache->pool = pool;
+	atomic_flag_clear(&cache->lock);
+	atomic_init(&cache->returned, NULL);
+}
+
+
+
+/**
+ * Takes a block from a cache, used by its owner only: its free list, then the blocks returned by the other threads, then a new slab.
+ * Returns NULL if there is insufficient amount of memory
+ */
+static struct tpool_block* tpool_cache_pop(struct tpool_cache* cache) {
+	struct tpool_block* block = cache->free;
+	if (block == NULL) {
+		block = atomic_exchange_explicit(&cache->returned, NULL, memory_order_acquire);
+	}
+
+	if (block == NULL) {
+		struct tpool_slab* slab = (struct tpool_slab*) malloc(sizeof(struct tpool_slab) + TPOOL_SLAB_BLOCKS * sizeof(struct tpool_block) + TPOOL_CACHE_LINE - 1);
+		if (slab == NULL) {
+			return NULL;
+		}
+		slab->next = cache->slabs;
+		cache->slabs = slab;
+
+		struct tpool_block* blocks = (struct tpool_block*) (((uintptr_t) (slab + 1) + TPOOL_CACHE_LINE - 1) & ~(uintptr_t) (TPOOL_CACHE_LINE - 1));
+		for (int i = 0; i < TPOOL_SLAB_BLOCKS; ++i) {
+			blocks[i].cache = cache;
+			blocks[i].next = (i < TPOOL_SLAB_BLOCKS - 1) ? &blocks[i + 1] : NULL;
+		}
+		block = blocks;
+	}
+
+	cache->free = block->next;
+	return block;
+}
+
+
+
+/**
+ * Returns the chain of blocks from first to last to the cache they come from, from any thread
+ */
+static void tpool_cache_return(struct tpool_cache* cache, struct tpool_block* first, struct tpool_block* last) {
+	struct tpool_block* head = atomic_load_explicit(&cache->returned, memory_order_relaxed);
+	do {
+		last->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&cache->returned, &head, first, memory_order_release, memory_order_relaxed));
+}
+
+
+
+/**
+ * Returns the blocks batched by a worker to their cache
+ */
+static void tpool_cache_flush(struct tpool_worker* self) {
+	if (self->batch != NULL) {
+		tpool_cache_return(self->batch->cache, self->batch, self->batch_last);
+		self->batch = NULL;
+		self->batched = 0;
+	}
+}
+
+
+
+/**
+ * Releases the slabs of a cache
+ */
+static void tpool_cache_free(struct tpool_cache* cache) {
+	struct tpool_slab* slab = cache->slabs;
+	while (slab != NULL) {
+		struct tpool_slab* next = slab->next;
+		free(slab);
+		slab = next;
+	}
+}
+
+
+
+/**
+ * Wakes worker up if it is parked, returns 0 if it was not. Only the thread whose CAS succeeds issues the system call
+ */
+static int tpool_wake(struct tpool_worker* worker) {
+	int parked = 1;
+	if (atomic_load_explicit(&worker->parked, memory_order_relaxed) == 1
+		&& atomic_compare_exchange_strong_explicit(&worker->parked, &parked, 0, memory_order_acq_rel, memory_order_relaxed)) {
+		futex_wake(&worker->parked, 1);
+		return 1;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Wakes one parked worker up, if there is one, preferably of domain. Workers are scanned from the first one so that the same few stay warm under a light load
+ */
+static void tpool_notify(struct tpool* pool, unsigned int domain) {
+	if (atomic_load_explicit(&pool->sleepers, memory_order_relaxed) == 0) {
+		return;
+	}
+	for (int pass = 0; pass < ((pool->domains > 1) ? 2 : 1); ++pass) {
+		for (unsigned int i = 0; i < pool->count; ++i) {
+			if ((pool->workers[i].domain == domain) == (pass == 0) && tpool_wake(&pool->workers[i])) {
+				return;
+			}
+		}
+	}
+}
+
+
+
+/**
+ * Wakes the threads blocked in tpool_wait so that they count the tasks again, called when a worker runs out of tasks
+ */
+static void tpool_wake_waiters(struct tpool* pool) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&pool->waiters, memory_order_relaxed) != 0) {
+		atomic_fetch_add_explicit(&pool->idle, 1, memory_order_release);
+		futex_wake(&pool->idle, INT_MAX);
+	}
+}
+
+
+
+/**
+ * Returns a random index below bound for the calling worker, xorshift32
+ */
+static unsigned int tpool_victim(struct tpool_worker* self, unsigned int bound) {
+	unsigned int seed = self->seed;
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	self->seed = seed;
+	return seed % bound;
+}
+
+
+
+/**
+ * Returns the number of running workers outside a blocking region. The counters are read apart, a worker leaving a region meanwhile may make it negative
+ */
+static int tpool_active(struct tpool* pool) {
+	unsigned int live = atomic_load_explicit(&pool->live, memory_order_relaxed);
+	return (int) (live - atomic_load_explicit(&pool->blocked, memory_order_relaxed));
+}
+
+
+
+static void tpool_blocking(int blocking);
+static int tpool_main(void* param);
+
+
+
+/**
+ * Creates the thread of a worker, pinned to the CPUs of its L3 domain with its stack on its node in NUMA mode
+ */
+static int tpool_start(struct tpool* pool, struct tpool_worker* worker) {
+	thrd_attr_t thread = pool->thread;
+	if (pool->numa) {
+		thrd_attr_setnode(&thread, worker->node);
+		thrd_attr_setaffinity(&thread, &worker->cpuset);
+	}
+	return thrd_create_ex(&worker->thread, &thread, tpool_main, worker);
+}
+
+
+
+/**
+ * Starts a worker in a free slot of an elastic pool or a spare worker, of domain if one is free, returns 0 if every slot is taken, the pool is stopping or the thread could not be created.
+ * The slot is claimed before the stop flag is read and tpool_stop reads them the other way round: either the new worker is joined, or it is not created
+ */
+static int tpool_spawn(struct tpool* pool, unsigned int domain) {
+	for (int pass = 0; pass < ((pool->domains > 1) ? 2 : 1); ++pass) {
+		for (unsigned int i = 0; i < pool->count; ++i) {
+			struct tpool_worker* worker = &pool->workers[i];
+			int state = tpool_worker_dead;
+			if ((worker->domain == domain) != (pass == 0)
+				|| atomic_load_explicit(&worker->state, memory_order_relaxed) != tpool_worker_dead
+				|| !atomic_compare_exchange_strong_explicit(&worker->state, &state, tpool_worker_starting, memory_order_seq_cst, memory_order_relaxed)) {
+				continue;
+			}
+
+			if (atomic_load_explicit(&pool->stop, memory_order_seq_cst)) {
+				atomic_store_explicit(&worker->state, tpool_worker_dead, memory_order_release);
+				return 0;
+			}
+
+			atomic_fetch_add_explicit(&pool->live, 1, memory_order_relaxed);
+			if (tpool_start(pool, worker) != thrd_success) {
+				atomic_fetch_sub_explicit(&pool->live, 1, memory_order_relaxed);
+				atomic_store_explicit(&worker->state, tpool_worker_dead, memory_order_release);
+				return 0;
+			}
+			atomic_store_explicit(&worker->state, tpool_worker_alive, memory_order_release);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+
+/**
+ * Starts a worker in an elastic pool if the oldest task of the submission queue of domain has waited longer than the threshold.
+ * At most one worker is started per threshold, the submitters and workers that see the same backlog race for it
+ */
+static void tpool_grow(struct tpool* pool, unsigned int domain) {
+	if (tpool_active(pool) >= (int) pool->size) {
+		return;
+	}
+
+	long long oldest = tpool_queue_oldest(&pool->queues[domain]);
+	if (oldest == LLONG_MAX) {
+		return;
+	}
+
+	long long now = tpool_clock();
+	long long spawned_at = atomic_load_explicit(&pool->spawned_at, memory_order_relaxed);
+	if (now - oldest > pool->threshold && now - spawned_at >= pool->threshold
+		&& atomic_compare_exchange_strong_explicit(&pool->spawned_at, &spawned_at, now, memory_order_relaxed, memory_order_relaxed)) {
+		tpool_spawn(pool, domain);
+	}
+}
+
+
+
+/**
+ * Takes a task from the submission queue of domain
+ */
+static int tpool_take(struct tpool* pool, unsigned int domain, __OUT__ tpool_func_t* func, __OUT__ void** arg) {
+	if (!tpool_queue_pop(&pool->queues[domain], func, arg)) {
+		return 0;
+	}
+
+	/* The tasks behind this one have waited too, the worker taking from a backlog sees how long */
+	if (pool->elastic) {
+		tpool_grow(pool, domain);
+	}
+	return 1;
+}
+
+
+
+/**
+ * Steals a task from the victims of the calling worker between from and to, and takes the tasks left in the mailboxes of the workers that have left an elastic pool.
+ * Victims are visited from a random one so that the thieves spread over them
+ */
+static int tpool_steal(struct tpool_worker* self, unsigned int from, unsigned int to, __OUT__ tpool_func_t* func, __OUT__ void** arg) {
+	if (from == to) {
+		return 0;
+	}
+
+	unsigned int start = tpool_victim(self, to - from);
+	for (unsigned int i = 0; i < to - from; ++i) {
+		unsigned int index = from + (start + i) % (to - from);
+		struct tpool_worker* victim = &self->pool->workers[(self->victims != NULL) ? self->victims[index] : index];
+		if (victim == self) {
+			continue;
+		}
+		if (tpool_deque_steal(victim, func, arg) > 0
+			|| (atomic_load_explicit(&victim->state, memory_order_relaxed) != tpool_worker_alive && tpool_queue_pop(&victim->mailbox, func, arg))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+
+/**
+ * Looks for a task: in the mailbox of the calling worker, in the priority queues, in the deque of the worker, then in the submission queue of its domain,
+ * then in the deques of the other workers. In NUMA mode the workers sharing its L3 domain are robbed first, then the workers of its node,
+ * then the submission queues of the other nodes, and only then the workers of the other nodes
+ */
+static int tpool_find(struct tpool_worker* self, __OUT__ tpool_func_t* func, __OUT__ void** arg) {
+	struct tpool* pool = self->pool;
+	if (tpool_queue_pop(&self->mailbox, func, arg) || tpool_heap_take(self, func, arg) || tpool_deque_pop(self, func, arg)
+		|| tpool_take(pool, self->domain, func, arg)
+		|| tpool_steal(self, 0, self->near, func, arg) || tpool_steal(self, self->near, self->local, func, arg)) {
+		return 1;
+	}
+
+	for (unsigned int i = 1; i < pool->domains; ++i) {
+		if (tpool_take(pool, (self->domain + i) % pool->domains, func, arg)) {
+			return 1;
+		}
+	}
+	return tpool_steal(self, self->local, self->far, func, arg);
+}
+
+
+
+/**
+ * Makes a worker of an elastic pool, or a spare worker, whose park has timed out leave the pool, returns 1 if it has left. The pool keeps its minimum
+ * outside the blocking regions, and does not shrink for a keep-alive after it has grown. The worker un-parks itself first, nobody wakes it up any more.
+ * Once it has left, the slot is dead and the worker must not touch it nor the pool: everything it still owes the pool is done before
+ */
+static int tpool_retire(struct tpool_worker* self) {
+	struct tpool* pool = self->pool;
+	if (tpool_clock() - atomic_load_explicit(&pool->spawned_at, memory_order_relaxed) < pool->keepalive
+		|| tpool_active(pool) <= (int) pool->minimum) {
+		return 0;
+	}
+
+	int parked = 1;
+	if (!atomic_compare_exchange_strong_explicit(&self->parked, &parked, 0, memory_order_acq_rel, memory_order_relaxed)) {
+		return 0;
+	}
+
+	unsigned int live = atomic_load_explicit(&pool->live, memory_order_relaxed);
+	do {
+		if ((int) (live - atomic_load_explicit(&pool->blocked, memory_order_relaxed)) <= (int) pool->minimum) {
+			return 0;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&pool->live, &live, live - 1, memory_order_relaxed, memory_order_relaxed));
+
+	/* The handle is read while the slot is ours, tpool_stop may claim it to join it meanwhile */
+	int state = atomic_load_explicit(&self->state, memory_order_acquire);
+	thrd_t thread = self->thread;
+	if (state != tpool_worker_alive
+		|| !atomic_compare_exchange_strong_explicit(&self->state, &state, tpool_worker_exiting, memory_order_seq_cst, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&pool->live, 1, memory_order_relaxed);
+		return 0;
+	}
+
+	/* A task submitted to the mailbox before the slot was seen leaving is passed on, pairs with the fence of tpool_submit_to */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&self->mailbox.head, memory_order_relaxed) != atomic_load_explicit(&self->mailbox.tail, memory_order_relaxed)) {
+		tpool_notify(pool, self->domain);
+	}
+
+	/* The slot is only handed back once the worker is done with it: tpool_spawn may start a new worker in it, and tpool_stop release the pool */
+	atomic_fetch_sub_explicit(&pool->sleepers, 1, memory_order_relaxed);
+	tpool_cache_flush(self);
+	thrd_detach(thread);
+	atomic_store_explicit(&self->state, tpool_worker_dead, memory_order_release);
+	return 1;
+}
+
+
+
+/**
+ * Gets the next task of a worker: looks for one, spins, then parks. Returns 0 once the pool is stopped and there is no task left,
+ * -1 once the worker has left an elastic pool
+ * A spinning worker leaves the spinning state before it parks and looks for a task again after that,
+ * so a submission that saw it spinning is never missed. The parked word, the sleepers counter and the last look are ordered the same way.
+ */
+static int tpool_next(struct tpool_worker* self, __OUT__ tpool_func_t* func, __OUT__ void** arg) {
+	struct tpool* pool = self->pool;
+	for (;;) {
+		if (tpool_find(self, func, arg)) {
+			return 1;
+		}
+		tpool_wake_waiters(pool);
+
+		atomic_fetch_add_explicit(&pool->spinning, 1, memory_order_seq_cst);
+		int found = 0;
+		for (int i = 0; i < TPOOL_SPINS && !found; ++i) {
+			thrd_relax();
+			found = tpool_find(self, func, arg);
+		}
+
+		/* The last spinning worker hands the watch over to a parked one, the submitters did not wake anyone */
+		if (atomic_fetch_sub_explicit(&pool->spinning, 1, memory_order_seq_cst) == 1 && found) {
+			tpool_notify(pool, self->domain);
+		}
+		if (found) {
+			return 1;
+		}
+
+		/* The blocks of the other workers do not wait in the batch of a parked one */
+		tpool_cache_flush(self);
+
+		atomic_store_explicit(&self->parked, 1, memory_order_seq_cst);
+		atomic_fetch_add_explicit(&pool->sleepers, 1, memory_order_seq_cst);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		found = tpool_find(self, func, arg);
+		int stop = atomic_load_explicit(&pool->stop, memory_order_acquire);
+		if (found || stop) {
+			/* A submitter may have picked this worker in the meantime, the wake-up it spent is passed on */
+			if (atomic_exchange_explicit(&self->parked, 0, memory_order_acq_rel) == 0 && found) {
+				tpool_notify(pool, self->domain);
+			}
+		} else if (!pool->elastic && pool->spare == 0) {
+			while (atomic_load_explicit(&self->parked, memory_order_acquire) == 1) {
+				futex_wait(&self->parked, 1, NULL);
+			}
+		} else {
+			/* A worker of an elastic pool, or a spare one, parked for a keep-alive leaves it, a pool at its minimum parks without time limit */
+			long long idle = tpool_clock() + pool->keepalive;
+			while (atomic_load_explicit(&self->parked, memory_order_acquire) == 1) {
+				if (atomic_load_explicit(&pool->live, memory_order_relaxed) <= pool->minimum) {
+					futex_wait(&self->parked, 1, NULL);
+					continue;
+				}
+
+				struct timespec deadline = { idle / 1000000000LL, idle % 1000000000LL };
+				if (futex_wait(&self->parked, 1, &deadline) == thrd_timedout) {
+					if (tpool_retire(self)) {
+						return -1;
+					}
+					idle = tpool_clock() + pool->keepalive;
+				}
+			}
+		}
+		atomic_fetch_sub_explicit(&pool->sleepers, 1, memory_order_relaxed);
+
+		if (found) {
+			return 1;
+		} else if (stop) {
+			return 0;
+		}
+	}
+}
+
+
+
+/**
+ * Runs a task on the calling worker and counts it as completed, the counters are only written by the worker
+ * A task that waits may run other tasks meanwhile, the deadline is read before
+ */
+static void tpool_run(struct tpool_worker* self, tpool_func_t func, void* arg) {
+	long long deadline = self->deadline;
+	self->deadline = TPOOL_NO_DEADLINE;
+
+	func(arg);
+
+	if (deadline != TPOOL_NO_DEADLINE && tpool_clock() > deadline) {
+		atomic_store_explicit(&self->misses, atomic_load_explicit(&self->misses, memory_order_relaxed) + 1, memory_order_relaxed);
+	}
+	atomic_store_explicit(&self->completed, atomic_load_explicit(&self->completed, memory_order_relaxed) + 1, memory_order_release);
+}
+
+
+
+/**
+ * Start routine of the workers
+ */
+static int tpool_main(void* param) {
+	struct tpool_worker* self = (struct tpool_worker*) param;
+	tpool_self = self;
+	thrd_set_blocking_hook(tpool_blocking);
+
+	tpool_func_t func;
+	void* arg;
+	int next;
+	while ((next = tpool_next(self, &func, &arg)) > 0) {
+		tpool_run(self, func, arg);
+	}
+
+	/* A worker that has left the pool has already handed its slot back, it may belong to another worker or the pool be gone */
+	if (next == 0) {
+		tpool_cache_flush(self);
+	}
+	thrd_set_blocking_hook(NULL);
+	tpool_self = NULL;
+	return 0;
+}
+
+
+
+/**
+ * Checks whether every task has completed. Each counter only grows, completions are read first:
+ * a task that has not completed was spawned by a task counted as completed, or submitted, so the sums cannot be equal
+ */
+static int tpool_quiescent(struct tpool* pool) {
+	size_t completed = 0;
+	for (unsigned int i = 0; i < pool->count; ++i) {
+		completed += atomic_load_explicit(&pool->workers[i].completed, memory_order_acquire);
+	}
+
+	size_t spawned = atomic_load_explicit(&pool->submitted, memory_order_acquire);
+	for (unsigned int i = 0; i < pool->count; ++i) {
+		spawned += atomic_load_explicit(&pool->workers[i].spawned, memory_order_acquire);
+	}
+	return completed == spawned;
+}
+
+
+
+/**
+ * Stops the workers and joins them. A worker being started is waited for, a worker leaving an elastic pool either leaves first, and is waited for until it has handed its slot back, or is joined
+ */
+static void tpool_stop(struct tpool* pool) {
+	atomic_store_explicit(&pool->stop, 1, memory_order_seq_cst);
+	for (unsigned int i = 0; i < pool->count; ++i) {
+		if (atomic_exchange_explicit(&pool->workers[i].parked, 0, memory_order_seq_cst) == 1) {
+			futex_wake(&pool->workers[i].parked, 1);
+		}
+	}
+
+	for (unsigned int i = 0; i < pool->count; ++i) {
+		struct tpool_worker* worker = &pool->workers[i];
+		int state;
+		while ((state = atomic_load_explicit(&worker->state, memory_order_seq_cst)) == tpool_worker_starting || state == tpool_worker_exiting) {
+			thrd_yield();
+		}
+		if (state == tpool_worker_alive
+			&& atomic_compare_exchange_strong_explicit(&worker->state, &state, tpool_worker_joining, memory_order_seq_cst, memory_order_relaxed)) {
+			thrd_join(worker->thread, NULL);
+		}
+	}
+}
+
+
+
+/**
+ * Releases the queues and the deques of the pool, then the pool itself. Also called on a pool partially allocated by tpool_create
+ */
+static void tpool_free(struct tpool* pool) {
+	for (unsigned int i = 0; i < pool->count; ++i) {
+		struct tpool_buffer* buffer = atomic_load_explicit(&pool->workers[i].buffer, memory_order_relaxed);
+		while (buffer != NULL) {
+			struct tpool_buffer* previous = buffer->previous;
+			free(buffer);
+			buffer = previous;
+		}
+		free(pool->workers[i].mailbox.cells);
+		free(pool->workers[i].heap.entries);
+		tpool_cache_free(&pool->workers[i].cache);
+	}
+	tpool_cache_free(&pool->cache);
+	for (unsigned int i = 0; pool->queues != NULL && i < pool->domains; ++i) {
+		free(pool->queues[i].cells);
+	}
+	free(pool->queues);
+	free(pool->nodes);
+	free(pool->victims);
+	free(pool->workers);
+	free(pool);
+}
+
+
+
+/**
+ * Places the workers of a pool in NUMA mode: scattered over the packages and L3 domains of the CPUs the process is allowed to run on,
+ * each one pinned to its L3 domain within its node. The workers of a node share a submission queue, the victims of each worker are ordered by distance
+ */
+static int tpool_partition(struct tpool* pool) {
+	unsigned int count = pool->count;
+	thrd_cpuset_t* cpusets = (thrd_cpuset_t*) malloc(count * sizeof(thrd_cpuset_t));
+	pool->nodes = (int*) malloc(count * sizeof(int));
+	pool->victims = (unsigned int*) malloc(((size_t) count * (count - 1) + 1) * sizeof(unsigned int));
+
+	/* ERROR: No memory for the placement, the arrays of the pool are released with it */
+	if (cpusets == NULL || pool->nodes == NULL || pool->victims == NULL) {
+		free(cpusets);
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	/* ERROR: The workers cannot be placed, errno is kept from topo_place */
+	int value = topo_place(topo_scatter, count, cpusets);
+	if (value != thrd_success) {
+		free(cpusets);
+		return value;
+	}
+
+	/* The worker may run anywhere in its L3 domain, but only where the process may */
+	thrd_cpuset_t allowed;
+	thrd_t current = thrd_current();
+	int restricted = current != NULL && thrd_get_affinity(current, &allowed) == thrd_success;
+
+	pool->domains = 0;
+	for (unsigned int i = 0; i < count; ++i) {
+		struct tpool_worker* worker = &pool->workers[i];
+		int cpu = 0;
+		while (cpu < THRD_CPUSET_SIZE - 1 && !thrd_cpuset_isset(&cpusets[i], cpu)) {
+			++cpu;
+		}
+
+		const topo_cpu_t* desc = topo_cpu(cpu);
+		worker->node = (desc != NULL) ? desc->node : 0;
+		worker->l3 = (desc != NULL) ? desc->l3 : 0;
+		worker->cpuset = cpusets[i];
+		if (desc != NULL && topo_cpuset(topo_l3, desc->l3, &worker->cpuset) == thrd_success) {
+			for (int other = 0; other < THRD_CPUSET_SIZE; ++other) {
+				if (thrd_cpuset_isset(&worker->cpuset, other)
+					&& (topo_cpu(other)->node != desc->node || (restricted && !thrd_cpuset_isset(&allowed, other)))) {
+					thrd_cpuset_clear(&worker->cpuset, other);
+				}
+			}
+		}
+		if (thrd_cpuset_count(&worker->cpuset) == 0) {
+			worker->cpuset = cpusets[i];
+		}
+
+		worker->domain = 0;
+		while (worker->domain < pool->domains && pool->nodes[worker->domain] != worker->node) {
+			++worker->domain;
+		}
+		if (worker->domain == pool->domains) {
+			pool->nodes[pool->domains++] = worker->node;
+		}
+	}
+	free(cpusets);
+
+	/* Same L3 domain and node first, then same node, then the other nodes */
+	for (unsigned int i = 0; i < count; ++i) {
+		struct tpool_worker* worker = &pool->workers[i];
+		unsigned int* victims = &pool->victims[(size_t) i * (count - 1)];
+		unsigned int size = 0;
+		for (int distance = 0; distance < 3; ++distance) {
+			for (unsigned int j = 0; j < count; ++j) {
+				struct tpool_worker* victim = &pool->workers[j];
+				if (j != i && distance == ((victim->node != worker->node) ? 2 : (victim->l3 != worker->l3) ? 1 : 0)) {
+					victims[size++] = j;
+				}
+			}
+			if (distance == 0) {
+				worker->near = size;
+			} else if (distance == 1) {
+				worker->local = size;
+			}
+		}
+		worker->victims = victims;
+		worker->far = size;
+	}
+	return thrd_success;
+}
+
+
+
+void tpool_attr_init(__OUT__ tpool_attr_t* attr) {
+	memset(attr, 0, sizeof(*attr));
+	thrd_attr_init(&attr->thread);
+}
+
+
+
+int tpool_attr_setworkers(__INOUT__ tpool_attr_t* attr, unsigned int workers) {
+	/* ERROR: A pool needs a worker */
+	if (workers == 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->workers = workers;
+	attr->flags |= tpool_attr_workers;
+	return thrd_success;
+}
+
+
+
+int tpool_attr_setcapacity(__INOUT__ tpool_attr_t* attr, unsigned int capacity) {
+	/* ERROR: Positions are told apart from sequences only with at least 2 cells, and the capacity must stay a power of two */
+	if (capacity < 2 || capacity > (UINT_MAX / 2) + 1) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->capacity = capacity;
+	attr->flags |= tpool_attr_capacity;
+	return thrd_success;
+}
+
+
+
+int tpool_attr_setthread(__INOUT__ tpool_attr_t* attr, const thrd_attr_t* thread) {
+	/* ERROR: Workers share the same settings, a caller-provided stack cannot be shared */
+	if (thread->flags & thrd_attr_stack) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->thread = *thread;
+	attr->flags |= tpool_attr_thread;
+	return thrd_success;
+}
+
+
+
+int tpool_attr_setorder(__INOUT__ tpool_attr_t* attr, int order) {
+	/* ERROR: Unknown order */
+	if (order != tpool_order_priority && order != tpool_order_deadline) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->order = order;
+	attr->flags |= tpool_attr_order;
+	return thrd_success;
+}
+
+
+
+int tpool_attr_setaging(__INOUT__ tpool_attr_t* attr, long long aging) {
+	/* ERROR: Priorities times the aging must fit in the keys */
+	if (aging < 0 || aging > 1000000000LL) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->aging = aging;
+	attr->flags |= tpool_attr_aging;
+	return thrd_success;
+}
+
+
+
+int tpool_attr_setelastic(__INOUT__ tpool_attr_t* attr, unsigned int minimum, unsigned int maximum) {
+	/* ERROR: A pool needs a worker, and room for its minimum */
+	if (minimum == 0 || maximum < minimum) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->minimum = minimum;
+	attr->workers = maximum;
+	attr->flags |= tpool_attr_elastic | tpool_attr_workers;
+	return thrd_success;
+}
+
+
+
+int tpool_attr_setkeepalive(__INOUT__ tpool_attr_t* attr, long long keepalive) {
+	/* ERROR: A keep-alive is a duration */
+	if (keepalive <= 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->keepalive = keepalive;
+	attr->flags |= tpool_attr_keepalive;
+	return thrd_success;
+}
+
+
+
+int tpool_attr_setthreshold(__INOUT__ tpool_attr_t* attr, long long threshold) {
+	/* ERROR: A threshold is a duration */
+	if (threshold <= 0) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	attr->threshold = threshold;
+	attr->flags |= tpool_attr_threshold;
+	return thrd_success;
+}
+
+
+
+int tpool_attr_setnuma(__INOUT__ tpool_attr_t* attr, int numa) {
+	attr->numa = numa != 0;
+	attr->flags |= tpool_attr_numa;
+	return thrd_success;
+}
+
+
+
+int tpool_attr_setblocking(__INOUT__ tpool_attr_t* attr, unsigned int spare) {
+	attr->spare = spare;
+	attr->flags |= tpool_attr_blocking;
+	return thrd_success;
+}
+
+
+
+int tpool_create(__OUT__ tpool_t* pool, const tpool_attr_t* attr) {
+	tpool_attr_t defaults;
+	if (attr == NULL) {
+		tpool_attr_init(&defaults);
+		attr = &defaults;
+	}
+
+	unsigned int size = (attr->flags & tpool_attr_workers) ? attr->workers : thrd_hardware_concurrency();
+	unsigned int spare = (attr->flags & tpool_attr_blocking) ? attr->spare : 0;
+
+	/* ERROR: The slots of the workers and of the spare workers must be countable */
+	if (spare > UINT_MAX - size) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+	unsigned int count = size + spare;
+
+	size_t capacity = 2;
+	while (capacity < ((attr->flags & tpool_attr_capacity) ? attr->capacity : TPOOL_CAPACITY)) {
+		capacity <<= 1;
+	}
+
+	struct tpool* self = (struct tpool*) calloc(1, sizeof(struct tpool));
+	struct tpool_worker* workers = (struct tpool_worker*) calloc(count, sizeof(struct tpool_worker));
+
+	/* ERROR: No memory for the pool */
+	if (self == NULL || workers == NULL) {
+		free(self);
+		free(workers);
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+	self->count = count;
+	self->size = size;
+	self->spare = spare;
+	self->workers = workers;
+	self->order = (attr->flags & tpool_attr_order) ? attr->order : tpool_order_priority;
+	self->aging = (attr->flags & tpool_attr_aging) ? attr->aging : TPOOL_AGING;
+	self->elastic = (attr->flags & tpool_attr_elastic) != 0;
+	self->minimum = (self->elastic && attr->minimum < size) ? attr->minimum : size;
+	self->keepalive = (attr->flags & tpool_attr_keepalive) ? attr->keepalive : TPOOL_KEEPALIVE;
+	self->threshold = (attr->flags & tpool_attr_threshold) ? attr->threshold : TPOOL_THRESHOLD;
+	atomic_init(&self->spawned_at, tpool_clock());
+	self->numa = (attr->flags & tpool_attr_numa) && attr->numa;
+	self->domains = 1;
+
+	int allocated = 1;
+	for (unsigned int i = 0; i < count; ++i) {
+		struct tpool_buffer* buffer = tpool_buffer_alloc(TPOOL_DEQUE_SIZE);
+		atomic_init(&workers[i].buffer, buffer);
+		allocated = tpool_queue_init(&workers[i].mailbox, TPOOL_MAILBOX_SIZE) && buffer != NULL && allocated;
+		workers[i].pool = self;
+		workers[i].index = i;
+		workers[i].far = count;
+		workers[i].deadline = TPOOL_NO_DEADLINE;
+		atomic_flag_clear(&workers[i].heap.lock);
+		atomic_init(&workers[i].heap.top, TPOOL_NO_DEADLINE);
+		workers[i].seed = 2654435761u * (i + 1);
+		tpool_cache_init(&workers[i].cache, self);
+	}
+	tpool_cache_init(&self->cache, self);
+
+	/* ERROR: The workers could not be placed, errno is kept from tpool_partition */
+	if (self->numa) {
+		int value = tpool_partition(self);
+		if (value != thrd_success) {
+			int error = errno;
+			tpool_free(self);
+			errno = error;
+			return value;
+		}
+	}
+
+	/* One submission queue per node of the workers */
+	self->queues = (struct tpool_queue*) calloc(self->domains, sizeof(struct tpool_queue));
+	for (unsigned int i = 0; self->queues != NULL && i < self->domains; ++i) {
+		allocated = tpool_queue_init(&self->queues[i], capacity) && allocated;
+	}
+
+	/* ERROR: No memory for the queues or the deques, whatever has been allocated is released */
+	if (!allocated || self->queues == NULL) {
+		tpool_free(self);
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	/* Workers started on demand are kept light */
+	self->thread = attr->thread;
+	if (!(self->thread.flags & thrd_attr_name)) {
+		thrd_attr_setname(&self->thread, "tpool");
+	}
+	if (self->elastic && !(self->thread.flags & thrd_attr_stacksize)) {
+		thrd_attr_setstacksize(&self->thread, TPOOL_STACK);
+	}
+
+	for (unsigned int i = 0; i < self->minimum; ++i) {
+		atomic_store_explicit(&workers[i].state, tpool_worker_starting, memory_order_relaxed);
+		int value = tpool_start(self, &workers[i]);
+
+		/* ERROR: The workers already started are stopped, errno is kept from thrd_create_ex */
+		if (value != thrd_success) {
+			int error = errno;
+			atomic_store_explicit(&workers[i].state, tpool_worker_dead, memory_order_relaxed);
+			tpool_stop(self);
+			tpool_free(self);
+			errno = error;
+			return value;
+		}
+		atomic_store_explicit(&workers[i].state, tpool_worker_alive, memory_order_release);
+		atomic_fetch_add_explicit(&self->live, 1, memory_order_relaxed);
+	}
+
+	*pool = self;
+	return thrd_success;
+}
+
+
+
+/**
+ * Returns the submission queue of node, -1 for the node of the calling thread. A node without worker gets the queue of the calling thread
+ */
+static unsigned int tpool_domain(struct tpool* pool, int node) {
+	if (pool->domains == 1) {
+		return 0;
+	}
+
+	for (unsigned int i = 0; node >= 0 && i < pool->domains; ++i) {
+		if (pool->nodes[i] == node) {
+			return i;
+		}
+	}
+
+	struct tpool_worker* self = tpool_self;
+	if (self != NULL && self->pool == pool) {
+		return self->domain;
+	}
+
+	#ifdef __linux__
+		int cpu = sched_getcpu();
+		const topo_cpu_t* desc = (cpu >= 0) ? topo_cpu(cpu) : NULL;
+		for (unsigned int i = 0; desc != NULL && i < pool->domains; ++i) {
+			if (pool->nodes[i] == desc->node) {
+				return i;
+			}
+		}
+	#endif /* __linux__ */
+
+	return 0;
+}
+
+
+
+/**
+ * Submits a task to the submission queue of node, see tpool_submit_node, or to the deque of the calling worker if it runs on that node
+ */
+static int tpool_trysubmit_at(struct tpool* pool, int node, tpool_func_t func, void* arg) {
+	/* ERROR: A task needs a function */
+	if (func == NULL) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+	unsigned int domain = tpool_domain(pool, node);
+
+	/* A task spawned by a worker goes to its own deque, the counter is only written by the worker */
+	struct tpool_worker* self = tpool_self;
+	if (self != NULL && self->pool == pool && self->domain == domain) {
+		size_t spawned = atomic_load_explicit(&self->spawned, memory_order_relaxed);
+		atomic_store_explicit(&self->spawned, spawned + 1, memory_order_relaxed);
+		if (tpool_deque_push(self, func, arg)) {
+			/* Best effort: a missed wake-up only delays the steal, the worker runs its own tasks anyway */
+			if (atomic_load_explicit(&pool->spinning, memory_order_relaxed) == 0) {
+				tpool_notify(pool, domain);
+			}
+			return thrd_success;
+		}
+
+		/* The deque could not grow, the task goes to the submission queue instead */
+		atomic_store_explicit(&self->spawned, spawned, memory_order_relaxed);
+	}
+
+	/* The task is counted before it is queued, tpool_wait cannot see it completed before it is submitted */
+	atomic_fetch_add_explicit(&pool->submitted, 1, memory_order_relaxed);
+	if (!tpool_queue_push(&pool->queues[domain], func, arg, pool->elastic ? tpool_clock() : 0)) {
+		atomic_fetch_sub_explicit(&pool->submitted, 1, memory_order_relaxed);
+		tpool_wake_waiters(pool);
+		return thrd_busy;
+	}
+
+	/* A spinning worker will find the task, otherwise a parked one is woken up. Pairs with the fences of tpool_next */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&pool->spinning, memory_order_relaxed) == 0) {
+		tpool_notify(pool, domain);
+
+		/* Every worker is busy, an elastic pool may need one more */
+		if (pool->elastic && atomic_load_explicit(&pool->sleepers, memory_order_relaxed) == 0) {
+			tpool_grow(pool, domain);
+		}
+	}
+	return thrd_success;
+}
+
+
+
+/**
+ * Submits a task to node, waiting for room in the submission queue
+ */
+static int tpool_submit_at(struct tpool* pool, int node, tpool_func_t func, void* arg) {
+	thrd_backoff_t backoff;
+	thrd_backoff_init(&backoff, THRD_BACKOFF_SPINS, THRD_BACKOFF_YIELDS, THRD_BACKOFF_SLEEP);
+
+	int value;
+	while ((value = tpool_trysubmit_at(pool, node, func, arg)) == thrd_busy) {
+		/* A worker whose deque cannot grow makes room itself instead of waiting for the others */
+		if (tpool_help(pool)) {
+			thrd_backoff_reset(&backoff);
+		} else {
+			thrd_backoff_wait(&backoff);
+		}
+	}
+	return value;
+}
+
+
+
+int tpool_trysubmit(tpool_t pool, tpool_func_t func, void* arg) {
+	return tpool_trysubmit_at(pool, -1, func, arg);
+}
+
+
+
+int tpool_submit(tpool_t pool, tpool_func_t func, void* arg) {
+	return tpool_submit_at(pool, -1, func, arg);
+}
+
+
+
+int tpool_submit_node(tpool_t pool, int node, tpool_func_t func, void* arg) {
+	/* ERROR: Out of the node range */
+	if (node < -1 || node >= THRD_CPUSET_SIZE) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	return tpool_submit_at(pool, node, func, arg);
+}
+
+
+
+int tpool_submit_to(tpool_t pool, unsigned int worker, tpool_func_t func, void* arg) {
+	/* ERROR: A task needs a function and an existing worker */
+	if (func == NULL || worker >= pool->count) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	struct tpool_worker* target = &pool->workers[worker];
+	atomic_fetch_add_explicit(&pool->submitted, 1, memory_order_relaxed);
+	if (!tpool_queue_push(&target->mailbox, func, arg, 0)) {
+		/* The mailbox is full, the worker is only a hint */
+		atomic_fetch_sub_explicit(&pool->submitted, 1, memory_order_relaxed);
+		return tpool_submit(pool, func, arg);
+	}
+
+	/* Only the target takes the task, it is woken up whoever else is spinning. Pairs with the fences of tpool_next and tpool_retire:
+	   the mailbox of a worker that has left an elastic pool is emptied by the others */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&target->state, memory_order_relaxed) == tpool_worker_alive) {
+		tpool_wake(target);
+	} else {
+		tpool_notify(pool, target->domain);
+	}
+	return thrd_success;
+}
+
+
+
+int tpool_submit_prio(tpool_t pool, int priority, const struct timespec* deadline, tpool_func_t func, void* arg) {
+	/* ERROR: A task needs a function */
+	if (func == NULL) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	struct tpool_entry entry;
+	entry.enqueued = tpool_clock();
+	entry.deadline = (deadline != NULL) ? deadline->tv_sec * 1000000000LL + deadline->tv_nsec : TPOOL_NO_DEADLINE;
+	entry.priority = priority;
+	entry.func = func;
+	entry.arg = arg;
+
+	/* Virtual deadline: the aging bounds the wait of a task for the tasks that overtake it */
+	if (pool->order == tpool_order_deadline) {
+		entry.key = (entry.deadline != TPOOL_NO_DEADLINE || pool->aging == 0) ? entry.deadline : entry.enqueued + pool->aging;
+	} else {
+		entry.key = (pool->aging != 0) ? entry.enqueued - (long long) priority * pool->aging : -(long long) priority;
+	}
+
+	struct tpool_worker* self = tpool_self;
+	struct tpool_worker* target = (self != NULL && self->pool == pool)
+		? self
+		: &pool->workers[atomic_fetch_add_explicit(&pool->turn, 1, memory_order_relaxed) % pool->count];
+
+	/* The task is counted before it is queued, tpool_wait cannot see it completed before it is submitted */
+	atomic_fetch_add_explicit(&pool->submitted, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pool->queued, 1, memory_order_release);
+
+	tpool_heap_lock(&target->heap);
+	int pushed = tpool_heap_push(&target->heap, &entry);
+	tpool_heap_unlock(&target->heap);
+
+	/* ERROR: The priority queue could not grow */
+	if (!pushed) {
+		atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+		atomic_fetch_sub_explicit(&pool->submitted, 1, memory_order_relaxed);
+		tpool_wake_waiters(pool);
+		errno = ENOMEM;
+		return thrd_nomem;
+	}
+
+	/* Pairs with the fences of tpool_next, as for tpool_trysubmit */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&pool->spinning, memory_order_relaxed) == 0) {
+		tpool_notify(pool, target->domain);
+	}
+	return thrd_success;
+}
+
+
+
+void tpool_stats(tpool_t pool, __OUT__ tpool_stats_t* stats) {
+	memset(stats, 0, sizeof(*stats));
+	for (unsigned int i = 0; i < pool->count; ++i) {
+		struct tpool_worker* worker = &pool->workers[i];
+		stats->prioritized += atomic_load_explicit(&worker->prioritized, memory_order_relaxed);
+		stats->deadlines += atomic_load_explicit(&worker->deadlines, memory_order_relaxed);
+		stats->misses += atomic_load_explicit(&worker->misses, memory_order_relaxed);
+		stats->late += atomic_load_explicit(&worker->late, memory_order_relaxed);
+		stats->aged += atomic_load_explicit(&worker->aged, memory_order_relaxed);
+		stats->waited += atomic_load_explicit(&worker->waited, memory_order_relaxed);
+
+		unsigned long long waited_max = atomic_load_explicit(&worker->waited_max, memory_order_relaxed);
+		if (waited_max > stats->waited_max) {
+			stats->waited_max = waited_max;
+		}
+	}
+}
+
+
+
+int tpool_help(tpool_t pool) {
+	struct tpool_worker* self = tpool_self;
+	if (self == NULL || self->pool != pool) {
+		return 0;
+	}
+
+	tpool_func_t func;
+	void* arg;
+	if (!tpool_find(self, &func, &arg)) {
+		return 0;
+	}
+	tpool_run(self, func, arg);
+	return 1;
+}
+
+
+
+int tpool_demand(tpool_t pool) {
+	/* The thieves have taken everything the worker offered */
+	struct tpool_worker* self = tpool_self;
+	if (self != NULL && self->pool == pool) {
+		return atomic_load_explicit(&self->bottom, memory_order_relaxed) <= atomic_load_explicit(&self->top, memory_order_relaxed);
+	}
+
+	/* From outside, the queues are drained and a worker is looking for a task */
+	for (unsigned int i = 0; i < pool->domains; ++i) {
+		if (atomic_load_explicit(&pool->queues[i].head, memory_order_relaxed) != atomic_load_explicit(&pool->queues[i].tail, memory_order_relaxed)) {
+			return 0;
+		}
+	}
+	return atomic_load_explicit(&pool->spinning, memory_order_relaxed) != 0 || atomic_load_explicit(&pool->sleepers, memory_order_relaxed) != 0;
+}
+
+
+
+int tpool_worker_index(tpool_t pool) {
+	struct tpool_worker* self = tpool_self;
+	return (self != NULL && self->pool == pool) ? (int) self->index : -1;
+}
+
+
+
+int tpool_wait(tpool_t pool) {
+	/* ERROR: A task waiting for the pool waits for itself */
+	if (tpool_self != NULL && tpool_self->pool == pool) {
+		errno = EDEADLK;
+		return thrd_error;
+	}
+
+	atomic_fetch_add_explicit(&pool->waiters, 1, memory_order_seq_cst);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	for (;;) {
+		int idle = atomic_load_explicit(&pool->idle, memory_order_acquire);
+		if (tpool_quiescent(pool)) {
+			break;
+		}
+		futex_wait(&pool->idle, idle, NULL);
+	}
+
+	atomic_fetch_sub_explicit(&pool->waiters, 1, memory_order_relaxed);
+	return thrd_success;
+}
+
+
+
+unsigned int tpool_size(tpool_t pool) {
+	return pool->size;
+}
+
+
+
+unsigned int tpool_slots(tpool_t pool) {
+	return pool->count;
+}
+
+
+
+unsigned int tpool_live(tpool_t pool) {
+	return atomic_load_explicit(&pool->live, memory_order_relaxed);
+}
+
+
+
+void tpool_begin_blocking(void) {
+	struct tpool_worker* self = tpool_self;
+	if (self == NULL || self->blocking++ != 0) {
+		return;
+	}
+
+	struct tpool* pool = self->pool;
+	atomic_fetch_add_explicit(&pool->blocked, 1, memory_order_seq_cst);
+
+	/* A spinning worker takes over the tasks the worker leaves behind */
+	if (atomic_load_explicit(&pool->spinning, memory_order_seq_cst) != 0) {
+		return;
+	}
+
+	/* A parked worker is only woken up if there is a task to take over: the deque of the worker, the submission queues or the priority queues */
+	if (atomic_load_explicit(&pool->sleepers, memory_order_seq_cst) != 0) {
+		int pending = atomic_load_explicit(&self->bottom, memory_order_relaxed) > atomic_load_explicit(&self->top, memory_order_relaxed)
+			|| atomic_load_explicit(&pool->queued, memory_order_relaxed) != 0;
+		for (unsigned int i = 0; !pending && i < pool->domains; ++i) {
+			pending = atomic_load_explicit(&pool->queues[i].head, memory_order_relaxed) != atomic_load_explicit(&pool->queues[i].tail, memory_order_relaxed);
+		}
+		if (pending) {
+			tpool_notify(pool, self->domain);
+		}
+		return;
+	}
+
+	/* Every other worker is busy, one is started while the pool is short of workers outside the blocking regions.
+	 * It also holds the pool for a keep-alive, as a worker started on a backlog does */
+	if (atomic_load_explicit(&pool->live, memory_order_relaxed) < pool->count && tpool_active(pool) < (int) pool->size
+		&& tpool_spawn(pool, self->domain)) {
+		atomic_store_explicit(&pool->spawned_at, tpool_clock(), memory_order_relaxed);
+	}
+}
+
+
+
+void tpool_end_blocking(void) {
+	struct tpool_worker* self = tpool_self;
+	if (self == NULL || self->blocking == 0 || --self->blocking != 0) {
+		return;
+	}
+
+	/* The workers started meanwhile park, then leave after a keep-alive */
+	atomic_fetch_sub_explicit(&self->pool->blocked, 1, memory_order_relaxed);
+}
+
+
+
+/**
+ * Blocking hook of the workers, see thrd_set_blocking_hook
+ */
+static void tpool_blocking(int blocking) {
+	if (blocking) {
+		tpool_begin_blocking();
+	} else {
+		tpool_end_blocking();
+	}
+}
+
+
+
+/**
+ * Creates the shared pool, with a spare worker per worker: the tasks of the library and of its users may wait for each other
+ */
+static void tpool_shared_create(void) {
+	tpool_attr_t attr;
+	tpool_attr_init(&attr);
+	tpool_attr_setblocking(&attr, thrd_hardware_concurrency());
+
+	if (tpool_create(&tpool_shared_pool, &attr) != thrd_success) {
+		tpool_shared_pool = NULL;
+	}
+}
+
+
+
+#ifdef __unix__
+static void tpool_shared_init(void) {
+	tpool_shared_create();
+}
+#endif /* __unix__ */
+
+#ifdef _WIN32
+static BOOL CALLBACK tpool_shared_init(PINIT_ONCE once, PVOID param, PVOID* context) {
+	(void) once;
+	(void) param;
+	(void) context;
+
+	tpool_shared_create();
+	return TRUE;
+}
+#endif /* _WIN32 */
+
+
+
+tpool_t tpool_shared(void) {
+	#ifdef __unix__
+		pthread_once(&tpool_shared_once, tpool_shared_init);
+	#endif /* __unix__ */
+
+	#ifdef _WIN32
+		InitOnceExecuteOnce(&tpool_shared_once, tpool_shared_init, NULL, NULL);
+	#endif /* _WIN32 */
+
+	return tpool_shared_pool;
+}
+
+
+
+void* tpool_task_alloc(tpool_t pool, size_t size) {
+	struct tpool_block* block;
+	struct tpool_worker* self = tpool_self;
+	if (size > TPOOL_TASK_SIZE) {
+		/* Larger than a block, allocated on its own with the same header */
+		block = (struct tpool_block*) malloc(offsetof(struct tpool_block, data) + size);
+		if (block != NULL) {
+			block->cache = NULL;
+		}
+	} else if (self != NULL && self->pool == pool) {
+		block = tpool_cache_pop(&self->cache);
+	} else {
+		while (atomic_flag_test_and_set_explicit(&pool->cache.lock, memory_order_acquire)) {
+			thrd_yield();
+		}
+		block = tpool_cache_pop(&pool->cache);
+		atomic_flag_clear_explicit(&pool->cache.lock, memory_order_release);
+	}
+
+	/* ERROR: No memory for a new slab */
+	if (block == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return &block->data;
+}
+
+
+
+void tpool_task_free(void* task) {
+	if (task == NULL) {
+		return;
+	}
+
+	struct tpool_block* block = (struct tpool_block*) ((unsigned char*) task - offsetof(struct tpool_block, data));
+	struct tpool_cache* cache = block->cache;
+	struct tpool_worker* self = tpool_self;
+	if (cache == NULL) {
+		free(block);
+	} else if (self != NULL && cache == &self->cache) {
+		block->next = cache->free;
+		cache->free = block;
+	} else if (self != NULL && self->pool == cache->pool) {
+		/* A worker of the same pool returns the blocks of a cache together, the batch goes back once full or when the cache changes */
+		if (self->batch != NULL && (self->batch->cache != cache || self->batched == TPOOL_TASK_BATCH)) {
+			tpool_cache_flush(self);
+		}
+		if (self->batch == NULL) {
+			self->batch_last = block;
+		}
+		block->next = self->batch;
+		self->batch = block;
+		++self->batched;
+	} else {
+		tpool_cache_return(cache, block, block);
+	}
+}
+
+
+
+/**
+ * Runs a task of a group, then counts it as completed
+ */
+static void tpool_group_run(void* param) {
+	struct tpool_group_task* task = (struct tpool_group_task*) param;
+	tpool_group_t* group = task->group;
+	tpool_func_t func = task->func;
+	void* arg = task->arg;
+	tpool_task_free(task);
+
+	func(arg);
+	tpool_group_done(group);
+}
+
+
+
+void tpool_group_init(__OUT__ tpool_group_t* group, tpool_t pool) {
+	group->pool = (pool != NULL) ? pool : tpool_shared();
+	atomic_init(&group->pending, 0);
+}
+
+
+
+int tpool_group_spawn(__INOUT__ tpool_group_t* group, tpool_func_t func, void* arg) {
+	/* ERROR: A task needs a function */
+	if (func == NULL) {
+		errno = EINVAL;
+		return thrd_error;
+	}
+
+	struct tpool_group_task* task = (group->pool != NULL) ? (struct tpool_group_task*) tpool_task_alloc(group->pool, sizeof(struct tpool_group_task)) : NULL;
+
+	/* No pool or no memory, the task is run right away: the group waits for it all the same */
+	if (task == NULL) {
+		func(arg);
+		return thrd_success;
+	}
+	task->group = group;
+	task->func = func;
+	task->arg = arg;
+
+	tpool_group_add(group, 1);
+	int value = tpool_submit(group->pool, tpool_group_run, task);
+
+	/* ERROR: The task could not be submitted, errno is kept from tpool_submit */
+	if (value != thrd_success) {
+		tpool_task_free(task);
+		tpool_group_done(group);
+	}
+	return value;
+}
+
+
+
+void tpool_group_add(__INOUT__ tpool_group_t* group, int count) {
+	atomic_fetch_add_explicit(&group->pending, count, memory_order_relaxed);
+}
+
+
+
+void tpool_group_done(__INOUT__ tpool_group_t* group) {
+	/* The group may be gone as soon as pending reaches 0, its address is then only used as a futex key */
+	if (atomic_fetch_sub_explicit(&group->pending, 1, memory_order_acq_rel) == (TPOOL_GROUP_WAITING | 1)) {
+		futex_wake(&group->pending, INT_MAX);
+	}
+}
+
+
+
+int tpool_group_wait(__INOUT__ tpool_group_t* group) {
+	/* A worker never sleeps: the rest of the group may be in its own deque or mailbox, or in the mailbox of a worker waiting the same way for this one */
+	if (group->pool != NULL && tpool_self != NULL && tpool_self->pool == group->pool) {
+		thrd_backoff_t backoff;
+		thrd_backoff_init(&backoff, THRD_BACKOFF_SPINS, THRD_BACKOFF_YIELDS, THRD_BACKOFF_SLEEP);
+
+		while ((atomic_load_explicit(&group->pending, memory_order_acquire) & ~TPOOL_GROUP_WAITING) != 0) {
+			if (tpool_help(group->pool)) {
+				thrd_backoff_reset(&backoff);
+			} else {
+				thrd_backoff_wait(&backoff);
+			}
+		}
+		return thrd_success;
+	}
+
+	for (;;) {
+		int pending = atomic_fetch_or_explicit(&group->pending, TPOOL_GROUP_WAITING, memory_order_acquire) | TPOOL_GROUP_WAITING;
+		if (pending == TPOOL_GROUP_WAITING) {
+			break;
+		}
+		futex_wait(&group->pending, pending, NULL);
+	}
+
+	/* The group is empty again, it may be reused */
+	atomic_store_explicit(&group->pending, 0, memory_order_relaxed);
+	return thrd_success;
+}
+
+
+
+void tpool_destroy(tpool_t pool) {
+	tpool_wait(pool);
+	tpool_stop(pool);
+	tpool_free(pool);
+}
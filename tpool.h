@@ -0,0 +1,556 @@
+﻿#ifndef C11_THREADS_TPOOL_HEADER
+#define C11_THREADS_TPOOL_HEADER
+
+#include "threads.h"
+
+#include <stdatomic.h> /* For atomic_int */
+
+
+
+/**
+ * Work-stealing thread pool, of a fixed size or elastic between a minimum and a maximum number of workers. Tasks submitted from outside the pool go to a lock-free bounded MPMC queue,
+ * tasks submitted by a task go to the Chase-Lev deque of its worker: the worker runs them LIFO, idle workers steal them FIFO.
+ * Idle workers spin for a while, then park on a futex of their own. A submission only enters the system to wake a parked worker, and never while another worker is spinning.
+ * Each worker also has a mailbox, for the tasks submitted to it by tpool_submit_to, and a priority queue, for the tasks submitted by tpool_submit_prio.
+ * Priority queues are looked at first: a prioritized task only waits for the current task of a worker, whatever the number of queued tasks.
+ * An elastic pool starts a worker when the oldest task of the submission queue has waited longer than a threshold,
+ * and a worker parked for longer than a keep-alive leaves the pool, as long as the pool keeps its minimum.
+ * In NUMA mode the workers are spread over the nodes and pinned to their L3 domain, each node has its own submission queue:
+ * a task is submitted to the node of the caller unless told otherwise, and an idle worker robs its L3 domain, then its node, and only then the other nodes.
+ * A task that blocks marks it with tpool_begin_blocking and tpool_end_blocking, which mtx_lock, thrd_join, thrd_sleep and fut_wait do by themselves on a worker:
+ * a parked worker is woken up to take over the tasks it leaves behind, or if every worker is busy another one is started, up to the maximum of an elastic pool plus the spare workers.
+ */
+
+
+
+/**
+ * The type tpool_func_t is the function of a task, invoked as func(arg) on a worker
+ */
+typedef void (*tpool_func_t)(void*);
+
+
+
+/**
+ * Pool, see tpool.c
+ */
+typedef struct tpool* tpool_t;
+
+
+
+/**
+ * Task group, a set of tasks to wait for together, see tpool_group_init. Lives wherever its owner wants, typically on the stack of the waiting task
+ *
+ * pool			pool the tasks of the group are submitted to
+ * pending		number of tasks of the group not completed yet, with a bit telling that a thread sleeps on it
+ */
+typedef struct {
+	tpool_t pool;
+	atomic_int pending;
+} tpool_group_t;
+
+
+
+/**
+ * Pool attributes enum, flags telling which fields of tpool_attr_t have been set
+ *
+ * tpool_attr_workers	workers has been set
+ * tpool_attr_capacity	capacity has been set
+ * tpool_attr_thread	thread has been set
+ * tpool_attr_order		order has been set
+ * tpool_attr_aging		aging has been set
+ * tpool_attr_elastic	minimum has been set, workers is then the maximum
+ * tpool_attr_keepalive	keepalive has been set
+ * tpool_attr_threshold	threshold has been set
+ * tpool_attr_numa		numa has been set
+ * tpool_attr_blocking	spare has been set
+ */
+enum {
+	tpool_attr_workers   = 1 << 0,
+	tpool_attr_capacity  = 1 << 1,
+	tpool_attr_thread    = 1 << 2,
+	tpool_attr_order     = 1 << 3,
+	tpool_attr_aging     = 1 << 4,
+	tpool_attr_elastic   = 1 << 5,
+	tpool_attr_keepalive = 1 << 6,
+	tpool_attr_threshold = 1 << 7,
+	tpool_attr_numa      = 1 << 8,
+	tpool_attr_blocking  = 1 << 9
+};
+
+
+
+/**
+ * Priority queue order enum, used by tpool_attr_setorder
+ *
+ * tpool_order_priority		highest priority first. With aging, a task is run as if it was submitted priority * aging nanoseconds earlier,
+ *							so a task waits at most (difference of priorities) * aging for the tasks of higher priority submitted after it
+ * tpool_order_deadline		earliest deadline first, priority breaks ties. With aging, a task without deadline gets one aging nanoseconds after its submission,
+ *							without aging it runs after every task with a deadline
+ */
+enum {
+	tpool_order_priority,
+	tpool_order_deadline
+};
+
+
+
+/**
+ * Pool attributes used by tpool_create, must be initialized with tpool_attr_init and filled with the tpool_attr_set* functions
+ * TPOOL_CAPACITY is the default number of tasks the submission queue can hold
+ * TPOOL_AGING is the default aging of the priority queues in nanoseconds, the starvation guard of low priority tasks
+ * TPOOL_KEEPALIVE is the default time in nanoseconds a worker of an elastic pool stays parked before it leaves the pool
+ * TPOOL_THRESHOLD is the default time in nanoseconds a task may wait in the submission queue of an elastic pool before a worker is started
+ * TPOOL_STACK is the default stack size of the workers of an elastic pool
+ * TPOOL_TASK_SIZE is the size of the task descriptors served from the caches of the pool by tpool_task_alloc
+ */
+#define TPOOL_CAPACITY 1024
+#define TPOOL_AGING 10000000LL
+#define TPOOL_KEEPALIVE 60000000000LL
+#define TPOOL_THRESHOLD 1000000LL
+#define TPOOL_STACK (256 * 1024)
+#define TPOOL_TASK_SIZE 48
+
+typedef struct {
+	unsigned int flags;
+	unsigned int workers;
+	unsigned int capacity;
+	thrd_attr_t thread;
+	int order;
+	long long aging;
+	unsigned int minimum;
+	long long keepalive;
+	long long threshold;
+	int numa;
+	unsigned int spare;
+} tpool_attr_t;
+
+
+
+/**
+ * Statistics of the priority queues of a pool, see tpool_stats
+ *
+ * prioritized		number of tasks run from the priority queues
+ * deadlines		number of those tasks that had a deadline
+ * misses			number of tasks completed after their deadline
+ * late				number of tasks started after their deadline
+ * aged				number of tasks run before a task of higher priority of the same queue, thanks to the aging
+ * waited			total time spent in the priority queues, in nanoseconds
+ * waited_max		longest time spent in a priority queue, in nanoseconds
+ */
+typedef struct {
+	unsigned long long prioritized;
+	unsigned long long deadlines;
+	unsigned long long misses;
+	unsigned long long late;
+	unsigned long long aged;
+	unsigned long long waited;
+	unsigned long long waited_max;
+} tpool_stats_t;
+
+
+
+/**
+ * Initializes attr with default values: one worker per CPU the process can use, see thrd_hardware_concurrency, and a queue of TPOOL_CAPACITY tasks.
+ *
+ * @param attr			pointer to the attributes to initialize
+ */
+void tpool_attr_init(__OUT__ tpool_attr_t* attr);
+
+
+
+/**
+ * Sets the number of workers of the pool.
+ *
+ * @param attr			pointer to the attributes
+ * @param workers		number of workers, at least 1
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_attr_setworkers(__INOUT__ tpool_attr_t* attr, unsigned int workers);
+
+
+
+/**
+ * Sets the number of tasks the submission queue can hold, rounded up to a power of two.
+ *
+ * @param attr			pointer to the attributes
+ * @param capacity		capacity of the queue, at least 2
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_attr_setcapacity(__INOUT__ tpool_attr_t* attr, unsigned int capacity);
+
+
+
+/**
+ * Sets the attributes the worker threads are created with, see thrd_create_ex. Workers are named "tpool" unless thread sets a name.
+ *
+ * @param attr			pointer to the attributes
+ * @param thread		pointer to the thread attributes, copied
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_attr_setthread(__INOUT__ tpool_attr_t* attr, const thrd_attr_t* thread);
+
+
+
+/**
+ * Sets the order of the priority queues of the pool, tpool_order_priority by default.
+ *
+ * @param attr			pointer to the attributes
+ * @param order			tpool_order_priority or tpool_order_deadline
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_attr_setorder(__INOUT__ tpool_attr_t* attr, int order);
+
+
+
+/**
+ * Sets the aging of the priority queues of the pool, TPOOL_AGING by default: the starvation guard of the tasks of low priority or without deadline.
+ *
+ * @param attr			pointer to the attributes
+ * @param aging			aging in nanoseconds, at most one second, 0 for a strict order
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_attr_setaging(__INOUT__ tpool_attr_t* attr, long long aging);
+
+
+
+/**
+ * Makes the pool elastic: it starts with minimum workers and grows up to maximum ones. Its workers get a stack of TPOOL_STACK bytes,
+ * unless tpool_attr_setthread sets a stack size.
+ *
+ * @param attr			pointer to the attributes
+ * @param minimum		number of workers always running, at least 1
+ * @param maximum		largest number of workers, at least minimum
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_attr_setelastic(__INOUT__ tpool_attr_t* attr, unsigned int minimum, unsigned int maximum);
+
+
+
+/**
+ * Sets how long a worker of an elastic pool stays parked before it leaves the pool, TPOOL_KEEPALIVE by default.
+ * A worker also stays for a keep-alive after the last start of a worker, so that the pool does not shrink right after a spike.
+ *
+ * @param attr			pointer to the attributes
+ * @param keepalive		keep-alive in nanoseconds, at least 1
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_attr_setkeepalive(__INOUT__ tpool_attr_t* attr, long long keepalive);
+
+
+
+/**
+ * Sets how long the oldest task of the submission queue of an elastic pool may wait before a worker is started, TPOOL_THRESHOLD by default.
+ * At most one worker is started per threshold, so that a spike does not start every worker at once.
+ *
+ * @param attr			pointer to the attributes
+ * @param threshold		threshold in nanoseconds, at least 1
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_attr_setthreshold(__INOUT__ tpool_attr_t* attr, long long threshold);
+
+
+
+/**
+ * Enables the NUMA mode: workers are placed with topo_scatter over the CPUs the process is allowed to run on, so that they spread over the packages
+ * and L3 domains, then each one is pinned to the allowed CPUs of its L3 domain within its node, with its stack allocated on its node.
+ * The affinity and the node of the thread attributes are replaced. Each node of the workers has its own submission queue, of the capacity of the pool.
+ * On a machine with a single node, the mode still pins the workers by L3 domain and has them steal from their own domain first.
+ *
+ * @param attr			pointer to the attributes
+ * @param numa			non-zero to enable the NUMA mode
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_attr_setnuma(__INOUT__ tpool_attr_t* attr, int numa);
+
+
+
+/**
+ * Sets the number of spare workers, 0 by default: workers started while workers are blocked in a blocking region, so that the pool keeps its number of workers running tasks.
+ * Spare workers take the slots after the workers, see tpool_slots, and leave the pool after a keep-alive once they are not needed any more.
+ * An elastic pool also starts its own workers up to its maximum for the blocked ones, spare workers go beyond.
+ *
+ * @param attr			pointer to the attributes
+ * @param spare			largest number of spare workers running at once
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_attr_setblocking(__INOUT__ tpool_attr_t* attr, unsigned int spare);
+
+
+
+/**
+ * Creates a pool and starts its workers.
+ *
+ * @param pool			pointer to memory location to put the identifier of the new pool
+ * @param attr			attributes of the pool, NULL for defaults
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int tpool_create(__OUT__ tpool_t* pool, const tpool_attr_t* attr);
+
+
+
+/**
+ * Submits a task, invoked as func(arg) by a worker. Tasks submitted from outside the pool are dequeued in submission order,
+ * tasks submitted by a task of the pool are pushed to the deque of its worker without any read-modify-write, and run last in first out.
+ * If the queue is full, the caller waits for room. In NUMA mode, a task submitted from outside the pool goes to the queue of the node the caller runs on.
+ *
+ * @param pool			identifier of the pool
+ * @param func			function of the task
+ * @param arg			argument to pass to the function
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_submit(tpool_t pool, tpool_func_t func, void* arg);
+
+
+
+/**
+ * Same as tpool_submit, but returns immediately if the queue is full.
+ *
+ * @param pool			identifier of the pool
+ * @param func			function of the task
+ * @param arg			argument to pass to the function
+ * @return				thrd_success if successful, thrd_busy if the queue is full, thrd_error otherwise.
+ */
+int tpool_trysubmit(tpool_t pool, tpool_func_t func, void* arg);
+
+
+
+/**
+ * Same as tpool_submit, but the task goes to the submission queue of a given NUMA node, next to the data it works on.
+ * A task of the pool submitting to its own node pushes to its deque as with tpool_submit. A node without worker, or a pool without NUMA mode, ignores the hint.
+ *
+ * @param pool			identifier of the pool
+ * @param node			NUMA node id, see topology.h, -1 for the node of the calling thread
+ * @param func			function of the task
+ * @param arg			argument to pass to the function
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_submit_node(tpool_t pool, int node, tpool_func_t func, void* arg);
+
+
+
+/**
+ * Submits a task to the mailbox of a given worker: only that worker runs it, and it is woken up for it even if others are spinning.
+ * Used to keep the same data on the same worker across submissions. If the mailbox is full, the task is submitted as with tpool_submit.
+ * In an elastic pool, the other workers take the tasks of the mailbox of a worker that is not running.
+ *
+ * @param pool			identifier of the pool
+ * @param worker		index of the worker, lower than tpool_size(pool)
+ * @param func			function of the task
+ * @param arg			argument to pass to the function
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_submit_to(tpool_t pool, unsigned int worker, tpool_func_t func, void* arg);
+
+
+
+/**
+ * Submits a task to the priority queues, invoked as func(arg) by a worker. Spawned from a worker, the task goes to its own queue,
+ * otherwise the queues are taken in turn. Workers take the task with the best key over all the queues, before any task of tpool_submit.
+ *
+ * @param pool			identifier of the pool
+ * @param priority		priority of the task, higher first, 0 is neutral
+ * @param deadline		absolute TIME_UTC deadline of the task, or NULL. Ordered by in tpool_order_deadline, counted in the statistics in both orders
+ * @param func			function of the task
+ * @param arg			argument to pass to the function
+ * @return				thrd_success if successful. Otherwise returns thrd_nomem if there was insufficient amount of memory or thrd_error if another error occurred.
+ */
+int tpool_submit_prio(tpool_t pool, int priority, const struct timespec* deadline, tpool_func_t func, void* arg);
+
+
+
+/**
+ * Reads the statistics of the priority queues of the pool, summed over the workers.
+ *
+ * @param pool			identifier of the pool
+ * @param stats			pointer to memory location to put the statistics
+ */
+void tpool_stats(tpool_t pool, __OUT__ tpool_stats_t* stats);
+
+
+
+/**
+ * Runs one pending task of the pool on the calling thread, if it is a worker of the pool. Lets a task wait for the tasks it submitted without blocking its worker.
+ *
+ * @param pool			identifier of the pool
+ * @return				1 if a task has been run, 0 if there was none or the caller is not a worker of the pool.
+ */
+int tpool_help(tpool_t pool);
+
+
+
+/**
+ * Tells whether the pool is short of tasks: from a worker, its deque has been emptied by the thieves,
+ * from outside, the submission queue is empty while a worker is looking for a task. Meant for lazy splitting of work, the answer is only a hint.
+ *
+ * @param pool			identifier of the pool
+ * @return				nonzero if a new task would likely be picked up soon, 0 otherwise.
+ */
+int tpool_demand(tpool_t pool);
+
+
+
+/**
+ * Returns the index of the calling worker in the pool.
+ *
+ * @param pool			identifier of the pool
+ * @return				index of the worker, -1 if the caller is not a worker of the pool.
+ */
+int tpool_worker_index(tpool_t pool);
+
+
+
+/**
+ * Blocks until every task submitted to the pool has completed, including the tasks they submit.
+ * Must not be called from a task of the pool.
+ *
+ * @param pool			identifier of the pool
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_wait(tpool_t pool);
+
+
+
+/**
+ * Returns the number of workers of the pool, the maximum for an elastic pool. Spare workers are not counted, see tpool_slots.
+ *
+ * @param pool			identifier of the pool
+ * @return				number of workers
+ */
+unsigned int tpool_size(tpool_t pool);
+
+
+
+/**
+ * Returns the number of worker slots of the pool: its workers, plus its spare workers. Indices returned by tpool_worker_index are lower than it.
+ *
+ * @param pool			identifier of the pool
+ * @return				number of worker slots
+ */
+unsigned int tpool_slots(tpool_t pool);
+
+
+
+/**
+ * Returns the number of workers currently running, between the minimum and the maximum for an elastic pool, plus the spare workers running.
+ *
+ * @param pool			identifier of the pool
+ * @return				number of running workers
+ */
+unsigned int tpool_live(tpool_t pool);
+
+
+
+/**
+ * Tells the pool of the calling worker that its task is about to block, on a lock, an I/O or another task. Does nothing outside a worker.
+ * A parked worker is woken up if tasks wait in the deque of the worker or in the queues, otherwise if no worker is idle, a worker is started
+ * in an elastic pool below its maximum, or a spare worker. The tasks of the mailbox of the worker wait for it.
+ * Blocking regions nest, only the outermost one counts. The library calls it on a worker when mtx_lock, thrd_join, thrd_join_timed, thrd_join_any,
+ * thrd_sleep, fut_wait or fut_wait_timed are about to block, see thrd_set_blocking_hook.
+ */
+void tpool_begin_blocking(void);
+
+
+
+/**
+ * Ends the blocking region started by tpool_begin_blocking. The workers started for it park, and spare ones leave the pool after a keep-alive.
+ */
+void tpool_end_blocking(void);
+
+
+
+/**
+ * Allocates a task descriptor: the function, the argument and the small captures of a task submitted to the pool.
+ * Descriptors of up to TPOOL_TASK_SIZE bytes are blocks of a cache of the calling worker, or of a cache shared under a spin lock by the threads outside the pool.
+ * Caches grow by slabs and never shrink: once warm, allocating and freeing descriptors does not call malloc.
+ *
+ * @param pool			identifier of the pool the task is submitted to
+ * @param size			size of the descriptor, a larger one than TPOOL_TASK_SIZE is allocated with malloc
+ * @return				pointer to the descriptor, aligned for any type, NULL if there was insufficient amount of memory.
+ */
+void* tpool_task_alloc(tpool_t pool, size_t size);
+
+
+
+/**
+ * Releases a task descriptor of tpool_task_alloc, from any thread, before the pool is destroyed. A block freed by its worker goes back to its free list,
+ * the blocks a worker frees for another one are returned together through a lock-free list, the owner takes them all at once when its free list is empty.
+ *
+ * @param task			pointer to the descriptor, or NULL
+ */
+void tpool_task_free(void* task);
+
+
+
+/**
+ * Returns the pool shared by the library, created with default attributes and a spare worker per worker by the first call, never destroyed.
+ *
+ * @return				identifier of the shared pool, NULL if it could not be created.
+ */
+tpool_t tpool_shared(void);
+
+
+
+/**
+ * Initializes an empty task group.
+ *
+ * @param group			pointer to the group to initialize
+ * @param pool			identifier of the pool running the tasks of the group, NULL for the shared pool
+ */
+void tpool_group_init(__OUT__ tpool_group_t* group, tpool_t pool);
+
+
+
+/**
+ * Submits a task of the group, invoked as func(arg) by a worker. Spawned from a worker, the task goes to its deque.
+ * The task is run by the calling thread if there is no pool, or insufficient amount of memory.
+ *
+ * @param group			pointer to the group
+ * @param func			function of the task
+ * @param arg			argument to pass to the function
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_group_spawn(__INOUT__ tpool_group_t* group, tpool_func_t func, void* arg);
+
+
+
+/**
+ * Counts count more tasks in the group, for tasks submitted by other means than tpool_group_spawn. Each of them must call tpool_group_done once complete.
+ * Must be called before the tasks are submitted, by a thread that already waits for the group or holds one of its tasks.
+ *
+ * @param group			pointer to the group
+ * @param count			number of tasks
+ */
+void tpool_group_add(__INOUT__ tpool_group_t* group, int count);
+
+
+
+/**
+ * Counts a task of the group as completed. The group may be gone as soon as this returns.
+ *
+ * @param group			pointer to the group
+ */
+void tpool_group_done(__INOUT__ tpool_group_t* group);
+
+
+
+/**
+ * Blocks until every task of the group has completed, including the ones they spawn in the group meanwhile.
+ * Called from a worker of the pool, the worker runs pending tasks, its own ones first, then stolen ones, instead of sleeping:
+ * nested groups keep every worker busy and never need more threads.
+ *
+ * @param group			pointer to the group
+ * @return				thrd_success if successful, thrd_error otherwise.
+ */
+int tpool_group_wait(__INOUT__ tpool_group_t* group);
+
+
+
+/**
+ * Waits for the submitted tasks to complete, then stops and joins the workers and releases the pool.
+ * Must not be called from a task of the pool.
+ *
+ * @param pool			identifier of the pool to destroy
+ */
+void tpool_destroy(tpool_t pool);
+
+#endif /* C11_THREADS_TPOOL_HEADER */